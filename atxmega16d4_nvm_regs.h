@@ -44,9 +44,25 @@
 #define XNVM_CALIBRATION_BASE          0x008E0200 //!< Address where calibration row starts.
 #define XNVM_SIGNATURE_BASE            0x008E0400 //!< Address where signature bytes start.
 
-#define XNVM_FLASH_PAGE_SIZE			512			//
+#define XNVM_FLASH_PAGE_SIZE            0x0100 //!< Flash page size (128 words).
+
+#define XNVM_APPL_SIZE                  0x4000 //!< Application section size.
+#define XNVM_BOOT_BASE (XNVM_FLASH_BASE + XNVM_APPL_SIZE) //!< Address where boot section starts.
+#define XNVM_BOOT_SIZE                  0x1000 //!< Boot section size.
+#define XNVM_FLASH_SIZE (XNVM_APPL_SIZE + XNVM_BOOT_SIZE) //!< Whole flash size.
+#define XNVM_EEPROM_SIZE                0x0400 //!< EEPROM size.
+#define XNVM_USER_SIGN_SIZE             0x0100 //!< User signature row size.
+#define XNVM_CALIBRATION_SIZE           0x0040 //!< Calibration row size.
+#define XNVM_FUSE_SIZE                  8      //!< Fuse bytes, lock bits included.
+#define XNVM_SRAM_START                 0x2000 //!< Data space address of the internal SRAM.
+#define XNVM_SRAM_SIZE                  0x0800 //!< Internal SRAM size.
+
+#define XNVM_DEVID0                     0x1E   //!< Device signature, Atmel.
+#define XNVM_DEVID1                     0x94   //!< Device signature, 16 KB flash.
+#define XNVM_DEVID2                     0x42   //!< Device signature, ATxmega16D4.
 
 #define XNVM_CONTROLLER_BASE 0x01C0               //!< NVM Controller register base address.
+#define XNVM_CONTROLLER_DATA_REG_OFFSET 0x04      //!< NVM Controller Data Register (DATA0-2) offset.
 #define XNVM_CONTROLLER_CMD_REG_OFFSET 0x0A       //!< NVM Controller Command Register offset.
 #define XNVM_CONTROLLER_STATUS_REG_OFFSET 0x0F    //!< NVM Controller Status Register offset.
 #define XNVM_CONTROLLER_CTRLA_REG_OFFSET 0x0B     //!< NVM Controller Control Register A offset.
@@ -67,7 +83,17 @@
 #define NVM_MCU_CONTROL   0x90                    //!< MCU Control base address.
 
 #define NVM_COMMAND_BUFFER_SIZE 20                //!< NVM Command buffer size.
-#define WAIT_RETRIES_NUM 1000                     //!< Retry Number.
 #define DUMMY_BYTE 0x55                           //!< Dummy byte for Dummy writing.
+#define XNVM_ATTEMPTS 3                           //!< Attempts per instruction group.
+
+/*
+ * Default time budgets, in microseconds. Datasheet figures are 8 ms for a
+ * flash/EEPROM page erase and write and 40 ms for a chip erase; the PDI guard
+ * time is at most 128 bits, 1.28 ms at 100 kHz.
+ */
+#define XNVM_TIMEOUT_BYTE_US  2000                //!< Start of a response byte.
+#define XNVM_TIMEOUT_NVMEN_US 5000                //!< NVM enable after KEY.
+#define XNVM_TIMEOUT_BUSY_US  20000               //!< Page erase and write.
+#define XNVM_TIMEOUT_ERASE_US 100000              //!< Chip erase.
 
 #endif
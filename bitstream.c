@@ -0,0 +1,399 @@
+/**
+ * PDI bitstream compiler.
+ *
+ * Compiles NVM operations into a sequence CMD_SEQUENCE replays: every frame
+ * is encoded here, with its start, parity and stop bits, and so are the
+ * idle bits ahead of each instruction group, the same ones pdi_write()
+ * sends. The PRU is left with clocking bits out and checking the response
+ * bytes at the points marked for it.
+ *
+ * The instruction groups are those of xmega_pdi_nvm.c, in the same order.
+ * What the firmware does not get from a sequence is its retries: a failed
+ * check stops the sequence and the host decides what to do.
+ *
+ * Copyright (C) 2015-2017 Toby Churchill Ltd.
+ *
+ * Enric Balletbo Serra <enric.balletbo@collabora.com>
+ *
+ * License
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+#include <errno.h>
+
+#include "bitstream.h"
+#include "xmega_pdi_nvm.h"
+#include "atxmega16d4_nvm_regs.h"
+
+#define FRAME_BITS	12
+#define IDLE_BITS	16	/* the two BREAK bytes of pdi_write() */
+#define RUN_BITS_MAX	0xFFFF
+
+#define NVM_REG(reg)	(XNVM_DATA_BASE + XNVM_CONTROLLER_BASE + (reg))
+
+static void bs_word(struct bitstream *bs, uint32_t word)
+{
+	if (bs->nwords == bs->size) {
+		bs->error = ENOSPC;
+		return;
+	}
+	bs->words[bs->nwords++] = word;
+}
+
+static void bs_close(struct bitstream *bs)
+{
+	bs->run = -1;
+}
+
+/**
+ * \brief Append up to 32 bits to the open run, opening a TX if needed.
+ *
+ * TX runs are split where their bit or frame counts would overflow, the
+ * PRU sends them back to back anyway.
+ */
+static void bs_bits(struct bitstream *bs, uint32_t bits, unsigned int n,
+		    unsigned int frames)
+{
+	uint32_t *op;
+	unsigned int used, shift;
+
+	if (bs->error)
+		return;
+
+	if (bs->run >= 0) {
+		op = &bs->words[bs->run];
+		if (SEQ_OP(*op) == SEQ_TX &&
+		    (SEQ_BITS(*op) + n > RUN_BITS_MAX ||
+		     SEQ_TX_FRAMES(*op) + frames > SEQ_TX_FRAMES_MAX))
+			bs_close(bs);
+	}
+
+	if (bs->run < 0) {
+		bs_word(bs, SEQ_WORD(SEQ_TX, 0));
+		if (bs->error)
+			return;
+		bs->run = bs->nwords - 1;
+	}
+
+	if (n < 32)
+		bits &= (1u << n) - 1;
+
+	op = &bs->words[bs->run];
+	used = SEQ_BITS(*op);
+	shift = used % 32;
+
+	if (shift == 0) {
+		bs_word(bs, bits);
+	} else {
+		bs->words[bs->nwords - 1] |= bits << shift;
+		if (shift + n > 32)
+			bs_word(bs, bits >> (32 - shift));
+	}
+	if (bs->error)
+		return;
+
+	*op += n + (frames << 16);
+}
+
+static void bs_frame(struct bitstream *bs, uint8_t data)
+{
+	uint32_t parity = data;
+
+	parity ^= parity >> 4;
+	parity ^= parity >> 2;
+	parity ^= parity >> 1;
+
+	bs_bits(bs, (uint32_t)data << 1 | (parity & 1) << 9 | 3 << 10,
+		FRAME_BITS, 1);
+}
+
+/**
+ * \brief An instruction group, as one pdi_write() would send it.
+ */
+static void bs_group(struct bitstream *bs, const uint8_t *data, size_t length)
+{
+	size_t i;
+
+	bs_bits(bs, 0xFFFF, IDLE_BITS, 0);
+	for (i = 0; i < length; i++)
+		bs_frame(bs, data[i]);
+}
+
+/**
+ * \brief Read a response byte, the sequence stops unless it passes.
+ */
+static void bs_rx(struct bitstream *bs, uint8_t expect, uint8_t mask)
+{
+	bs_close(bs);
+	bs_word(bs, SEQ_WORD(SEQ_RX, 1));
+	bs_word(bs, SEQ_CHECK(expect, mask));
+}
+
+/**
+ * \brief Send a one byte request until its response passes.
+ */
+static void bs_poll(struct bitstream *bs, unsigned int budget,
+		    const uint8_t *request, size_t length,
+		    uint8_t expect, uint8_t mask)
+{
+	bs_close(bs);
+	bs_word(bs, SEQ_WORD(SEQ_POLL, budget << 24));
+	if (bs->error)
+		return;
+
+	bs->run = bs->nwords - 1;
+	bs_group(bs, request, length);
+	bs_close(bs);
+
+	bs_word(bs, SEQ_CHECK(expect, mask));
+}
+
+static void bs_page(struct bitstream *bs, int erased)
+{
+	bs_close(bs);
+	bs_word(bs, SEQ_WORD(SEQ_PAGE, erased ? SEQ_PAGE_ERASED : 0));
+}
+
+static void put_le32(uint8_t *p, uint32_t value)
+{
+	p[0] = value;
+	p[1] = value >> 8;
+	p[2] = value >> 16;
+	p[3] = value >> 24;
+}
+
+/* See xnvm_iowrite_byte() */
+static void bs_sts(struct bitstream *bs, uint32_t address, uint8_t value)
+{
+	uint8_t cmd[6];
+
+	cmd[0] = XNVM_PDI_STS_INSTR | XNVM_PDI_LONG_ADDRESS_MASK |
+		 XNVM_PDI_BYTE_DATA_MASK;
+	put_le32(&cmd[1], address);
+	cmd[5] = value;
+	bs_group(bs, cmd, sizeof(cmd));
+}
+
+/* See xnvm_st_ptr() */
+static void bs_st_ptr(struct bitstream *bs, uint32_t address)
+{
+	uint8_t cmd[5];
+
+	cmd[0] = XNVM_PDI_ST_INSTR | XNVM_PDI_LD_PTR_ADDRESS_MASK |
+		 XNVM_PDI_LONG_DATA_MASK;
+	put_le32(&cmd[1], address);
+	bs_group(bs, cmd, sizeof(cmd));
+}
+
+/* See xnvm_st_star_ptr_postinc() */
+static void bs_st_inc(struct bitstream *bs, uint8_t value)
+{
+	uint8_t cmd[2];
+
+	cmd[0] = XNVM_PDI_ST_INSTR | XNVM_PDI_LD_PTR_STAR_INC_MASK |
+		 XNVM_PDI_BYTE_DATA_MASK;
+	cmd[1] = value;
+	bs_group(bs, cmd, sizeof(cmd));
+}
+
+static void bs_nvm_cmd(struct bitstream *bs, uint8_t cmd_id)
+{
+	bs_sts(bs, NVM_REG(XNVM_CONTROLLER_CMD_REG_OFFSET), cmd_id);
+}
+
+static void bs_cmdex(struct bitstream *bs)
+{
+	bs_sts(bs, NVM_REG(XNVM_CONTROLLER_CTRLA_REG_OFFSET),
+	       XNVM_CTRLA_CMDEX);
+}
+
+/* See xnvm_confirm() */
+static void bs_confirm(struct bitstream *bs)
+{
+	static const uint8_t ldcs = XNVM_PDI_LDCS_INSTR |
+				    XOCD_STATUS_REGISTER_ADDRESS;
+
+	bs_group(bs, &ldcs, 1);
+	bs_rx(bs, XNVM_NVMEN, XNVM_NVMEN);
+}
+
+/* See xnvm_ctrl_wait_nvmbusy() */
+static void bs_wait_busy(struct bitstream *bs, unsigned int budget)
+{
+	uint8_t cmd[5];
+
+	cmd[0] = XNVM_PDI_LDS_INSTR | XNVM_PDI_LONG_ADDRESS_MASK |
+		 XNVM_PDI_BYTE_DATA_MASK;
+	put_le32(&cmd[1], NVM_REG(XNVM_CONTROLLER_STATUS_REG_OFFSET));
+	bs_poll(bs, budget, cmd, sizeof(cmd), 0, XNVM_NVM_BUSY);
+}
+
+/* See xnvm_wait_for_nvmen() */
+static void bs_wait_nvmen(struct bitstream *bs, unsigned int budget)
+{
+	static const uint8_t ldcs = XNVM_PDI_LDCS_INSTR |
+				    XOCD_STATUS_REGISTER_ADDRESS;
+
+	bs_poll(bs, budget, &ldcs, 1, XNVM_NVMEN, XNVM_NVMEN);
+}
+
+/* See xnvm_erase_at() */
+static void bs_erase_at(struct bitstream *bs, uint8_t cmd_id,
+			uint32_t address, unsigned int budget)
+{
+	bs_nvm_cmd(bs, cmd_id);
+	bs_st_ptr(bs, address);
+	bs_st_inc(bs, DUMMY_BYTE);
+	bs_confirm(bs);
+	bs_wait_busy(bs, budget);
+}
+
+/* See xnvm_load_flash_page_buffer() */
+static void bs_load_page(struct bitstream *bs, uint32_t address,
+			 const uint8_t *data, size_t length)
+{
+	static const uint8_t st_inc = XNVM_PDI_ST_INSTR |
+				      XNVM_PDI_LD_PTR_STAR_INC_MASK |
+				      XNVM_PDI_BYTE_DATA_MASK;
+	uint8_t repeat[2];
+
+	bs_nvm_cmd(bs, XNVM_CMD_LOAD_FLASH_PAGE_BUFFER);
+	bs_st_ptr(bs, address);
+
+	repeat[0] = XNVM_PDI_REPEAT_INSTR | XNVM_PDI_BYTE_DATA_MASK;
+	repeat[1] = length - 1;
+	bs_group(bs, repeat, sizeof(repeat));
+	bs_group(bs, &st_inc, 1);
+	bs_group(bs, data, length);
+}
+
+/* See xnvm_start_flash_page() and xnvm_wait_flash_page() */
+static void bs_write_page(struct bitstream *bs, uint32_t address,
+			  const uint8_t *data, size_t length, int erase)
+{
+	uint8_t cmd_id;
+
+	if (address >= XNVM_APPL_SIZE)
+		cmd_id = erase ? XNVM_CMD_ERASE_AND_WRITE_BOOT_PAGE :
+			XNVM_CMD_WRITE_BOOT_PAGE;
+	else
+		cmd_id = erase ? XNVM_CMD_ERASE_AND_WRITE_APP_SECTION :
+			XNVM_CMD_WRITE_APP_SECTION;
+
+	address += XNVM_FLASH_BASE;
+
+	/* xnvm_erase_flash_buffer() */
+	bs_st_ptr(bs, 0);
+	bs_nvm_cmd(bs, XNVM_CMD_ERASE_FLASH_PAGE_BUFFER);
+	bs_cmdex(bs);
+	bs_wait_busy(bs, SEQ_BUDGET_BUSY);
+
+	bs_load_page(bs, address, data, length);
+	bs_erase_at(bs, cmd_id, address, SEQ_BUDGET_BUSY);
+	bs_page(bs, 0);
+}
+
+/* See xnvm_start_erase_flash_page() and xnvm_wait_flash_page() */
+static void bs_erase_page(struct bitstream *bs, uint32_t address)
+{
+	uint8_t cmd_id;
+
+	cmd_id = address >= XNVM_APPL_SIZE ? XNVM_CMD_ERASE_BOOT_PAGE :
+		XNVM_CMD_ERASE_APP_PAGE;
+
+	bs_erase_at(bs, cmd_id, address + XNVM_FLASH_BASE, SEQ_BUDGET_BUSY);
+	bs_page(bs, 1);
+}
+
+static int bs_status(struct bitstream *bs)
+{
+	if (bs->error) {
+		errno = bs->error;
+		return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * \brief Start compiling a sequence into a buffer.
+ *
+ * \param buf where the sequence goes, 32-bit aligned.
+ * \param size its size in bytes.
+ */
+void bitstream_init(struct bitstream *bs, void *buf, size_t size)
+{
+	bs->words = buf;
+	bs->size = size / 4;
+	bs->nwords = 0;
+	bs->run = -1;
+	bs->error = 0;
+}
+
+/**
+ * \brief Compile the erase CMD_ERASE does for an area.
+ *
+ * \retval 0 on success, -1 with errno set to ENOSPC or EINVAL otherwise.
+ */
+int bitstream_erase(struct bitstream *bs, enum nvm_area area)
+{
+	switch (area) {
+	case AREA_APP:
+		bs_erase_at(bs, XNVM_CMD_ERASE_APP_SECTION, XNVM_APPL_BASE,
+			    SEQ_BUDGET_ERASE);
+		break;
+	case AREA_BOOT:
+		bs_erase_at(bs, XNVM_CMD_ERASE_BOOT_SECTION, XNVM_BOOT_BASE,
+			    SEQ_BUDGET_ERASE);
+		break;
+	case AREA_CHIP:
+		/* See xnvm_chip_erase() */
+		bs_nvm_cmd(bs, XNVM_CMD_CHIP_ERASE);
+		bs_cmdex(bs);
+		bs_wait_nvmen(bs, SEQ_BUDGET_ERASE);
+		break;
+	default:
+		errno = EINVAL;
+		return -1;
+	}
+
+	return bs_status(bs);
+}
+
+/**
+ * \brief Compile the page erases and writes CMD_PROGRAM_IMAGE does for a
+ * stage, the stage as it is laid out in memory.
+ *
+ * \retval 0 on success, -1 with errno set to ENOSPC or EINVAL otherwise.
+ */
+int bitstream_stage(struct bitstream *bs, const struct stage_header *stage)
+{
+	const struct stage_page *map;
+	const uint8_t *payload;
+	uint32_t i;
+
+	if (stage->magic != STAGE_MAGIC ||
+	    stage->page_size != XNVM_FLASH_PAGE_SIZE) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	map = (const struct stage_page *)((const uint8_t *)stage +
+					  stage->map_offset);
+
+	for (i = 0; i < stage->npages && !bs->error; i++) {
+		if (map[i].flags & STAGE_PAGE_ERASE) {
+			bs_erase_page(bs, map[i].address);
+			continue;
+		}
+
+		payload = (const uint8_t *)stage + map[i].offset;
+		bs_write_page(bs, map[i].address, payload, stage->page_size,
+			      !(map[i].flags & STAGE_PAGE_WRITE));
+	}
+
+	return bs_status(bs);
+}
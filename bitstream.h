@@ -0,0 +1,41 @@
+/**
+ * PDI bitstream compiler, the host side of CMD_SEQUENCE.
+ *
+ * Copyright (C) 2015-2017 Toby Churchill Ltd.
+ *
+ * Enric Balletbo Serra <enric.balletbo@collabora.com>
+ *
+ * License
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+#ifndef BITSTREAM_H_INCLUDED
+#define BITSTREAM_H_INCLUDED
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "prog.h"
+
+/**
+ * \brief A sequence being compiled, see the CMD_SEQUENCE format in prog.h.
+ *
+ * Errors stick: once out of room every call fails, so a whole job can be
+ * compiled before checking.
+ */
+struct bitstream {
+	uint32_t *words;
+	size_t size;		/* room, in words */
+	size_t nwords;
+	long run;		/* open TX or POLL operation, -1 if none */
+	int error;		/* errno of the first failure */
+};
+
+void bitstream_init(struct bitstream *bs, void *buf, size_t size);
+int bitstream_erase(struct bitstream *bs, enum nvm_area area);
+int bitstream_stage(struct bitstream *bs, const struct stage_header *stage);
+
+#endif
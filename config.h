@@ -25,6 +25,24 @@
 #define PDI_DATA_PIN_O		15	/* GPO */
 #define PDI_TX_PIN_OE		5
 
+/*
+ * Data pins of the second channel, a target clocked by the same PDI_CLK
+ * as the first one. See PDI_CHANNELS.
+ */
+#define PDI1_DATA_PIN_I		7	/* GPI */
+#define PDI1_DATA_PIN_O		7	/* GPO */
+#define PDI1_TX_PIN_OE		6
+
+/*
+ * PDI pins of the shift PHY, fixed by the GP port serial modes. Writes to
+ * R30[15:0] load the shifter there, so no output enable can be driven:
+ * the data output goes to PDI_DATA through a series resistor the target
+ * overrides when it answers, and the input is taken straight off the line.
+ */
+#define PDI_SHIFT_CLK_PIN	1	/* GPO shift clock */
+#define PDI_SHIFT_DATA_PIN_O	0	/* GPO shift data */
+#define PDI_SHIFT_DATA_PIN_I	0	/* GPI shift data */
+
 /*
  * 200 MHz @ 5ns
  */
@@ -0,0 +1,41 @@
+/**
+ * CRC-16 (CCITT) shared by the host and the PRU.
+ *
+ * Copyright (C) 2015-2017 Toby Churchill Ltd.
+ *
+ * Enric Balletbo Serra <enric.balletbo@collabora.com>
+ *
+ * License
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+#ifndef CRC16_H_INCLUDED
+#define CRC16_H_INCLUDED
+
+#include <stdint.h>
+
+#define CRC16_INIT	0xFFFF
+
+/**
+ * \brief Update a CRC-16/CCITT (polynomial 0x1021) with a buffer.
+ *
+ * Bitwise on purpose, a lookup table does not fit in PRU data RAM.
+ */
+static inline uint16_t crc16_update(uint16_t crc, const uint8_t *buf,
+				    uint32_t length)
+{
+	uint8_t bit;
+
+	while (length--) {
+		crc ^= (uint16_t)*buf++ << 8;
+		for (bit = 0; bit < 8; bit++)
+			crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1;
+	}
+
+	return crc;
+}
+
+#endif
@@ -0,0 +1,208 @@
+/**
+ * Erase planning.
+ *
+ * Picks, for each flash section an image touches, the cheapest way to get
+ * it erased where needed: nothing if the section is blank already, page by
+ * page if few pages change, the whole section, or the whole chip. EEPROM is
+ * only ever lost to a chip erase, which must be allowed explicitly.
+ *
+ * Copyright (C) 2015-2017 Toby Churchill Ltd.
+ *
+ * Enric Balletbo Serra <enric.balletbo@collabora.com>
+ *
+ * License
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+#include <string.h>
+
+#include "erase.h"
+#include "atxmega16d4_nvm_regs.h"
+
+#define PAGE_SIZE	XNVM_FLASH_PAGE_SIZE
+
+/* flash offsets of the sections */
+static const struct {
+	uint32_t base;
+	uint32_t size;
+} sections[PLAN_SECTIONS] = {
+	{ 0, XNVM_APPL_SIZE },
+	{ XNVM_APPL_SIZE, XNVM_BOOT_SIZE },
+};
+
+static const char * const plan_names[] = {
+	[PLAN_UNTOUCHED]	= "untouched",
+	[PLAN_BLANK]		= "blank",
+	[PLAN_PAGES]		= "page erase",
+	[PLAN_SECTION]		= "section erase",
+	[PLAN_CHIP]		= "chip erase",
+};
+
+int page_is_blank(const uint8_t *page)
+{
+	const uint32_t *w = (const uint32_t *)page;
+	unsigned int i;
+
+	for (i = 0; i < PAGE_SIZE / 4; i++) {
+		if (w[i] != 0xFFFFFFFF)
+			return 0;
+	}
+
+	return 1;
+}
+
+/**
+ * \brief Copy a page of the image, padded with 0xFF past its end.
+ */
+void image_page(uint8_t *page, const uint8_t *image, size_t size,
+		uint32_t address)
+{
+	size_t len = 0;
+
+	if (address < size)
+		len = size - address < PAGE_SIZE ? size - address : PAGE_SIZE;
+
+	if (len)
+		memcpy(page, image + address, len);
+	memset(page + len, 0xFF, PAGE_SIZE - len);
+}
+
+/**
+ * \brief NVM CRC of a section that is blank, as CMD_SECTION_CRC returns it.
+ *
+ * The NVM controller runs the section through the CRC module, CRC-32
+ * (IEEE 802.3), and xnvm_section_crc() reads back the 24 bits of the NVM
+ * DATA register.
+ */
+uint32_t erase_blank_crc(unsigned int section)
+{
+	uint32_t crc = 0xFFFFFFFF;
+	uint32_t i;
+	uint8_t bit;
+
+	for (i = 0; i < sections[section].size; i++) {
+		crc ^= 0xFF;
+		for (bit = 0; bit < 8; bit++)
+			crc = (crc & 1) ? (crc >> 1) ^ 0xEDB88320 : crc >> 1;
+	}
+
+	return ~crc & 0xFFFFFF;
+}
+
+/**
+ * \brief Check whether an image of the given size reaches a section.
+ */
+int erase_section_covered(unsigned int section, size_t size)
+{
+	return sections[section].base < size;
+}
+
+const char *erase_plan_name(enum plan_erase erase)
+{
+	return plan_names[erase];
+}
+
+/**
+ * \brief Cost of programming a section after it has been erased.
+ */
+static uint32_t write_cost(unsigned int s, const uint8_t *image, size_t size)
+{
+	uint8_t page[PAGE_SIZE] __attribute__((aligned(4)));
+	uint32_t address, cost = 0;
+
+	for (address = sections[s].base;
+	     address < sections[s].base + sections[s].size && address < size;
+	     address += PAGE_SIZE) {
+		image_page(page, image, size, address);
+		if (!page_is_blank(page))
+			cost += PLAN_COST_PAGE_LOAD_US + PLAN_COST_PAGE_WRITE_US;
+	}
+
+	return cost;
+}
+
+/**
+ * \brief Cost of bringing a section to the image page by page.
+ */
+static uint32_t pages_cost(unsigned int s, const uint8_t *image, size_t size,
+			   const uint8_t *current)
+{
+	uint8_t page[PAGE_SIZE] __attribute__((aligned(4)));
+	uint32_t address, cost = 0;
+
+	for (address = sections[s].base;
+	     address < sections[s].base + sections[s].size;
+	     address += PAGE_SIZE) {
+		image_page(page, image, size, address);
+		if (!memcmp(page, current + address, PAGE_SIZE))
+			continue;
+
+		if (page_is_blank(page))
+			cost += PLAN_COST_PAGE_ERASE_US;
+		else
+			cost += PLAN_COST_PAGE_LOAD_US +
+				PLAN_COST_PAGE_ERASE_US +
+				PLAN_COST_PAGE_WRITE_US;
+	}
+
+	return cost;
+}
+
+/**
+ * \brief Plan the erases needed to program an image.
+ *
+ * The programmed flash must read back as the image, padded with 0xFF up to
+ * the end of the last section it reaches. Without the current contents a
+ * section that is not known to be blank can only be erased as a whole.
+ */
+void erase_plan(struct erase_plan *plan, const uint8_t *image, size_t size,
+		const uint8_t *current, const int *blank, int allow_chip)
+{
+	uint32_t cost, section_cost, chip_cost, write;
+	unsigned int s, covered = 0;
+
+	plan->end = 0;
+	plan->cost_us = 0;
+	chip_cost = PLAN_COST_CHIP_ERASE_US;
+
+	for (s = 0; s < PLAN_SECTIONS; s++) {
+		if (!erase_section_covered(s, size)) {
+			plan->erase[s] = PLAN_UNTOUCHED;
+			continue;
+		}
+		covered++;
+		plan->end = sections[s].base + sections[s].size;
+
+		write = write_cost(s, image, size);
+		chip_cost += write;
+
+		if (blank[s] == 1) {
+			plan->erase[s] = PLAN_BLANK;
+			plan->cost_us += write;
+			continue;
+		}
+
+		section_cost = PLAN_COST_SECTION_ERASE_US + write;
+		plan->erase[s] = PLAN_SECTION;
+		cost = section_cost;
+
+		if (current) {
+			cost = pages_cost(s, image, size, current);
+			if (cost < section_cost)
+				plan->erase[s] = PLAN_PAGES;
+			else
+				cost = section_cost;
+		}
+		plan->cost_us += cost;
+	}
+
+	/* a chip erase also takes the EEPROM, and every section with it */
+	if (allow_chip && covered == PLAN_SECTIONS && chip_cost < plan->cost_us) {
+		for (s = 0; s < PLAN_SECTIONS; s++)
+			plan->erase[s] = PLAN_CHIP;
+		plan->cost_us = chip_cost;
+	}
+}
@@ -0,0 +1,65 @@
+/**
+ * Erase planning.
+ *
+ * Copyright (C) 2015-2017 Toby Churchill Ltd.
+ *
+ * Enric Balletbo Serra <enric.balletbo@collabora.com>
+ *
+ * License
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+#ifndef ERASE_H_INCLUDED
+#define ERASE_H_INCLUDED
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* Flash sections, indexed by enum nvm_area (AREA_APP, AREA_BOOT) */
+#define PLAN_SECTIONS		2
+
+/*
+ * Rough cost of each operation, in microseconds. Only their ratios matter,
+ * they decide between the strategies and nothing else.
+ */
+#define PLAN_COST_PAGE_LOAD_US		3000	/* page over the PDI */
+#define PLAN_COST_PAGE_WRITE_US		2000
+#define PLAN_COST_PAGE_ERASE_US		2000
+#define PLAN_COST_SECTION_ERASE_US	20000
+#define PLAN_COST_CHIP_ERASE_US		30000
+
+enum plan_erase {
+	PLAN_UNTOUCHED,		/* outside the image, left alone */
+	PLAN_BLANK,		/* already erased, pages are only written */
+	PLAN_PAGES,		/* changed pages are erased one by one */
+	PLAN_SECTION,		/* section erase, then page writes */
+	PLAN_CHIP,		/* chip erase, then page writes */
+};
+
+/**
+ * \brief How each flash section gets erased for one image.
+ */
+struct erase_plan {
+	enum plan_erase erase[PLAN_SECTIONS];
+	uint32_t end;		/* end of the last section the image covers */
+	uint32_t cost_us;	/* estimated */
+};
+
+/*
+ * blank[] says, per section, whether it is erased (1), not erased (0) or
+ * unknown (-1). current is what the flash holds now, or NULL if unknown.
+ */
+void erase_plan(struct erase_plan *plan, const uint8_t *image, size_t size,
+		const uint8_t *current, const int *blank, int allow_chip);
+int erase_section_covered(unsigned int section, size_t size);
+uint32_t erase_blank_crc(unsigned int section);
+const char *erase_plan_name(enum plan_erase erase);
+
+int page_is_blank(const uint8_t *page);
+void image_page(uint8_t *page, const uint8_t *image, size_t size,
+		uint32_t address);
+
+#endif
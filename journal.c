@@ -0,0 +1,154 @@
+/**
+ * Programming progress journal.
+ *
+ * A single record, rewritten in place and flushed to disk every time the
+ * progress moves on, so that a job cut short by a signal, a crash or a
+ * target falling out of the fixture picks up where it stopped.
+ *
+ * Copyright (C) 2015-2017 Toby Churchill Ltd.
+ *
+ * Enric Balletbo Serra <enric.balletbo@collabora.com>
+ *
+ * License
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "journal.h"
+#include "crc16.h"
+
+static uint32_t journal_crc(const struct journal_record *rec)
+{
+	return crc16_update(CRC16_INIT, (const uint8_t *)rec,
+			    offsetof(struct journal_record, crc));
+}
+
+static int journal_sync(struct journal *j)
+{
+	ssize_t ret;
+
+	ret = pwrite(j->fd, &j->rec, sizeof(j->rec), 0);
+	if (ret < 0)
+		return -1;
+	if (ret != sizeof(j->rec)) {
+		errno = EIO;
+		return -1;
+	}
+
+	return fdatasync(j->fd);
+}
+
+/**
+ * \brief Open a journal file, created empty if it does not exist.
+ *
+ * A record that does not check out is taken as no progress at all.
+ *
+ * \retval 0 on success, -1 with errno set otherwise.
+ */
+int journal_open(struct journal *j, const char *path)
+{
+	ssize_t ret;
+
+	j->fd = open(path, O_RDWR | O_CREAT, 0644);
+	if (j->fd < 0)
+		return -1;
+
+	ret = pread(j->fd, &j->rec, sizeof(j->rec), 0);
+	if (ret < 0) {
+		close(j->fd);
+		return -1;
+	}
+
+	if (ret != sizeof(j->rec) || j->rec.magic != JOURNAL_MAGIC ||
+	    j->rec.version != JOURNAL_VERSION ||
+	    j->rec.crc != journal_crc(&j->rec))
+		memset(&j->rec, 0, sizeof(j->rec));
+
+	return 0;
+}
+
+void journal_close(struct journal *j)
+{
+	close(j->fd);
+}
+
+/**
+ * \brief 64-bit FNV-1a hash, of a plan for journal records.
+ */
+uint64_t journal_hash(const void *data, size_t size)
+{
+	const uint8_t *p = data;
+	uint64_t hash = 0xcbf29ce484222325ULL;
+
+	while (size--) {
+		hash ^= *p++;
+		hash *= 0x100000001b3ULL;
+	}
+
+	return hash;
+}
+
+/**
+ * \brief Look up the progress of a plan on a device.
+ *
+ * \retval 1 progress found, in op and page.
+ * \retval 0 the journal holds nothing for this plan and device.
+ */
+int journal_find(const struct journal *j, uint64_t plan_hash,
+		 const uint8_t *signature, const uint8_t *serial,
+		 uint32_t *op, uint32_t *page)
+{
+	const struct journal_record *rec = &j->rec;
+
+	if (rec->magic != JOURNAL_MAGIC || rec->plan_hash != plan_hash ||
+	    memcmp(rec->signature, signature, 3) ||
+	    memcmp(rec->serial, serial, JOURNAL_SERIAL_SIZE))
+		return 0;
+
+	*op = rec->op;
+	*page = rec->page;
+	return 1;
+}
+
+/**
+ * \brief Record the progress of a plan on a device, durably.
+ *
+ * \retval 0 on success, -1 with errno set otherwise.
+ */
+int journal_record(struct journal *j, uint64_t plan_hash,
+		   const uint8_t *signature, const uint8_t *serial,
+		   uint32_t op, uint32_t page)
+{
+	struct journal_record *rec = &j->rec;
+
+	memset(rec, 0, sizeof(*rec));
+	rec->magic = JOURNAL_MAGIC;
+	rec->version = JOURNAL_VERSION;
+	rec->plan_hash = plan_hash;
+	memcpy(rec->signature, signature, 3);
+	memcpy(rec->serial, serial, JOURNAL_SERIAL_SIZE);
+	rec->op = op;
+	rec->page = page;
+	rec->crc = journal_crc(rec);
+
+	return journal_sync(j);
+}
+
+/**
+ * \brief Forget any progress, once a plan ran to the end.
+ *
+ * \retval 0 on success, -1 with errno set otherwise.
+ */
+int journal_clear(struct journal *j)
+{
+	memset(&j->rec, 0, sizeof(j->rec));
+
+	return journal_sync(j);
+}
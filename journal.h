@@ -0,0 +1,67 @@
+/**
+ * Programming progress journal.
+ *
+ * Copyright (C) 2015-2017 Toby Churchill Ltd.
+ *
+ * Enric Balletbo Serra <enric.balletbo@collabora.com>
+ *
+ * License
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+#ifndef JOURNAL_H_INCLUDED
+#define JOURNAL_H_INCLUDED
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define JOURNAL_MAGIC		0x4e524a50	/* "PJRN" */
+#define JOURNAL_VERSION		1
+
+/*
+ * Lot number, wafer number and wafer coordinates, from the production
+ * signature row: they tell one device from another of the same kind.
+ */
+#define JOURNAL_SERIAL_OFFSET	0x08	/* from XNVM_CALIBRATION_BASE */
+#define JOURNAL_SERIAL_SIZE	14
+
+/**
+ * \brief On-disk record, the whole journal file.
+ *
+ * Pages before page of operation op of the plan are confirmed written on
+ * the device, the operations before op are done. An all zero record, or
+ * one that fails its CRC, holds no progress.
+ */
+struct journal_record {
+	uint32_t magic;
+	uint16_t version;
+	uint16_t reserved;
+	uint64_t plan_hash;		/* journal_hash() of the plan */
+	uint8_t signature[4];
+	uint8_t serial[JOURNAL_SERIAL_SIZE];
+	uint16_t reserved2;
+	uint32_t op;			/* next plan operation */
+	uint32_t page;			/* next page of a program operation */
+	uint32_t crc;			/* CRC-16 of the fields above */
+};
+
+struct journal {
+	int fd;
+	struct journal_record rec;
+};
+
+int journal_open(struct journal *j, const char *path);
+void journal_close(struct journal *j);
+uint64_t journal_hash(const void *data, size_t size);
+int journal_find(const struct journal *j, uint64_t plan_hash,
+		 const uint8_t *signature, const uint8_t *serial,
+		 uint32_t *op, uint32_t *page);
+int journal_record(struct journal *j, uint64_t plan_hash,
+		   const uint8_t *signature, const uint8_t *serial,
+		   uint32_t op, uint32_t page);
+int journal_clear(struct journal *j);
+
+#endif
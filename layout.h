@@ -0,0 +1,72 @@
+/**
+ * PRU memory layout.
+ *
+ * Where the firmware keeps its buffers, as the PRU sees the memory. The
+ * linker command file includes this header to size its regions and the
+ * host includes it to find the same buffers in its mappings, so both agree
+ * at build time. Macros only, the linker preprocessor reads it too.
+ *
+ * Copyright (C) 2015-2017 Toby Churchill Ltd.
+ *
+ * Enric Balletbo Serra <enric.balletbo@collabora.com>
+ *
+ * License
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+#ifndef LAYOUT_H_INCLUDED
+#define LAYOUT_H_INCLUDED
+
+/*
+ * AM335x PRU-ICSS local memory map, table 4.7 of the reference guide. PRU1
+ * does not run, PRU0 uses its data RAM for buffers.
+ */
+#define PRU_IRAM		0x00000000
+#define PRU_IRAM_SIZE		0x2000
+#define PRU_DRAM0		0x00000000	/* own data RAM */
+#define PRU_DRAM0_SIZE		0x2000
+#define PRU_DRAM1		0x00002000	/* PRU1 data RAM */
+#define PRU_DRAM1_SIZE		0x2000
+#define PRU_SHARED_RAM		0x00010000
+#define PRU_SHARED_RAM_SIZE	0x3000
+
+/*
+ * PRU0 data RAM: stack, the PDI instruction buffer at a fixed address,
+ * then C data. The stack comes first so that no object lives at address
+ * 0, the NULL pointer; it grows down, only an overflow would reach it.
+ */
+#define LAYOUT_STACK		PRU_DRAM0
+#define LAYOUT_STACK_SIZE	0x200
+#define LAYOUT_FRAMES		(LAYOUT_STACK + LAYOUT_STACK_SIZE)
+#define LAYOUT_FRAMES_SIZE	0x40
+
+/*
+ * PRU1 data RAM: the ping-pong buffers flash pages staged in DDR are
+ * fetched into, and the page buffer of the word per byte commands.
+ */
+#define LAYOUT_PAGE_SIZE	0x100
+#define LAYOUT_PAGES		PRU_DRAM1
+#define LAYOUT_PAGES_NUM	3
+#define LAYOUT_PAGES_SIZE	(LAYOUT_PAGES_NUM * LAYOUT_PAGE_SIZE)
+
+/* Then the window CMD_SEQUENCE reads a sequence from DDR through */
+#define LAYOUT_SEQ		(LAYOUT_PAGES + LAYOUT_PAGES_SIZE)
+#define LAYOUT_SEQ_SIZE		0x400
+
+/*
+ * Shared RAM: the command block (SHM_*) at offset 0 of the host mapping,
+ * the bus trace ring, then room neither uses.
+ */
+#define LAYOUT_MAILBOX		PRU_SHARED_RAM
+#define LAYOUT_MAILBOX_SIZE	0x400
+#define LAYOUT_TRACE		(LAYOUT_MAILBOX + LAYOUT_MAILBOX_SIZE)
+#define LAYOUT_TRACE_SIZE	0x2000
+#define LAYOUT_SHARED_FREE	(LAYOUT_TRACE + LAYOUT_TRACE_SIZE)
+
+/* Offset of a shared RAM address in the host mapping */
+#define LAYOUT_SHARED_OFFSET(addr)	((addr) - PRU_SHARED_RAM)
+
+#endif
@@ -0,0 +1,2069 @@
+/**
+ * PDI host library.
+ *
+ * Copyright (C) 2015-2017 Toby Churchill Ltd.
+ *
+ * Enric Balletbo Serra <enric.balletbo@collabora.com>
+ *
+ * License
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <prussdrv.h>
+#include <pruss_intc_mapping.h>
+
+#include "libpdi.h"
+#include "prog.h"
+#include "stage.h"
+#include "plan.h"
+#include "bitstream.h"
+#include "trace.h"
+#include "journal.h"
+#include "crc16.h"
+#include "atxmega16d4_nvm_regs.h"
+
+_Static_assert(PDI_TIMEOUT_NUM == SHM_TIMEOUTS_NUM,
+	       "enum pdi_timeout does not match struct xnvm_timeouts");
+_Static_assert(PRU_DOORBELL_EVENT == ARM_PRU0_INTERRUPT,
+	       "the firmware waits on another doorbell");
+_Static_assert(SHM_END * 4 <= LAYOUT_MAILBOX_SIZE,
+	       "the command block outgrew LAYOUT_MAILBOX_SIZE");
+_Static_assert(sizeof(struct devinfo) <= SHM_SLOT_NUM * SHM_SLOT_SIZE &&
+	       sizeof(struct phy_calibration) <= SHM_SLOT_NUM * SHM_SLOT_SIZE &&
+	       sizeof(struct verify_result) <= SHM_SLOT_NUM * SHM_SLOT_SIZE,
+	       "a command result overlaps SHM_METRICS");
+
+#define PRU_NUM 0
+
+/* Round trips learnt per command, for PDI_COMPLETION_HYBRID */
+#define PDI_CMD_SLOTS		64
+#define PDI_SPIN_US		100
+
+/* Pages per CMD_PROGRAM_IMAGE when the progress is journaled */
+#define PDI_JOURNAL_PAGES	16
+
+static const char * const phase_names[] = {
+	[PDI_PHASE_SETUP]	= "setup",
+	[PDI_PHASE_ENTER]	= "enter",
+	[PDI_PHASE_CHECK]	= "check",
+	[PDI_PHASE_ERASE]	= "erase",
+	[PDI_PHASE_WRITE]	= "write",
+	[PDI_PHASE_READ]	= "read",
+	[PDI_PHASE_LEAVE]	= "leave",
+	[PDI_PHASE_DETECT]	= "detect",
+};
+
+static const char * const completion_names[] = {
+	[PDI_COMPLETION_IRQ]	= "irq",
+	[PDI_COMPLETION_POLL]	= "poll",
+	[PDI_COMPLETION_HYBRID]	= "hybrid",
+};
+
+#ifndef START_ADDR
+#error "START_ADDR must be defined"
+#endif
+
+/* returned by a step function when it handed a command to the PRU */
+#define PDI_PENDING	1
+
+/**
+ * \brief Advance a job by one step.
+ *
+ * Called with the result of the previous PRU command. Either submits the
+ * next command and returns PDI_PENDING, or returns the job's final status.
+ */
+typedef int (*pdi_step_fn)(struct pdi *h, struct pdi_job *job,
+			   int32_t result);
+
+struct pdi_job {
+	struct pdi_job *next;
+	pdi_step_fn step;
+	int state;
+	int status;
+	int cancelled;
+	int session;		/* PDI session open on the PRU */
+	int leaving;		/* CMD_LEAVE_PROGMODE in flight */
+	pdi_done_cb done;
+	void *user;
+	uint32_t count;
+	uint64_t start_us;
+	struct pdi_stats stats;
+	struct devinfo info;
+	struct phy_info phy;
+	struct phy_calibration cal;
+	uint32_t reads;		/* per sampling point */
+	int backend;		/* enum phy_backend, or -1 to keep it */
+	uint32_t clk_hz;
+	uint32_t channels;	/* targets it drives, see PDI_CHANNELS */
+	int multi;		/* may drive more than one of them */
+
+	/* read jobs, and data space writes */
+	uint32_t cmd;		/* CMD_READ_MEMORY or CMD_READ_DATA */
+	struct pdi_region *regions;
+	unsigned int nregions;
+	pdi_chunk_cb chunk;
+	unsigned int region;
+	uint32_t offset;
+	uint32_t length;
+	unsigned int slot;
+
+	/* program jobs */
+	const uint8_t *image;
+	size_t size;
+	const uint8_t *current;
+	unsigned int flags;
+	int blank[PLAN_SECTIONS];
+	unsigned int section;
+	struct erase_plan plan;
+
+	/* plan jobs */
+	const struct plan_header *precompiled;
+	unsigned int op;	/* next operation */
+	uint32_t page;		/* next page of the program operation */
+	uint32_t resumed;	/* pages a previous run had written */
+	uint64_t plan_hash;
+	uint8_t serial[JOURNAL_SERIAL_SIZE];
+	uint8_t *values;	/* of the patch slots, back to back */
+	uint32_t patched;	/* bit n set once slot n has its value */
+	unsigned int patch;	/* next slot CMD_WRITE_NVM writes */
+	int staged;		/* the stage in DDR holds its values */
+
+	/* verify jobs, one entry per page of the plan */
+	struct pdi_mismatch *mismatches;
+	unsigned int nmismatches;
+
+	/* trace jobs */
+	FILE *trace;
+
+	/* detect jobs */
+	int present;
+	uint32_t period_ms;
+};
+
+struct pdi {
+	volatile uint32_t *shared_ram;
+	struct stage stage;
+	int stage_ok;
+	const struct plan_header *staged;	/* plan the stage holds */
+	struct journal *journal;	/* progress of plan jobs, or NULL */
+	int fd;
+	int busy;			/* a PRU command is in flight */
+	struct pdi_job *head;		/* running job */
+	struct pdi_job *tail;
+	uint32_t timeouts[PDI_TIMEOUT_NUM];
+	uint32_t channels;
+	int engine;			/* enum pdi_engine */
+	int completion;			/* enum pdi_completion */
+	uint32_t spin_us;
+	uint32_t expect_us[PDI_CMD_SLOTS];	/* usual round trip */
+
+	/* command in flight, and the firmware counters before it */
+	uint32_t cmd;
+	uint32_t cmd_arg;
+	uint32_t cmd_length;
+	uint32_t cmd_slot;
+	uint64_t cmd_start_us;
+	int polled;			/* its completion was caught spinning */
+	struct pdi_metrics fw;
+	struct pdi_stats stats;
+
+	/* bus trace being written, and the ring events already in it */
+	FILE *trace;
+	uint32_t trace_tail;
+};
+
+static uint64_t pdi_now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void pdi_stats_add(struct pdi_stats *dst, const struct pdi_stats *src)
+{
+	uint64_t *d = (uint64_t *)dst;
+	const uint64_t *s = (const uint64_t *)src;
+	size_t i;
+
+	for (i = 0; i < sizeof(*dst) / sizeof(uint64_t); i++)
+		d[i] += s[i];
+}
+
+static enum pdi_phase pdi_phase_of(uint32_t cmd)
+{
+	switch (cmd) {
+	case CMD_ENTER_PROGMODE:
+		return PDI_PHASE_ENTER;
+	case CMD_LEAVE_PROGMODE:
+		return PDI_PHASE_LEAVE;
+	case CMD_SECTION_CRC:
+	case CMD_VERIFY_IMAGE:
+		return PDI_PHASE_CHECK;
+	case CMD_ERASE:
+	case CMD_CHIP_ERASE:
+		return PDI_PHASE_ERASE;
+	case CMD_PROGRAM_IMAGE:
+	case CMD_PROGRAM_FLASH:
+	case CMD_SEQUENCE:
+	case CMD_WRITE_DATA:
+	case CMD_WRITE_NVM:
+		return PDI_PHASE_WRITE;
+	case CMD_IDENTIFY:
+	case CMD_READ_MEMORY:
+	case CMD_READ_DATA:
+	case CMD_READ_FLASH:
+	case CMD_READ_SIGNATURE:
+		return PDI_PHASE_READ;
+	case CMD_DETECT:
+		return PDI_PHASE_DETECT;
+	default:
+		return PDI_PHASE_SETUP;
+	}
+}
+
+/**
+ * \brief Charge the command that just completed to the running job.
+ */
+static void pdi_account(struct pdi *h)
+{
+	struct pdi_stats *st = &h->head->stats;
+	struct pdi_metrics fw;
+	uint32_t *expect = &h->expect_us[h->cmd % PDI_CMD_SLOTS];
+	uint64_t rtt;
+
+	memcpy(&fw, (const void *)&h->shared_ram[SHM_METRICS], sizeof(fw));
+
+	rtt = pdi_now_us() - h->cmd_start_us;
+	st->phase_us[pdi_phase_of(h->cmd)] += rtt;
+	if (h->polled) {
+		st->polled++;
+		st->polled_us += rtt;
+	} else {
+		st->irqs++;
+		st->irq_us += rtt;
+	}
+	*expect = *expect ? (*expect * 7 + rtt) / 8 : rtt;
+
+	/* the counters wrap, their differences do not */
+	st->commands += fw.commands - h->fw.commands;
+	st->pru_cycles += fw.command_cycles - h->fw.command_cycles;
+	st->tx_frames += fw.tx_frames - h->fw.tx_frames;
+	st->rx_frames += fw.rx_frames - h->fw.rx_frames;
+	st->frame_errors += fw.frame_errors - h->fw.frame_errors;
+	st->rx_timeouts += fw.rx_timeouts - h->fw.rx_timeouts;
+	st->retries += fw.retries - h->fw.retries;
+	st->busy_polls += fw.busy_polls - h->fw.busy_polls;
+	st->busy_cycles += fw.busy_cycles - h->fw.busy_cycles;
+	st->pages_written += fw.pages_written - h->fw.pages_written;
+	st->pages_erased += fw.pages_erased - h->fw.pages_erased;
+	st->keepalives += fw.keepalives - h->fw.keepalives;
+
+	h->fw = fw;
+}
+
+/**
+ * \brief Hand a command over to the PRU and ring its doorbell.
+ *
+ * The completion shows up as the event fd becoming readable.
+ */
+static int pdi_command(struct pdi *h, uint32_t cmd, uint32_t arg,
+		       uint32_t length, uint32_t slot)
+{
+	h->shared_ram[SHM_ARG] = arg;
+	h->shared_ram[SHM_LENGTH] = length;
+	h->shared_ram[SHM_SLOT] = slot;
+	h->shared_ram[SHM_ABORT] = 0;
+	h->shared_ram[SHM_CMD] = cmd;
+
+	/* the descriptor must be in place before the PRU wakes up */
+	__sync_synchronize();
+	prussdrv_pru_send_event(ARM_PRU0_INTERRUPT);
+	h->busy = 1;
+	h->cmd = cmd;
+	h->cmd_arg = arg;
+	h->cmd_length = length;
+	h->cmd_slot = slot;
+	h->cmd_start_us = pdi_now_us();
+
+	return PDI_PENDING;
+}
+
+/**
+ * \brief Start the job at the head of the queue.
+ *
+ * Every job starts by sending the time budgets and its channels, so that
+ * the first step always runs from pdi_process() and any override reaches
+ * the PRU.
+ */
+static void pdi_start(struct pdi *h)
+{
+	unsigned int i;
+
+	if (h->busy || !h->head)
+		return;
+
+	h->head->start_us = pdi_now_us();
+
+	for (i = 0; i < PDI_TIMEOUT_NUM; i++)
+		h->shared_ram[SHM_DATA + i] = h->timeouts[i];
+
+	pdi_command(h, CMD_SET_TIMEOUTS, h->head->channels, 0, 0);
+}
+
+static void pdi_job_free(struct pdi_job *job)
+{
+	free(job->mismatches);
+	free(job->regions);
+	free(job->values);
+	free(job);
+}
+
+static void pdi_finish(struct pdi *h, struct pdi_job *job, int status)
+{
+	struct pdi_stats *st = &job->stats;
+	uint64_t busy = 0;
+	unsigned int i;
+
+	st->jobs = 1;
+	st->elapsed_us = pdi_now_us() - job->start_us;
+	for (i = 0; i < PDI_PHASE_NUM; i++)
+		busy += st->phase_us[i];
+	st->host_us = st->elapsed_us > busy ? st->elapsed_us - busy : 0;
+	pdi_stats_add(&h->stats, st);
+
+	h->head = job->next;
+	if (!h->head)
+		h->tail = NULL;
+
+	if (job->done)
+		job->done(job, status, job->user);
+	pdi_job_free(job);
+
+	pdi_start(h);
+}
+
+/**
+ * \brief Feed the result of the last PRU command to the running job.
+ *
+ * A job that ends with its PDI session open leaves programming mode
+ * first, whatever the reason it ended.
+ */
+static void pdi_advance(struct pdi *h, int32_t result)
+{
+	struct pdi_job *job = h->head;
+	int ret;
+
+	if (job->leaving) {
+		pdi_finish(h, job, job->status);
+		return;
+	}
+
+	if (job->cancelled)
+		ret = ERR_FLUSHED;
+	else
+		ret = job->step(h, job, result);
+
+	if (ret == PDI_PENDING)
+		return;
+
+	if (job->session) {
+		job->status = ret;
+		job->session = 0;
+		job->leaving = 1;
+		pdi_command(h, CMD_LEAVE_PROGMODE, 0, 0, 0);
+		return;
+	}
+
+	pdi_finish(h, job, ret);
+}
+
+/**
+ * \brief Load the PDI firmware into PRU0 and get a handle on it.
+ *
+ * Returns NULL if the PRU could not be set up.
+ */
+struct pdi *pdi_open(void)
+{
+	tpruss_intc_initdata pruss_intc_initdata = PRUSS_INTC_INITDATA;
+	struct pdi *h;
+	void *p;
+
+	h = calloc(1, sizeof(*h));
+	if (!h)
+		return NULL;
+
+	prussdrv_init();
+	if (prussdrv_open(PRU_EVTOUT_0) < 0)
+		goto err_free;
+	prussdrv_pruintc_init(&pruss_intc_initdata);
+
+	h->fd = prussdrv_pru_event_fd(PRU_EVTOUT_0);
+	if (h->fd < 0)
+		goto err_exit;
+
+	/* Get pointer to shared ram */
+	prussdrv_map_prumem(PRUSS0_SHARED_DATARAM, &p);
+	h->shared_ram = (uint32_t *)p;
+	h->shared_ram[SHM_CMD] = 0;
+
+	h->stage_ok = stage_init(&h->stage) == 0;
+	h->spin_us = PDI_SPIN_US;
+
+	/* Load and run binary into pru0 */
+	if (prussdrv_load_datafile(PRU_NUM, "./data.bin") < 0 ||
+	    prussdrv_exec_program_at(PRU_NUM, "./text.bin", START_ADDR) < 0)
+		goto err_exit;
+
+	return h;
+
+err_exit:
+	prussdrv_exit();
+err_free:
+	free(h);
+	return NULL;
+}
+
+/**
+ * \brief Cancel every job, wait for the PRU to settle and release it.
+ *
+ * This is the only call that may block.
+ */
+void pdi_close(struct pdi *h)
+{
+	while (h->head && h->head->next)
+		pdi_cancel(h, h->head->next);
+	if (h->head)
+		pdi_cancel(h, h->head);
+	pdi_run(h);
+
+	prussdrv_pru_disable(PRU_NUM);
+	prussdrv_exit();
+	free(h);
+}
+
+/**
+ * \brief File descriptor that becomes readable when pdi_process() has work.
+ */
+int pdi_fd(struct pdi *h)
+{
+	return h->fd;
+}
+
+/**
+ * \brief How long to spin for the command in flight, in microseconds.
+ */
+static uint32_t pdi_spin_budget(struct pdi *h)
+{
+	uint32_t expect = h->expect_us[h->cmd % PDI_CMD_SLOTS];
+
+	switch (h->completion) {
+	case PDI_COMPLETION_POLL:
+		return h->spin_us;
+	case PDI_COMPLETION_HYBRID:
+		/* a command not seen yet gets the benefit of the doubt */
+		return expect <= h->spin_us ? h->spin_us : 0;
+	default:
+		return 0;
+	}
+}
+
+/**
+ * \brief Collect a pending PRU interrupt, if there is one.
+ *
+ * Only when the event fd is readable, so this does not sleep.
+ *
+ * \retval 1 an interrupt was collected, 0 none was pending.
+ */
+static int pdi_drain_event(struct pdi *h)
+{
+	struct pollfd pfd = { .fd = h->fd, .events = POLLIN };
+
+	if (poll(&pfd, 1, 0) <= 0)
+		return 0;
+
+	prussdrv_pru_wait_event(PRU_EVTOUT_0);
+	prussdrv_pru_clear_event(PRU_EVTOUT_0, PRU0_ARM_INTERRUPT);
+
+	return 1;
+}
+
+/**
+ * \brief Check whether the command in flight completed.
+ *
+ * The PRU clears the command word once the results are in place, then
+ * raises its interrupt. The word tells the completion, the interrupt only
+ * wakes the caller up: a completion caught spinning does not wait for it,
+ * it is collected by the next call instead. Clearing it may take the
+ * interrupt of the command now in flight along, which is why the word is
+ * looked at after the interrupt is collected.
+ *
+ * \param spin_us how long to spin on the command word, 0 not to.
+ */
+static int pdi_completed(struct pdi *h, uint32_t spin_us)
+{
+	uint64_t start, now;
+	int irq;
+
+	irq = pdi_drain_event(h);
+
+	h->polled = 0;
+	if (h->shared_ram[SHM_CMD] != 0) {
+		if (!spin_us)
+			return 0;
+
+		start = now = pdi_now_us();
+		while (h->shared_ram[SHM_CMD] != 0) {
+			now = pdi_now_us();
+			if (now - start >= spin_us) {
+				h->head->stats.spin_us += now - start;
+				return 0;
+			}
+		}
+		h->polled = 1;
+	} else if (!irq) {
+		h->polled = 1;
+	}
+
+	h->busy = 0;
+
+	return 1;
+}
+
+static volatile struct trace_ring *pdi_trace_ring(struct pdi *h)
+{
+	return (volatile struct trace_ring *)
+		&h->shared_ram[LAYOUT_SHARED_OFFSET(LAYOUT_TRACE) / 4];
+}
+
+/**
+ * \brief Write the events of the command that just completed to the trace.
+ *
+ * The ring holds TRACE_EVENTS events. A command that recorded more than
+ * that lost its first ones, the block says how many.
+ */
+static void pdi_trace_drain(struct pdi *h, int32_t result)
+{
+	volatile struct trace_ring *ring = pdi_trace_ring(h);
+	struct trace_event ev;
+	struct trace_block blk = {
+		.cmd = h->cmd,
+		.arg = h->cmd_arg,
+		.length = h->cmd_length,
+		.slot = h->cmd_slot,
+		.result = result,
+	};
+	const void *extra = NULL;
+	uint32_t timeouts[SHM_TIMEOUTS_NUM];
+	static const uint8_t pad[4];
+	uint32_t head, n, i;
+
+	head = ring->head;
+	n = head - h->trace_tail;
+	if (n > TRACE_EVENTS) {
+		blk.lost = n - TRACE_EVENTS;
+		n = TRACE_EVENTS;
+	}
+	blk.nevents = n;
+
+	/* what the replay cannot get from the events */
+	if ((h->cmd == CMD_PROGRAM_IMAGE || h->cmd == CMD_VERIFY_IMAGE) &&
+	    h->stage_ok && h->cmd_arg == h->stage.phys) {
+		extra = h->stage.ddr;
+		blk.extra = stage_size(h->stage.hdr);
+	} else if (h->cmd == CMD_SEQUENCE && h->stage_ok &&
+		   h->cmd_arg == h->stage.phys) {
+		extra = h->stage.ddr;
+		blk.extra = h->cmd_length * 4;
+	} else if (h->cmd == CMD_SET_TIMEOUTS) {
+		for (i = 0; i < SHM_TIMEOUTS_NUM; i++)
+			timeouts[i] = h->shared_ram[SHM_DATA + i];
+		extra = timeouts;
+		blk.extra = sizeof(timeouts);
+	} else if ((h->cmd == CMD_WRITE_DATA || h->cmd == CMD_WRITE_NVM) &&
+		   h->cmd_slot < SHM_SLOT_NUM &&
+		   h->cmd_length <= (SHM_SLOT_NUM - h->cmd_slot) *
+				    SHM_SLOT_SIZE) {
+		extra = (const void *)&h->shared_ram[SHM_SLOT_OFFSET(h->cmd_slot)];
+		blk.extra = h->cmd_length;
+	}
+
+	fwrite(&blk, sizeof(blk), 1, h->trace);
+	for (i = head - n; i != head; i++) {
+		memcpy(&ev, (const void *)&ring->events[i % TRACE_EVENTS],
+		       sizeof(ev));
+		fwrite(&ev, sizeof(ev), 1, h->trace);
+	}
+	if (blk.extra) {
+		fwrite(extra, blk.extra, 1, h->trace);
+		fwrite(pad, -blk.extra & 3, 1, h->trace);
+	}
+
+	h->trace_tail = head;
+}
+
+/**
+ * \brief Collect PRU completions and advance the running job.
+ *
+ * Does not sleep. With PDI_COMPLETION_POLL or PDI_COMPLETION_HYBRID it
+ * spins for each command it sends, up to the spin budget, and goes on
+ * with the job as long as they complete in time.
+ *
+ * Returns 1 if a completion was handled, 0 otherwise.
+ */
+int pdi_process(struct pdi *h)
+{
+	int handled = 0;
+
+	/* the interrupt of a command caught spinning wakes the caller later */
+	if (!h->busy)
+		pdi_drain_event(h);
+
+	while (h->busy && pdi_completed(h, pdi_spin_budget(h))) {
+		pdi_account(h);
+		if (h->trace)
+			pdi_trace_drain(h, (int32_t)h->shared_ram[SHM_RESULT]);
+		pdi_advance(h, (int32_t)h->shared_ram[SHM_RESULT]);
+		handled = 1;
+	}
+
+	return handled;
+}
+
+/**
+ * \brief Run the queue until it is empty.
+ *
+ * For callers without an event loop of their own.
+ *
+ * \retval 0 all jobs are done.
+ * \retval -1 interrupted by a signal (errno EINTR) or poll() failed.
+ */
+int pdi_run(struct pdi *h)
+{
+	struct pollfd pfd = { .fd = h->fd, .events = POLLIN };
+
+	while (h->busy) {
+		if (poll(&pfd, 1, -1) < 0)
+			return -1;
+		pdi_process(h);
+	}
+
+	return 0;
+}
+
+/**
+ * \brief Check whether the queue is empty.
+ */
+int pdi_idle(struct pdi *h)
+{
+	return !h->head;
+}
+
+/**
+ * \brief Override the time budgets, in microseconds.
+ *
+ * \param timeouts PDI_TIMEOUT_NUM entries, indexed by enum pdi_timeout.
+ * Zero entries keep the firmware defaults. Takes effect from the next job.
+ */
+void pdi_set_timeouts(struct pdi *h, const uint32_t *timeouts)
+{
+	memcpy(h->timeouts, timeouts, sizeof(h->timeouts));
+}
+
+/**
+ * \brief Choose how command completions are collected.
+ *
+ * Spinning saves the wakeup of the interrupt path on commands that take
+ * less than the budget, at the cost of a CPU while it spins. The round
+ * trips of either path are in struct pdi_stats.
+ *
+ * \param spin_us spin budget per command, 0 for the default.
+ */
+void pdi_set_completion(struct pdi *h, enum pdi_completion mode,
+			uint32_t spin_us)
+{
+	h->completion = mode;
+	h->spin_us = spin_us ? spin_us : PDI_SPIN_US;
+}
+
+/**
+ * \brief Choose the targets the jobs drive, bit n for channel n.
+ *
+ * With more than one channel pdi_submit() only takes jobs made by
+ * pdi_job_program_plan(), pdi_job_detect(), pdi_job_phy(),
+ * pdi_job_phy_select() and pdi_job_trace(). A plan job must run with
+ * PDI_ENGINE_FIRMWARE and patch no slots, or it ends with
+ * ERR_INVALID_ARG. Takes effect from the next job submitted.
+ *
+ * \param mask the channels, 0 for channel 0 alone.
+ */
+void pdi_set_channels(struct pdi *h, uint32_t mask)
+{
+	h->channels = mask;
+}
+
+/**
+ * \brief Choose what runs the operations of plan jobs on the PRU.
+ *
+ * Takes effect from the next job.
+ */
+void pdi_set_engine(struct pdi *h, enum pdi_engine engine)
+{
+	h->engine = engine;
+}
+
+/**
+ * \brief Keep the progress of plan jobs in a journal, or stop if NULL.
+ *
+ * Plan jobs programming a single target with PDI_ENGINE_FIRMWARE record
+ * every operation done and every batch of pages written, flushed to disk,
+ * and resume from the journal when it holds progress of the same plan on
+ * the same device. It must stay open while they run.
+ */
+void pdi_set_journal(struct pdi *h, struct journal *journal)
+{
+	h->journal = journal;
+}
+
+/**
+ * \brief Queue a job. It starts right away if the PRU is idle.
+ *
+ * \retval 0 queued, on the channels chosen with pdi_set_channels().
+ * \retval -1 no job, or one that cannot drive several channels (errno
+ * EINVAL). The job is still the caller's.
+ */
+int pdi_submit(struct pdi *h, struct pdi_job *job)
+{
+	/* the other jobs would read every channel into one slot */
+	if (!job || (h->channels & (h->channels - 1) && !job->multi)) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	job->channels = h->channels;
+	job->next = NULL;
+	if (h->tail)
+		h->tail->next = job;
+	else
+		h->head = job;
+	h->tail = job;
+
+	pdi_start(h);
+
+	return 0;
+}
+
+/**
+ * \brief Cancel a job.
+ *
+ * A queued job never starts. The running job stops at the next command
+ * boundary, leaving programming mode cleanly; a CMD_PROGRAM_IMAGE or
+ * CMD_DETECT in flight is told to stop early, the former once the page
+ * it writes is done. Either way the done callback gets ERR_FLUSHED.
+ *
+ * \retval 0 the job will be cancelled.
+ * \retval -1 the job is not queued (errno ESRCH).
+ */
+int pdi_cancel(struct pdi *h, struct pdi_job *job)
+{
+	struct pdi_job **p;
+
+	for (p = &h->head; *p; p = &(*p)->next) {
+		if (*p == job)
+			break;
+	}
+	if (!*p) {
+		errno = ESRCH;
+		return -1;
+	}
+
+	if (job == h->head) {
+		job->cancelled = 1;
+		if (h->busy)
+			h->shared_ram[SHM_ABORT] = 1;
+		return 0;
+	}
+
+	*p = job->next;
+	if (h->tail == job) {
+		for (h->tail = h->head; h->tail->next; h->tail = h->tail->next)
+			;
+	}
+	if (job->done)
+		job->done(job, ERR_FLUSHED, job->user);
+	pdi_job_free(job);
+
+	return 0;
+}
+
+/**
+ * \brief Free a job that was never submitted.
+ *
+ * For a job the caller gave up on while setting it up, see
+ * pdi_job_patch(). A submitted job is freed by the library.
+ */
+void pdi_job_discard(struct pdi_job *job)
+{
+	if (job)
+		pdi_job_free(job);
+}
+
+static struct pdi_job *pdi_job_alloc(pdi_step_fn step, pdi_done_cb done,
+				     void *user)
+{
+	struct pdi_job *job;
+
+	job = calloc(1, sizeof(*job));
+	if (!job)
+		return NULL;
+
+	job->step = step;
+	job->done = done;
+	job->user = user;
+
+	return job;
+}
+
+static int pdi_identify_step(struct pdi *h, struct pdi_job *job,
+			     int32_t result)
+{
+	if (result != STATUS_OK)
+		return result;
+
+	/* the whole information block comes back from one command */
+	if (job->state++ == 0)
+		return pdi_command(h, CMD_IDENTIFY, 0, 0, 0);
+
+	memcpy(&job->info, (const void *)&h->shared_ram[SHM_DATA],
+	       sizeof(job->info));
+	job->stats.bytes_read += sizeof(job->info);
+
+	return STATUS_OK;
+}
+
+/**
+ * \brief Job reading the device information block.
+ */
+struct pdi_job *pdi_job_identify(pdi_done_cb done, void *user)
+{
+	return pdi_job_alloc(pdi_identify_step, done, user);
+}
+
+static int pdi_phy_step(struct pdi *h, struct pdi_job *job, int32_t result)
+{
+	uint32_t half = 0;
+
+	if (result != STATUS_OK)
+		return result;
+
+	if (job->state == 0) {
+		job->state++;
+		if (job->backend >= 0)
+			return pdi_command(h, CMD_PHY_SELECT, job->backend,
+					   0, 0);
+	}
+
+	if (job->state == 1) {
+		job->state++;
+		/* round the half period up, never clock faster than asked */
+		if (job->clk_hz)
+			half = (PRU_CLOCK_HZ + 2 * job->clk_hz - 1) /
+				(2 * job->clk_hz);
+		return pdi_command(h, CMD_PHY_INFO, half, 0, 0);
+	}
+
+	memcpy(&job->phy, (const void *)&h->shared_ram[SHM_DATA],
+	       sizeof(job->phy));
+
+	return STATUS_OK;
+}
+
+/**
+ * \brief Job setting the PDI clock and reading the PHY cycle budgets.
+ *
+ * \param clk_hz PDI_CLK frequency, 0 to leave the clock alone. The closest
+ * frequency the PHY can do without going faster is used, and holds for
+ * every job after this one.
+ */
+struct pdi_job *pdi_job_phy(uint32_t clk_hz, pdi_done_cb done, void *user)
+{
+	return pdi_job_phy_select(-1, clk_hz, done, user);
+}
+
+/**
+ * \brief Job switching the PHY backend, then setting the clock like
+ * pdi_job_phy().
+ *
+ * The PRU refuses to switch while a PDI session is open.
+ *
+ * \param backend enum phy_backend, or -1 to keep the one in use.
+ * \param clk_hz PDI_CLK frequency, 0 for the backend default.
+ */
+struct pdi_job *pdi_job_phy_select(int backend, uint32_t clk_hz,
+				   pdi_done_cb done, void *user)
+{
+	struct pdi_job *job;
+
+	job = pdi_job_alloc(pdi_phy_step, done, user);
+	if (!job)
+		return NULL;
+
+	job->backend = backend;
+	job->clk_hz = clk_hz;
+	job->multi = 1;
+
+	return job;
+}
+
+static int pdi_calibrate_step(struct pdi *h, struct pdi_job *job,
+			      int32_t result)
+{
+	switch (job->state++) {
+	case 0:
+		return pdi_command(h, CMD_ENTER_PROGMODE, 0, 0, 0);
+	case 1:
+		if (result != STATUS_OK)
+			return result;
+		job->session = 1;
+		return pdi_command(h, CMD_CALIBRATE, 0, job->reads, 0);
+	}
+
+	/* the sweep is worth having even when no point passed */
+	memcpy(&job->cal, (const void *)&h->shared_ram[SHM_DATA],
+	       sizeof(job->cal));
+
+	return result;
+}
+
+/**
+ * \brief Job finding the best input sampling point at the current clock.
+ *
+ * The point found is used by every job after this one, until the clock
+ * changes. The signature read at the current point is the reference.
+ *
+ * \param reads signature reads at each sampling point.
+ */
+struct pdi_job *pdi_job_calibrate(uint32_t reads, pdi_done_cb done,
+				  void *user)
+{
+	struct pdi_job *job;
+
+	job = pdi_job_alloc(pdi_calibrate_step, done, user);
+	if (!job)
+		return NULL;
+
+	job->reads = reads;
+
+	return job;
+}
+
+/*
+ * Memory reads alternate between the slots, the host consumes one while
+ * the PRU fills the other. Data space reads are small and fill both.
+ */
+static int pdi_read_submit(struct pdi *h, struct pdi_job *job)
+{
+	uint32_t left = job->regions[job->region].size - job->offset;
+	uint32_t max = job->cmd == CMD_READ_DATA ? SHM_DATA_MAX : SHM_SLOT_SIZE;
+
+	job->length = left < max ? left : max;
+
+	return pdi_command(h, job->cmd,
+			   job->regions[job->region].address + job->offset,
+			   job->length, job->slot);
+}
+
+static int pdi_read_step(struct pdi *h, struct pdi_job *job, int32_t result)
+{
+	unsigned int region, slot;
+	uint32_t offset, length;
+	int more;
+
+	if (result != STATUS_OK)
+		return result;
+
+	switch (job->state++) {
+	case 0:
+		return pdi_command(h, CMD_ENTER_PROGMODE, 0, 0, 0);
+	case 1:
+		job->session = 1;
+		return pdi_read_submit(h, job);
+	}
+
+	/* a chunk landed, queue the next one before handing this one out */
+	region = job->region;
+	offset = job->offset;
+	length = job->length;
+	slot = job->slot;
+
+	job->offset += length;
+	if (job->offset >= job->regions[job->region].size) {
+		job->region++;
+		job->offset = 0;
+	}
+	more = job->region < job->nregions;
+	if (job->cmd == CMD_READ_MEMORY) {
+		job->slot = !job->slot;
+		if (more)
+			pdi_read_submit(h, job);
+	}
+
+	job->count += length;
+	job->stats.bytes_read += length;
+	if (job->chunk)
+		job->chunk(job, region, offset,
+			   (const uint8_t *)&h->shared_ram[SHM_SLOT_OFFSET(slot)],
+			   length, job->user);
+
+	/* the same slots again, only once the chunk was handed out */
+	if (more && job->cmd == CMD_READ_DATA)
+		return pdi_read_submit(h, job);
+
+	return more ? PDI_PENDING : STATUS_OK;
+}
+
+static struct pdi_job *pdi_read_alloc(uint32_t cmd,
+				      const struct pdi_region *regions,
+				      unsigned int nregions, pdi_chunk_cb chunk,
+				      pdi_done_cb done, void *user)
+{
+	struct pdi_job *job;
+	unsigned int i;
+
+	for (i = 0; i < nregions; i++) {
+		if (regions[i].size == 0)
+			return NULL;
+	}
+
+	job = pdi_job_alloc(pdi_read_step, done, user);
+	if (!job)
+		return NULL;
+
+	job->regions = malloc(nregions * sizeof(*regions));
+	if (!job->regions) {
+		free(job);
+		return NULL;
+	}
+	memcpy(job->regions, regions, nregions * sizeof(*regions));
+	job->nregions = nregions;
+	job->chunk = chunk;
+	job->cmd = cmd;
+
+	return job;
+}
+
+/**
+ * \brief Job reading a list of memory regions.
+ *
+ * The chunk callback gets the data while the next chunk is being read.
+ */
+struct pdi_job *pdi_job_read(const struct pdi_region *regions,
+			     unsigned int nregions, pdi_chunk_cb chunk,
+			     pdi_done_cb done, void *user)
+{
+	return pdi_read_alloc(CMD_READ_MEMORY, regions, nregions, chunk, done,
+			      user);
+}
+
+/**
+ * \brief Job reading a list of data space regions, SRAM or I/O registers.
+ *
+ * Addresses are data space addresses. Each chunk, up to SHM_DATA_MAX
+ * bytes, is a single PDI burst, so a few hundred bytes of state come back
+ * in one command. Returns NULL if a region is empty or outside the data
+ * space.
+ */
+struct pdi_job *pdi_job_read_data(const struct pdi_region *regions,
+				  unsigned int nregions, pdi_chunk_cb chunk,
+				  pdi_done_cb done, void *user)
+{
+	unsigned int i;
+
+	for (i = 0; i < nregions; i++) {
+		if (regions[i].address >= DATA_SPACE_SIZE ||
+		    regions[i].size > DATA_SPACE_SIZE - regions[i].address)
+			return NULL;
+	}
+
+	return pdi_read_alloc(CMD_READ_DATA, regions, nregions, chunk, done,
+			      user);
+}
+
+static int pdi_write_data_step(struct pdi *h, struct pdi_job *job,
+			       int32_t result)
+{
+	uint32_t left;
+
+	if (result != STATUS_OK)
+		return result;
+
+	switch (job->state++) {
+	case 0:
+		return pdi_command(h, CMD_ENTER_PROGMODE, 0, 0, 0);
+	case 1:
+		job->session = 1;
+		break;
+	default:
+		job->offset += job->length;
+		job->count = job->offset;
+		job->stats.bytes_programmed += job->length;
+		break;
+	}
+
+	left = job->size - job->offset;
+	if (left == 0)
+		return STATUS_OK;
+
+	job->length = left < SHM_DATA_MAX ? left : SHM_DATA_MAX;
+	memcpy((void *)&h->shared_ram[SHM_SLOT_OFFSET(0)],
+	       job->image + job->offset, job->length);
+
+	return pdi_command(h, CMD_WRITE_DATA, job->regions[0].address +
+			   job->offset, job->length, 0);
+}
+
+/**
+ * \brief Job writing a range of the data space, SRAM or I/O registers.
+ *
+ * Each chunk, up to SHM_DATA_MAX bytes, is a single PDI burst. The bytes
+ * are written in order, I/O registers with side effects included, and
+ * never sent twice. The data must stay valid until the job is done.
+ * Returns NULL if the range is empty or outside the data space.
+ */
+struct pdi_job *pdi_job_write_data(uint32_t address, const uint8_t *data,
+				   uint32_t length, pdi_done_cb done,
+				   void *user)
+{
+	struct pdi_job *job;
+
+	if (length == 0 || address >= DATA_SPACE_SIZE ||
+	    length > DATA_SPACE_SIZE - address)
+		return NULL;
+
+	job = pdi_job_alloc(pdi_write_data_step, done, user);
+	if (!job)
+		return NULL;
+
+	job->regions = malloc(sizeof(*job->regions));
+	if (!job->regions) {
+		free(job);
+		return NULL;
+	}
+	job->regions[0].address = address;
+	job->regions[0].size = length;
+	job->nregions = 1;
+	job->image = data;
+	job->size = length;
+	job->cmd = CMD_WRITE_DATA;
+
+	return job;
+}
+
+enum program_state {
+	PROGRAM_START,
+	PROGRAM_ENTER,		/* CMD_ENTER_PROGMODE sent */
+	PROGRAM_CHECK,		/* blank check of job->section */
+	PROGRAM_ERASE,		/* erase of job->section, or of the chip */
+	PROGRAM_WRITE,		/* CMD_PROGRAM_IMAGE sent */
+};
+
+/**
+ * \brief Erase whatever the plan says, from job->section on, then write.
+ */
+static int pdi_program_erase(struct pdi *h, struct pdi_job *job)
+{
+	for (; job->section < PLAN_SECTIONS; job->section++) {
+		switch (job->plan.erase[job->section]) {
+		case PLAN_CHIP:
+			job->state = PROGRAM_ERASE;
+			return pdi_command(h, CMD_ERASE, AREA_CHIP, 0, 0);
+		case PLAN_SECTION:
+			job->state = PROGRAM_ERASE;
+			return pdi_command(h, CMD_ERASE, job->section, 0, 0);
+		default:
+			break;
+		}
+	}
+
+	job->state = PROGRAM_WRITE;
+	return pdi_command(h, CMD_PROGRAM_IMAGE, h->stage.phys, 0, 0);
+}
+
+/**
+ * \brief Blank check the next section the image reaches, then plan.
+ *
+ * Against the CRC of the erased section, see erase_blank_crc().
+ */
+static int pdi_program_check(struct pdi *h, struct pdi_job *job)
+{
+	for (; job->section < PLAN_SECTIONS; job->section++) {
+		if (erase_section_covered(job->section, job->size)) {
+			job->state = PROGRAM_CHECK;
+			return pdi_command(h, CMD_SECTION_CRC, job->section,
+					   0, 0);
+		}
+	}
+
+	erase_plan(&job->plan, job->image, job->size, job->current,
+		   job->blank, job->flags & PDI_PROGRAM_CHIP_ERASE);
+
+	/* the stage is shared, only fill it in once the job runs */
+	h->staged = NULL;
+	if (!h->stage_ok || stage_image(&h->stage, job->image, job->size,
+					job->current, &job->plan) < 0)
+		return ERR_NO_MEMORY;
+
+	job->stats.pages_skipped = job->plan.end / h->stage.hdr->page_size -
+				   h->stage.hdr->npages;
+
+	job->section = 0;
+	return pdi_program_erase(h, job);
+}
+
+static int pdi_program_step(struct pdi *h, struct pdi_job *job,
+			    int32_t result)
+{
+	uint32_t crc = h->shared_ram[SHM_LENGTH];
+
+	if (result != STATUS_OK)
+		return result;
+
+	switch (job->state) {
+	case PROGRAM_START:
+		job->state = PROGRAM_ENTER;
+		return pdi_command(h, CMD_ENTER_PROGMODE, 0, 0, 0);
+	case PROGRAM_ENTER:
+		job->session = 1;
+		job->section = 0;
+		return pdi_program_check(h, job);
+	case PROGRAM_CHECK:
+		job->blank[job->section] = crc ==
+					   erase_blank_crc(job->section);
+		job->section++;
+		return pdi_program_check(h, job);
+	case PROGRAM_ERASE:
+		/* a chip erase blanked the other sections as well */
+		if (job->plan.erase[job->section] == PLAN_CHIP)
+			job->section = PLAN_SECTIONS;
+		else
+			job->section++;
+		return pdi_program_erase(h, job);
+	default:
+		job->count = h->shared_ram[SHM_LENGTH];
+		job->stats.bytes_programmed = job->stats.pages_written *
+					      h->stage.hdr->page_size;
+		return STATUS_OK;
+	}
+}
+
+/**
+ * \brief Job programming a flash image.
+ *
+ * Only the flash sections the image reaches are touched, each erased in
+ * the cheapest way that leaves it holding the image, see erase_plan(). The
+ * EEPROM is kept unless PDI_PROGRAM_CHIP_ERASE allows a chip erase.
+ *
+ * \param current what the flash holds now, XNVM_FLASH_SIZE bytes, or NULL
+ * if unknown. Knowing it allows erasing only the pages that change.
+ *
+ * The image and the current contents must stay valid until the job is done.
+ */
+struct pdi_job *pdi_job_program(const uint8_t *image, size_t size,
+				const uint8_t *current, unsigned int flags,
+				pdi_done_cb done, void *user)
+{
+	struct pdi_job *job;
+	unsigned int i;
+
+	job = pdi_job_alloc(pdi_program_step, done, user);
+	if (!job)
+		return NULL;
+
+	job->image = image;
+	job->size = size;
+	job->current = current;
+	job->flags = flags;
+	for (i = 0; i < PLAN_SECTIONS; i++)
+		job->blank[i] = -1;
+
+	return job;
+}
+
+enum plan_run_state {
+	PLAN_RUN_START,
+	PLAN_RUN_ENTER,		/* CMD_ENTER_PROGMODE sent */
+	PLAN_RUN_SIGNATURE,	/* device signature read */
+	PLAN_RUN_SERIAL,	/* device serial read, for the journal */
+	PLAN_RUN_VERIFY,	/* last page the journal has read back */
+	PLAN_RUN_ERASE,		/* CMD_ERASE of an operation sent */
+	PLAN_RUN_WRITE,		/* CMD_PROGRAM_IMAGE with the plan stage sent */
+	PLAN_RUN_SEQUENCE,	/* CMD_SEQUENCE of the whole plan sent */
+	PLAN_RUN_PATCH,		/* CMD_WRITE_NVM of a slot sent */
+};
+
+/*
+ * Value of patch slot s, in job->values.
+ */
+static uint8_t *pdi_patch_value(struct pdi_job *job, unsigned int s)
+{
+	const struct plan_header *plan = job->precompiled;
+	uint8_t *value = job->values;
+	unsigned int i;
+
+	for (i = 0; i < s; i++)
+		value += plan->patches[i].length;
+
+	return value;
+}
+
+/*
+ * Whether every slot has its value, or every flash slot.
+ */
+static int pdi_patches_set(struct pdi_job *job, int flash_only)
+{
+	const struct plan_header *plan = job->precompiled;
+	unsigned int s;
+
+	for (s = 0; s < plan->npatches; s++) {
+		if (flash_only && plan->patches[s].area != PLAN_PATCH_FLASH)
+			continue;
+		if (!(job->patched & 1u << s))
+			return 0;
+	}
+
+	return 1;
+}
+
+/**
+ * \brief Put the values of the flash slots into a copy of the plan stage.
+ *
+ * Only the pages under the slots change, payload and CRC, the rest of the
+ * stage is left as it is. plan_check() made sure they are all staged.
+ */
+static void pdi_plan_patch(struct pdi_job *job, uint8_t *stage)
+{
+	const struct plan_header *plan = job->precompiled;
+	struct stage_header *hdr = (struct stage_header *)stage;
+	struct stage_page *map;
+	const struct plan_patch *p;
+	const uint8_t *value;
+	uint32_t address, end, base, i;
+	unsigned int s;
+
+	map = (struct stage_page *)(stage + hdr->map_offset);
+	for (s = 0; s < plan->npatches; s++) {
+		p = &plan->patches[s];
+		if (p->area != PLAN_PATCH_FLASH)
+			continue;
+
+		value = pdi_patch_value(job, s);
+		for (address = p->offset; address < p->offset + p->length;
+		     address = end) {
+			base = address - address % plan->page_size;
+			end = base + plan->page_size;
+			if (end > p->offset + p->length)
+				end = p->offset + p->length;
+
+			for (i = 0; map[i].address != base; i++)
+				;
+			memcpy(stage + map[i].offset + address - base,
+			       value + address - p->offset, end - address);
+			map[i].crc = crc16_update(CRC16_INIT,
+						  stage + map[i].offset,
+						  plan->page_size);
+		}
+	}
+}
+
+/**
+ * \brief Compile every operation of a plan into one sequence in DDR.
+ *
+ * With patch slots the stage is patched in a copy first, the sequence
+ * carries the pages as they are written.
+ */
+static int pdi_plan_sequence(struct pdi *h, struct pdi_job *job)
+{
+	const struct plan_header *plan = job->precompiled;
+	const struct stage_header *stage = plan_stage(plan);
+	uint8_t *copy = NULL;
+	struct bitstream bs;
+	unsigned int i;
+	int ret = 0;
+
+	if (!h->stage_ok)
+		return ERR_NO_MEMORY;
+
+	if (plan->npatches) {
+		copy = malloc(plan->stage_size);
+		if (!copy)
+			return ERR_NO_MEMORY;
+		memcpy(copy, stage, plan->stage_size);
+		pdi_plan_patch(job, copy);
+		stage = (const struct stage_header *)copy;
+	}
+
+	h->staged = NULL;
+	bitstream_init(&bs, h->stage.ddr, h->stage.size);
+	for (i = 0; i < plan->nops && ret == 0; i++) {
+		if (plan->ops[i].type == PLAN_OP_ERASE)
+			ret = bitstream_erase(&bs, plan->ops[i].arg);
+		else
+			ret = bitstream_stage(&bs, stage);
+	}
+	free(copy);
+	if (ret < 0)
+		return errno == ENOSPC ? ERR_NO_MEMORY : ERR_INVALID_ARG;
+
+	job->op = plan->nops;
+	job->state = PLAN_RUN_SEQUENCE;
+	return pdi_command(h, CMD_SEQUENCE, h->stage.phys, bs.nwords, 0);
+}
+
+/**
+ * \brief Whether the progress of a plan job goes to the journal.
+ *
+ * Only for a single target programmed by the firmware, page by page.
+ */
+static int pdi_journaled(struct pdi *h, struct pdi_job *job)
+{
+	return h->journal && h->engine == PDI_ENGINE_FIRMWARE &&
+	       !(job->channels & (job->channels - 1));
+}
+
+static int pdi_journal_record(struct pdi *h, struct pdi_job *job)
+{
+	if (journal_record(h->journal, job->plan_hash,
+			   job->precompiled->signature, job->serial,
+			   job->op, job->page) < 0)
+		return ERR_IO_ERROR;
+
+	return STATUS_OK;
+}
+
+/**
+ * \brief Check a page read back into slot 0 against what the plan wrote.
+ *
+ * Against the stage in DDR, which holds the values of the patch slots.
+ */
+static int pdi_plan_page_ok(struct pdi *h, const struct plan_header *plan,
+			    uint32_t index)
+{
+	const struct stage_header *stage = h->stage.hdr;
+	const struct stage_page *page = (const struct stage_page *)
+		((const uint8_t *)stage + stage->map_offset) + index;
+	const uint8_t erased = 0xFF;
+	uint16_t expect = page->crc;
+	uint32_t i;
+
+	if (page->flags & STAGE_PAGE_ERASE) {
+		expect = CRC16_INIT;
+		for (i = 0; i < plan->page_size; i++)
+			expect = crc16_update(expect, &erased, 1);
+	}
+
+	return crc16_update(CRC16_INIT,
+			    (const uint8_t *)&h->shared_ram[SHM_SLOT_OFFSET(0)],
+			    plan->page_size) == expect;
+}
+
+static int pdi_plan_next(struct pdi *h, struct pdi_job *job);
+static int pdi_plan_stage(struct pdi *h, struct pdi_job *job);
+
+/**
+ * \brief Pick a plan up where the journal says a previous run stopped.
+ *
+ * The last page it confirmed written is read back first. Pages after it
+ * may or may not have been written, they are written again. A run that
+ * stopped right after erasing has nothing to read back, so the erases
+ * leading up to where it stopped run again.
+ */
+static int pdi_plan_resume(struct pdi *h, struct pdi_job *job)
+{
+	const struct plan_header *plan = job->precompiled;
+	const struct stage_header *stage = plan_stage(plan);
+	const struct stage_page *map;
+	uint32_t op, page;
+	int ret;
+
+	if (!journal_find(h->journal, job->plan_hash, plan->signature,
+			  job->serial, &op, &page) || op > plan->nops)
+		return pdi_plan_next(h, job);
+
+	/* a program operation that completed ends on its last page */
+	if (page == 0 && op > 0 && plan->ops[op - 1].type == PLAN_OP_PROGRAM) {
+		op--;
+		page = stage->npages;
+	}
+
+	if (page == 0) {
+		while (op > 0 && plan->ops[op - 1].type == PLAN_OP_ERASE)
+			op--;
+		job->op = op;
+		return pdi_plan_next(h, job);
+	}
+
+	if (op == plan->nops || plan->ops[op].type != PLAN_OP_PROGRAM ||
+	    page > stage->npages)
+		return pdi_plan_next(h, job);
+
+	ret = pdi_plan_stage(h, job);
+	if (ret)
+		return ret;
+
+	map = (const struct stage_page *)((const uint8_t *)stage +
+					  stage->map_offset);
+	job->op = op;
+	job->page = page;
+	job->state = PLAN_RUN_VERIFY;
+	return pdi_command(h, CMD_READ_MEMORY,
+			   XNVM_FLASH_BASE + map[page - 1].address,
+			   plan->page_size, 0);
+}
+
+/**
+ * \brief Copy the stage of a plan to DDR, unless it is there already.
+ *
+ * The stage is laid out as the PRU reads it, one copy and it runs, and it
+ * stays there for the next board the plan runs on. The pages under the
+ * flash slots are then patched in place with the values of this job.
+ */
+static int pdi_plan_stage(struct pdi *h, struct pdi_job *job)
+{
+	const struct plan_header *plan = job->precompiled;
+
+	if (!h->stage_ok || plan->stage_size > h->stage.size)
+		return ERR_NO_MEMORY;
+	if (h->staged != plan) {
+		memcpy(h->stage.ddr, plan_stage(plan), plan->stage_size);
+		h->staged = plan;
+		job->staged = 0;
+	}
+	if (!job->staged) {
+		pdi_plan_patch(job, h->stage.ddr);
+		job->staged = 1;
+	}
+
+	return STATUS_OK;
+}
+
+/**
+ * \brief Run the next operation of a plan, or finish.
+ *
+ * Once the flash is written, the EEPROM and user signature slots are, one
+ * CMD_WRITE_NVM each.
+ */
+static int pdi_plan_next(struct pdi *h, struct pdi_job *job)
+{
+	const struct plan_header *plan = job->precompiled;
+	const struct plan_patch *p;
+	const struct plan_op *op;
+	int ret;
+
+	if (job->op == plan->nops) {
+		for (; job->patch < plan->npatches; job->patch++) {
+			p = &plan->patches[job->patch];
+			if (p->area == PLAN_PATCH_FLASH)
+				continue;
+			memcpy((void *)&h->shared_ram[SHM_SLOT_OFFSET(0)],
+			       pdi_patch_value(job, job->patch), p->length);
+			job->state = PLAN_RUN_PATCH;
+			return pdi_command(h, CMD_WRITE_NVM,
+					   plan_patch_address(p),
+					   p->length, 0);
+		}
+		if (pdi_journaled(h, job) && journal_clear(h->journal) < 0)
+			return ERR_IO_ERROR;
+		return STATUS_OK;
+	}
+
+	if (h->engine == PDI_ENGINE_SEQUENCER)
+		return pdi_plan_sequence(h, job);
+
+	op = &plan->ops[job->op];
+	if (op->type == PLAN_OP_ERASE) {
+		job->op++;
+		job->state = PLAN_RUN_ERASE;
+		return pdi_command(h, CMD_ERASE, op->arg, 0, 0);
+	}
+
+	ret = pdi_plan_stage(h, job);
+	if (ret)
+		return ret;
+
+	/* a batch at a time when journaled, each confirmed on disk */
+	job->state = PLAN_RUN_WRITE;
+	return pdi_command(h, CMD_PROGRAM_IMAGE, h->stage.phys, job->page,
+			   pdi_journaled(h, job) ? PDI_JOURNAL_PAGES : 0);
+}
+
+static int pdi_plan_step(struct pdi *h, struct pdi_job *job, int32_t result)
+{
+	const struct plan_header *plan = job->precompiled;
+	uint32_t mask;
+	unsigned int i, slot;
+	int ret;
+
+	if (result != STATUS_OK)
+		return result;
+
+	switch (job->state) {
+	case PLAN_RUN_START:
+		/* every target would get the values of one */
+		if (!pdi_patches_set(job, 0) ||
+		    (plan->npatches && (job->channels & (job->channels - 1))))
+			return ERR_INVALID_ARG;
+		job->state = PLAN_RUN_ENTER;
+		return pdi_command(h, CMD_ENTER_PROGMODE, 0, 0, 0);
+	case PLAN_RUN_ENTER:
+		job->session = 1;
+		job->state = PLAN_RUN_SIGNATURE;
+		return pdi_command(h, CMD_READ_MEMORY, plan->signature_address,
+				   3, 0);
+	case PLAN_RUN_SIGNATURE:
+		/* with several channels, channel n read into slot n */
+		mask = job->channels ? job->channels : 1;
+		for (i = 0; i < PDI_CHANNELS; i++) {
+			if (!(mask & 1 << i))
+				continue;
+			slot = mask & (mask - 1) ? i : 0;
+			job->stats.bytes_read += 3;
+			if (memcmp((const void *)&h->shared_ram[SHM_SLOT_OFFSET(slot)],
+				   plan->signature, 3))
+				return ERR_UNSUPPORTED_DEV;
+		}
+		if (pdi_journaled(h, job)) {
+			job->state = PLAN_RUN_SERIAL;
+			return pdi_command(h, CMD_READ_MEMORY,
+					   XNVM_CALIBRATION_BASE +
+					   JOURNAL_SERIAL_OFFSET,
+					   JOURNAL_SERIAL_SIZE, 0);
+		}
+		break;
+	case PLAN_RUN_SERIAL:
+		job->stats.bytes_read += JOURNAL_SERIAL_SIZE;
+		memcpy(job->serial,
+		       (const void *)&h->shared_ram[SHM_SLOT_OFFSET(0)],
+		       JOURNAL_SERIAL_SIZE);
+		return pdi_plan_resume(h, job);
+	case PLAN_RUN_VERIFY:
+		/* not what the plan wrote: the device was touched since */
+		job->stats.bytes_read += plan->page_size;
+		if (pdi_plan_page_ok(h, plan, job->page - 1)) {
+			job->resumed = job->page;
+		} else {
+			job->op = 0;
+			job->page = 0;
+		}
+		break;
+	case PLAN_RUN_ERASE:
+		if (pdi_journaled(h, job)) {
+			ret = pdi_journal_record(h, job);
+			if (ret)
+				return ret;
+		}
+		break;
+	case PLAN_RUN_WRITE:
+		job->page = job->count = h->shared_ram[SHM_LENGTH];
+		job->stats.bytes_programmed = job->stats.pages_written *
+					      plan->page_size;
+		if (job->page >= plan_stage(plan)->npages) {
+			job->op++;
+			job->page = 0;
+		}
+		if (pdi_journaled(h, job)) {
+			ret = pdi_journal_record(h, job);
+			if (ret)
+				return ret;
+		}
+		break;
+	case PLAN_RUN_SEQUENCE:
+		job->count = plan_stage(plan)->npages;
+		job->stats.bytes_programmed = job->stats.pages_written *
+					      plan->page_size;
+		break;
+	case PLAN_RUN_PATCH:
+		job->stats.bytes_programmed += plan->patches[job->patch].length;
+		job->patch++;
+		break;
+	default:
+		break;
+	}
+
+	return pdi_plan_next(h, job);
+}
+
+/**
+ * \brief Job running a plan compiled by plan_compile().
+ *
+ * The operations run as the plan lists them, nothing is worked out from
+ * the image. With PDI_ENGINE_SEQUENCER they are compiled into a single
+ * CMD_SEQUENCE once the signature matches. The plan is refused with
+ * ERR_UNSUPPORTED_DEV, before anything is erased, if the device signature
+ * is not the one it was compiled for.
+ *
+ * The plan must stay mapped until the job is done. Returns NULL, with
+ * errno set, if the plan is not intact. The stage of a plan run again on
+ * the same handle, board after board, is not copied again, only the
+ * pages under its flash slots are patched, see pdi_job_patch().
+ *
+ * With a journal, see pdi_set_journal(), a plan cut short on a device
+ * carries on where it stopped the next time it runs on that device.
+ */
+struct pdi_job *pdi_job_program_plan(const struct plan_header *plan,
+				     size_t size, pdi_done_cb done,
+				     void *user)
+{
+	struct pdi_job *job;
+	unsigned int i;
+
+	if (plan_check(plan, size) < 0)
+		return NULL;
+
+	job = pdi_job_alloc(pdi_plan_step, done, user);
+	if (!job)
+		return NULL;
+
+	job->multi = 1;
+	job->precompiled = plan;
+	job->size = size;
+	job->plan_hash = journal_hash(plan, size);
+	for (i = 0; i < PLAN_SECTIONS; i++)
+		job->plan.erase[i] = plan->erase[i];
+	job->plan.end = plan->end;
+	job->stats.pages_skipped = plan->end / plan->page_size -
+				   plan_stage(plan)->npages;
+
+	return job;
+}
+
+enum verify_state {
+	VERIFY_START,
+	VERIFY_ENTER,		/* CMD_ENTER_PROGMODE sent */
+	VERIFY_SIGNATURE,	/* device signature read */
+	VERIFY_PAGES,		/* CMD_VERIFY_IMAGE from job->page on sent */
+};
+
+static int pdi_verify_step(struct pdi *h, struct pdi_job *job,
+			   int32_t result)
+{
+	const struct plan_header *plan = job->precompiled;
+	const struct stage_header *stage = plan_stage(plan);
+	const struct stage_page *map;
+	struct pdi_mismatch *m;
+	struct verify_result res;
+	uint32_t i;
+	int ret;
+
+	if (result != STATUS_OK)
+		return result;
+
+	switch (job->state) {
+	case VERIFY_START:
+		if (!pdi_patches_set(job, 1))
+			return ERR_INVALID_ARG;
+		job->state = VERIFY_ENTER;
+		return pdi_command(h, CMD_ENTER_PROGMODE, 0, 0, 0);
+	case VERIFY_ENTER:
+		job->session = 1;
+		job->state = VERIFY_SIGNATURE;
+		return pdi_command(h, CMD_READ_MEMORY, plan->signature_address,
+				   3, 0);
+	case VERIFY_SIGNATURE:
+		job->stats.bytes_read += 3;
+		if (memcmp((const void *)&h->shared_ram[SHM_SLOT_OFFSET(0)],
+			   plan->signature, 3))
+			return ERR_UNSUPPORTED_DEV;
+		ret = pdi_plan_stage(h, job);
+		if (ret)
+			return ret;
+		job->state = VERIFY_PAGES;
+		break;
+	default:
+		memcpy(&res, (const void *)&h->shared_ram[SHM_DATA],
+		       sizeof(res));
+		map = (const struct stage_page *)((const uint8_t *)stage +
+						  stage->map_offset);
+		for (i = 0; i < res.pages; i++) {
+			if (!(res.bitmap[i / 32] & 1u << i % 32))
+				continue;
+			m = &job->mismatches[job->nmismatches++];
+			m->address = map[job->page + i].address;
+			m->offset = res.first[i];
+		}
+		job->page = job->count = h->shared_ram[SHM_LENGTH];
+		break;
+	}
+
+	if (job->page < stage->npages)
+		return pdi_command(h, CMD_VERIFY_IMAGE, h->stage.phys,
+				   job->page, 0);
+
+	return job->nmismatches ? ERR_BAD_DATA : STATUS_OK;
+}
+
+/**
+ * \brief Job checking that the flash holds what a plan writes.
+ *
+ * Every page the plan writes or erases is read back and compared on the
+ * PRU, against the stage of the plan, without trusting any CRC the device
+ * computes. Only the verdict crosses over: a bitmap and the first byte
+ * that differs, for up to VERIFY_PAGES_MAX pages per command. Pages the
+ * plan leaves alone are not read.
+ *
+ * Done with ERR_BAD_DATA if a page differs, see pdi_job_mismatches().
+ * The plan must stay mapped until the job is done. Returns NULL, with
+ * errno set, if the plan is not intact.
+ */
+struct pdi_job *pdi_job_verify_plan(const struct plan_header *plan,
+				    size_t size, pdi_done_cb done,
+				    void *user)
+{
+	struct pdi_job *job;
+	uint32_t npages;
+
+	if (plan_check(plan, size) < 0)
+		return NULL;
+
+	job = pdi_job_alloc(pdi_verify_step, done, user);
+	if (!job)
+		return NULL;
+
+	npages = plan_stage(plan)->npages;
+	job->mismatches = calloc(npages ? npages : 1,
+				 sizeof(*job->mismatches));
+	if (!job->mismatches) {
+		free(job);
+		return NULL;
+	}
+	job->precompiled = plan;
+	job->size = size;
+
+	return job;
+}
+
+/**
+ * \brief Give a patch slot of the plan its value for this device.
+ *
+ * Before the job is submitted. A plan job needs a value for every slot of
+ * the plan, a verify job for every flash slot, or they fail with
+ * ERR_INVALID_ARG. The value is copied, and goes into the plan hash the
+ * journal keys progress on.
+ *
+ * \retval 0 on success, -1 with errno set to EINVAL if the plan has no
+ * slot by that name or the value does not fit it, ENOMEM otherwise.
+ */
+int pdi_job_patch(struct pdi_job *job, const char *name,
+		  const uint8_t *data, uint32_t length)
+{
+	const struct plan_header *plan = job->precompiled;
+	uint32_t size;
+	int s;
+
+	s = plan ? plan_patch_find(plan, name) : -1;
+	if (s < 0 || plan->patches[s].length != length) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	size = plan_patch_size(plan);
+	if (!job->values) {
+		job->values = calloc(1, size);
+		if (!job->values)
+			return -1;
+	}
+	memcpy(pdi_patch_value(job, s), data, length);
+	job->patched |= 1u << s;
+
+	job->plan_hash = journal_hash(plan, job->size) ^
+			 journal_hash(job->values, size);
+	return 0;
+}
+
+static int pdi_trace_step(struct pdi *h, struct pdi_job *job, int32_t result)
+{
+	struct trace_header hdr = {
+		.magic = TRACE_MAGIC,
+		.version = TRACE_VERSION,
+		.event_size = sizeof(struct trace_event),
+		.clock_hz = PRU_CLOCK_HZ,
+	};
+
+	if (result != STATUS_OK)
+		return result;
+
+	if (job->state++ == 0) {
+		h->trace = NULL;
+		return pdi_command(h, CMD_TRACE, job->trace != NULL, 0, 0);
+	}
+
+	if (job->trace) {
+		if (fwrite(&hdr, sizeof(hdr), 1, job->trace) != 1)
+			return ERR_IO_ERROR;
+		h->trace = job->trace;
+		h->trace_tail = pdi_trace_ring(h)->head;
+	}
+
+	return STATUS_OK;
+}
+
+/**
+ * \brief Job starting or stopping the bus trace.
+ *
+ * Every PRU command of the jobs after this one is written to the trace,
+ * with the bus events it caused, see trace.h. The file stays the caller's,
+ * to be closed once a trace job without one ran, or the handle is closed.
+ *
+ * \param f where to write the trace, NULL to stop tracing.
+ */
+struct pdi_job *pdi_job_trace(FILE *f, pdi_done_cb done, void *user)
+{
+	struct pdi_job *job;
+
+	job = pdi_job_alloc(pdi_trace_step, done, user);
+	if (job) {
+		job->trace = f;
+		job->multi = 1;
+	}
+
+	return job;
+}
+
+static int pdi_detect_step(struct pdi *h, struct pdi_job *job,
+			   int32_t result)
+{
+	/* the PRU gives up every DETECT_WINDOW_MS, ask again */
+	if (job->state++ == 0 || result == ERR_TIMEOUT)
+		return pdi_command(h, CMD_DETECT, job->present,
+				   job->period_ms, 0);
+
+	return result;
+}
+
+/**
+ * \brief Job waiting for the targets to be connected, or removed.
+ *
+ * The PRU probes the PDI of every channel of the job now and then, see
+ * CMD_DETECT, until they all answer or none does any more. The job runs
+ * until then, or until it is cancelled.
+ *
+ * \param present wait for the targets to be connected, or removed.
+ * \param period_ms time between two probes, 0 for DETECT_PERIOD_MS.
+ */
+struct pdi_job *pdi_job_detect(int present, uint32_t period_ms,
+			       pdi_done_cb done, void *user)
+{
+	struct pdi_job *job;
+
+	if (period_ms > DETECT_WINDOW_MS) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	job = pdi_job_alloc(pdi_detect_step, done, user);
+	if (!job)
+		return NULL;
+
+	job->present = present;
+	job->period_ms = period_ms;
+	job->multi = 1;
+
+	return job;
+}
+
+/**
+ * \brief Device information read by an identify job.
+ */
+const struct devinfo *pdi_job_devinfo(struct pdi_job *job)
+{
+	return &job->info;
+}
+
+/**
+ * \brief PHY cycle budgets read by a phy job.
+ */
+const struct phy_info *pdi_job_phy_info(struct pdi_job *job)
+{
+	return &job->phy;
+}
+
+/**
+ * \brief Sampling point sweep of a calibrate job.
+ */
+const struct phy_calibration *pdi_job_calibration(struct pdi_job *job)
+{
+	return &job->cal;
+}
+
+/**
+ * \brief Erase plan followed by a program job, once it got that far, or
+ * the one a plan job runs.
+ */
+const struct erase_plan *pdi_job_erase_plan(struct pdi_job *job)
+{
+	return &job->plan;
+}
+
+/**
+ * \brief Pages a verify job found to differ, in plan order.
+ */
+const struct pdi_mismatch *pdi_job_mismatches(struct pdi_job *job,
+					      unsigned int *n)
+{
+	*n = job->nmismatches;
+	return job->mismatches;
+}
+
+/**
+ * \brief Pages of a plan job a previous run had written, 0 if it did not
+ * resume.
+ */
+uint32_t pdi_job_resumed(struct pdi_job *job)
+{
+	return job->resumed;
+}
+
+/**
+ * \brief Bytes read by a read job, bytes written by a data space write
+ * job, pages written by a program job or pages compared by a verify job.
+ */
+uint32_t pdi_job_count(struct pdi_job *job)
+{
+	return job->count;
+}
+
+/**
+ * \brief Metrics of a job, complete once its done callback runs.
+ */
+const struct pdi_stats *pdi_job_stats(struct pdi_job *job)
+{
+	return &job->stats;
+}
+
+/**
+ * \brief Metrics summed over every job that ran on the handle.
+ */
+const struct pdi_stats *pdi_stats(struct pdi *h)
+{
+	return &h->stats;
+}
+
+const char *pdi_phase_name(enum pdi_phase phase)
+{
+	return phase_names[phase];
+}
+
+const char *pdi_completion_name(enum pdi_completion mode)
+{
+	return completion_names[mode];
+}
@@ -0,0 +1,216 @@
+/**
+ * PDI host library.
+ *
+ * Copyright (C) 2015-2017 Toby Churchill Ltd.
+ *
+ * Enric Balletbo Serra <enric.balletbo@collabora.com>
+ *
+ * License
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+#ifndef LIBPDI_H_INCLUDED
+#define LIBPDI_H_INCLUDED
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+
+#include "status_codes.h"
+#include "prog.h"
+#include "erase.h"
+
+/*
+ * A handle owns the PRU. Jobs are queued on it with pdi_submit() and run
+ * one after the other; nothing ever blocks. The caller waits for pdi_fd()
+ * to become readable, in its own event loop, and then calls pdi_process(),
+ * which advances the running job and fires the callbacks.
+ *
+ * Job callbacks run from pdi_process(). A job is freed by the library once
+ * its done callback returns, or by pdi_job_discard() if never submitted.
+ */
+struct pdi;
+struct pdi_job;
+struct plan_header;
+struct journal;
+
+/**
+ * \brief Called once when a job completes, fails or is cancelled.
+ *
+ * \param status STATUS_OK, ERR_FLUSHED if cancelled, or another status code.
+ */
+typedef void (*pdi_done_cb)(struct pdi_job *job, int status, void *user);
+
+/**
+ * \brief Called for every chunk of data read by a read job.
+ *
+ * \param region index of the region in the job's region list.
+ * \param offset offset of the chunk within the region.
+ */
+typedef void (*pdi_chunk_cb)(struct pdi_job *job, unsigned int region,
+			     uint32_t offset, const uint8_t *data,
+			     uint32_t length, void *user);
+
+/**
+ * \brief Time budgets that can be overridden, see pdi_set_timeouts().
+ */
+enum pdi_timeout {
+	PDI_TIMEOUT_BYTE,	/* start of a response byte */
+	PDI_TIMEOUT_NVMEN,	/* NVM enable after KEY */
+	PDI_TIMEOUT_BUSY,	/* page erase and write */
+	PDI_TIMEOUT_ERASE,	/* chip erase */
+	PDI_TIMEOUT_NUM,
+};
+
+/**
+ * \brief How command completions are collected, see pdi_set_completion().
+ */
+enum pdi_completion {
+	PDI_COMPLETION_IRQ,	/* sleep until the PRU interrupt */
+	PDI_COMPLETION_POLL,	/* spin on the command word for a while */
+	PDI_COMPLETION_HYBRID,	/* spin only for commands that are quick */
+	PDI_COMPLETION_NUM,
+};
+
+/**
+ * \brief What runs the NVM operations of plan jobs, see pdi_set_engine().
+ */
+enum pdi_engine {
+	PDI_ENGINE_FIRMWARE,	/* the xnvm code of the firmware */
+	PDI_ENGINE_SEQUENCER,	/* bits compiled on the host, CMD_SEQUENCE */
+};
+
+/**
+ * \brief A memory range to read, PDI address space, or data space for
+ * pdi_job_read_data().
+ */
+struct pdi_region {
+	uint32_t address;
+	uint32_t size;
+};
+
+/**
+ * \brief A page that does not hold what the plan writes.
+ */
+struct pdi_mismatch {
+	uint32_t address;	/* flash offset of the page */
+	uint32_t offset;	/* first byte that differs, in the page */
+};
+
+/**
+ * \brief Where the time of a job goes, by the PRU commands it runs.
+ */
+enum pdi_phase {
+	PDI_PHASE_SETUP,	/* time budgets, PHY */
+	PDI_PHASE_ENTER,	/* reset and NVM enable */
+	PDI_PHASE_CHECK,	/* section CRCs, readback compares */
+	PDI_PHASE_ERASE,
+	PDI_PHASE_WRITE,
+	PDI_PHASE_READ,
+	PDI_PHASE_LEAVE,
+	PDI_PHASE_DETECT,	/* waiting for a target to come or go */
+	PDI_PHASE_NUM,
+};
+
+/**
+ * \brief Metrics of a job, or summed over every job run on a handle.
+ *
+ * Phase times are command round trips as the host sees them, host_us is
+ * the rest of the elapsed time. The second half are the firmware counters
+ * of struct pdi_metrics over the job's commands. All fields are uint64_t.
+ */
+struct pdi_stats {
+	uint64_t jobs;
+	uint64_t elapsed_us;			/* first command to done */
+	uint64_t phase_us[PDI_PHASE_NUM];
+	uint64_t host_us;			/* between commands */
+	uint64_t bytes_programmed;
+	uint64_t bytes_read;
+	uint64_t pages_skipped;			/* needed no write */
+	uint64_t polled;			/* completions caught spinning */
+	uint64_t polled_us;			/* their round trips */
+	uint64_t irqs;				/* completions by interrupt */
+	uint64_t irq_us;			/* their round trips */
+	uint64_t spin_us;			/* spent spinning in vain */
+
+	uint64_t commands;
+	uint64_t pru_cycles;			/* PRU busy on the commands */
+	uint64_t tx_frames;
+	uint64_t rx_frames;
+	uint64_t frame_errors;
+	uint64_t rx_timeouts;
+	uint64_t retries;
+	uint64_t busy_polls;
+	uint64_t busy_cycles;			/* waiting for the NVM */
+	uint64_t pages_written;
+	uint64_t pages_erased;
+	uint64_t keepalives;			/* idle clocking between commands */
+};
+
+/* pdi_job_program() flags */
+#define PDI_PROGRAM_CHIP_ERASE	0x0001	/* a chip erase, EEPROM included, is fine */
+
+struct pdi *pdi_open(void);
+void pdi_close(struct pdi *h);
+int pdi_fd(struct pdi *h);
+int pdi_process(struct pdi *h);
+int pdi_run(struct pdi *h);
+int pdi_idle(struct pdi *h);
+void pdi_set_timeouts(struct pdi *h, const uint32_t *timeouts);
+void pdi_set_engine(struct pdi *h, enum pdi_engine engine);
+void pdi_set_channels(struct pdi *h, uint32_t mask);
+void pdi_set_journal(struct pdi *h, struct journal *journal);
+void pdi_set_completion(struct pdi *h, enum pdi_completion mode,
+			uint32_t spin_us);
+
+struct pdi_job *pdi_job_identify(pdi_done_cb done, void *user);
+struct pdi_job *pdi_job_phy(uint32_t clk_hz, pdi_done_cb done, void *user);
+struct pdi_job *pdi_job_phy_select(int backend, uint32_t clk_hz,
+				   pdi_done_cb done, void *user);
+struct pdi_job *pdi_job_calibrate(uint32_t reads, pdi_done_cb done,
+				  void *user);
+struct pdi_job *pdi_job_read(const struct pdi_region *regions,
+			     unsigned int nregions, pdi_chunk_cb chunk,
+			     pdi_done_cb done, void *user);
+struct pdi_job *pdi_job_read_data(const struct pdi_region *regions,
+				  unsigned int nregions, pdi_chunk_cb chunk,
+				  pdi_done_cb done, void *user);
+struct pdi_job *pdi_job_write_data(uint32_t address, const uint8_t *data,
+				   uint32_t length, pdi_done_cb done,
+				   void *user);
+struct pdi_job *pdi_job_program(const uint8_t *image, size_t size,
+				const uint8_t *current, unsigned int flags,
+				pdi_done_cb done, void *user);
+struct pdi_job *pdi_job_program_plan(const struct plan_header *plan,
+				     size_t size, pdi_done_cb done,
+				     void *user);
+struct pdi_job *pdi_job_verify_plan(const struct plan_header *plan,
+				    size_t size, pdi_done_cb done,
+				    void *user);
+int pdi_job_patch(struct pdi_job *job, const char *name,
+		  const uint8_t *data, uint32_t length);
+struct pdi_job *pdi_job_trace(FILE *f, pdi_done_cb done, void *user);
+struct pdi_job *pdi_job_detect(int present, uint32_t period_ms,
+			       pdi_done_cb done, void *user);
+
+int pdi_submit(struct pdi *h, struct pdi_job *job);
+int pdi_cancel(struct pdi *h, struct pdi_job *job);
+void pdi_job_discard(struct pdi_job *job);
+
+const struct devinfo *pdi_job_devinfo(struct pdi_job *job);
+const struct phy_info *pdi_job_phy_info(struct pdi_job *job);
+const struct phy_calibration *pdi_job_calibration(struct pdi_job *job);
+const struct erase_plan *pdi_job_erase_plan(struct pdi_job *job);
+uint32_t pdi_job_count(struct pdi_job *job);
+uint32_t pdi_job_resumed(struct pdi_job *job);
+const struct pdi_mismatch *pdi_job_mismatches(struct pdi_job *job,
+					      unsigned int *n);
+const struct pdi_stats *pdi_job_stats(struct pdi_job *job);
+const struct pdi_stats *pdi_stats(struct pdi *h);
+const char *pdi_phase_name(enum pdi_phase phase);
+const char *pdi_completion_name(enum pdi_completion mode);
+
+#endif
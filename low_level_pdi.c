@@ -13,92 +13,174 @@
  */
 
 #include "low_level_pdi.h"
+#include "pdi_phy.h"
+#include "timer.h"
+#include "crc16.h"
 
 /* PRU registers */
 volatile register unsigned int __R30;
 volatile register unsigned int __R31;
 
-/**
- * \brief Set the PDI DATA tx pin low.
- */
-#define pdi_data_tx_low() do { \
-       PDI_OUTPUT_PORT &= ~(1 << PDI_DATA_PIN_O); \
-} while (0)
-
-/**
- * \brief Set the PDI DATA tx pin high.
- */
-#define pdi_data_tx_high() do { \
-       PDI_OUTPUT_PORT |= (1 << PDI_DATA_PIN_O); \
-} while (0)
-
 /**
  * \brief Set the PDI DATA tx pin enabled.
  */
 #define pdi_data_tx_enable() do { \
-        PDI_OUTPUT_PORT |= (1 << PDI_TX_PIN_OE); \
+	if (pdi_phy.oe != PHY_NO_PIN) \
+		PDI_OUTPUT_PORT |= (1 << pdi_phy.oe); \
 } while (0)
 
 /**
  * \brief Set the PDI DATA tx pin in tri-state mode.
  */
 #define pdi_data_tx_disable() do { \
-        PDI_OUTPUT_PORT &= ~(1 << PDI_TX_PIN_OE); \
+	if (pdi_phy.oe != PHY_NO_PIN) \
+		PDI_OUTPUT_PORT &= ~(1 << pdi_phy.oe); \
 } while (0)
 
+struct pdi_phy pdi_phy = {
+	PDI_CLK_PIN,
+	PDI_DATA_PIN_O,
+	PDI_DATA_PIN_I,
+	(PDI_CLK_RATE_DIV_2 - PHY_HALF_FIXED) / 2,
+	0,
+	PDI_TX_PIN_OE,
+};
+
+/*
+ * Data pins of each channel on the bit-bang PHY, PDI_CLK is shared. The
+ * pins of the channel in use are in pdi_phy.
+ */
+static const struct pdi_channel {
+	uint32_t tx;
+	uint32_t rx;
+	uint32_t oe;
+} pdi_channel_pins[PDI_CHANNELS] = {
+	{ PDI_DATA_PIN_O, PDI_DATA_PIN_I, PDI_TX_PIN_OE },
+	{ PDI1_DATA_PIN_O, PDI1_DATA_PIN_I, PDI1_TX_PIN_OE },
+};
+
+/* Channels pdi_init() and pdi_deinit() drive, and the one in use */
+static uint32_t pdi_channel_mask = 1;
+static uint32_t pdi_channel;
+
+struct pdi_metrics pdi_metrics;
+
+/* Bus trace, see CMD_TRACE */
+#pragma DATA_SECTION(trace_ring, ".pdi_trace")
+static volatile struct trace_ring trace_ring;
+static uint32_t trace_pos;
+bool pdi_trace_on;
+
 /**
- * \brief Read PDI data bit
+ * \brief Start recording the bus from an empty ring, or stop.
  */
-static inline bool pdi_data_rx_bit(void)
+void pdi_trace_enable(bool on)
 {
-	return (PDI_INPUT_PORT & (1 << PDI_DATA_PIN_I));
+	trace_ring.head = 0;
+	trace_pos = 0;
+	pdi_trace_on = on;
 }
 
 /**
- * \brief Write PDI data bit.
+ * \brief Record a bus event, if tracing.
  */
-static inline void pdi_write_bit(bool bit)
+void pdi_trace(enum trace_type type, uint8_t data, uint16_t arg)
 {
-	pdi_clk_low();
+	volatile struct trace_event *ev;
 
-	if (bit)
-		pdi_data_tx_high();
-	else
-		pdi_data_tx_low();
+	if (!pdi_trace_on)
+		return;
 
-	/* wait the 1st half of our clock cycle (50us) */
-	__delay_cycles(PDI_CLK_RATE_DIV_2);
+	ev = &trace_ring.events[trace_pos];
+	ev->cycles = timer_cycles();
+	ev->type = type;
+	ev->data = data;
+	ev->arg = arg;
 
-	pdi_clk_high();
+	/* no division on the PRU, the position wraps on its own */
+	if (++trace_pos == TRACE_EVENTS)
+		trace_pos = 0;
+	trace_ring.head++;
+}
 
-	/* wait the 2nd half of our clock cycle (50us) */
-	__delay_cycles(PDI_CLK_RATE_DIV_2);
+static void bitbang_nop(void)
+{
 }
 
-/**
- * \brief Read PDI data bit.
- *
- * Returns data bit value.
- */
-static inline bool pdi_read_bit(void)
+static void bitbang_tx(uint32_t bits, uint32_t nbits)
 {
-	bool bit;
+	pdi_phy_tx(&pdi_phy, bits, nbits);
+}
 
-	pdi_clk_low();
-	/* wait the 1st half of our clock cycle (50us) */
-	__delay_cycles(PDI_CLK_RATE_DIV_2);
+static uint32_t bitbang_rx(uint32_t hunt)
+{
+	return pdi_phy_rx(&pdi_phy, hunt);
+}
 
-	pdi_clk_high();
+static uint32_t bitbang_rx_burst(uint8_t *data, uint32_t length, uint32_t hunt)
+{
+	return pdi_phy_rx_burst(&pdi_phy, data, length, hunt);
+}
+
+static enum status_code bitbang_set_clock(uint32_t half_cycles)
+{
+	if (half_cycles > PHY_HALF_CYCLES(PHY_HALF_MAX))
+		return ERR_INVALID_ARG;
+
+	/* 10 MHz rounds up to the fastest the loop does, faster is refused */
+	if (half_cycles + 1 < PHY_HALF_CYCLES(PHY_HALF_MIN))
+		return ERR_INVALID_ARG;
 
-	/* read back data */
-	bit = pdi_data_rx_bit();
-	
-	/* wait the 2nd half of our clock cycle (50us) */
-	__delay_cycles(PDI_CLK_RATE_DIV_2);
+	pdi_phy.half = (half_cycles - PHY_HALF_FIXED + 1) / 2;
+	if (pdi_phy.sample > PHY_SAMPLE_MAX(pdi_phy.half))
+		pdi_phy.sample = 0;
 
-	return bit;
+	return STATUS_OK;
 }
 
+static uint32_t bitbang_half_cycles(void)
+{
+	return PHY_HALF_CYCLES(pdi_phy.half);
+}
+
+static enum status_code bitbang_set_sample(uint32_t sample)
+{
+	if (sample > PHY_SAMPLE_MAX(pdi_phy.half))
+		return ERR_INVALID_ARG;
+
+	pdi_phy.sample = sample;
+
+	return STATUS_OK;
+}
+
+static uint32_t bitbang_max_sample(void)
+{
+	return PHY_SAMPLE_MAX(pdi_phy.half);
+}
+
+static uint32_t bitbang_sample_cycles(uint32_t sample)
+{
+	return PHY_SAMPLE_CYCLES(sample);
+}
+
+const struct pdi_phy_ops pdi_phy_bitbang = {
+	bitbang_nop,
+	bitbang_nop,
+	bitbang_tx,
+	bitbang_rx,
+	bitbang_rx_burst,
+	bitbang_set_clock,
+	bitbang_half_cycles,
+	bitbang_set_sample,
+	bitbang_max_sample,
+	bitbang_sample_cycles,
+	PHY_HALF_CYCLES(PHY_HALF_MIN),
+	PHY_HALF_CYCLES(PHY_HALF_MAX),
+	PHY_HALF_FIXED,
+};
+
+const struct pdi_phy_ops *pdi_phy_ops = &pdi_phy_bitbang;
+
 /**
  * \brief Write a single tx frame.
  *
@@ -106,108 +188,239 @@ static inline bool pdi_read_bit(void)
  */
 static inline void pdi_write_frame(uint8_t data)
 {
-	uint8_t bit;
-
-	/* start bit */
-	pdi_write_bit(0);
-
-	/* write data bits */
-	for (bit = 0; bit < 8; bit++)
-		pdi_write_bit(data & (1 << bit));
+	uint32_t parity = data;
 
 	/* parity bit (even) */
-	bit = 0;
-	while (data) {
-		bit = !bit;
-		data = data & (data - 1);
-	}
-	pdi_write_bit(bit);
+	parity ^= parity >> 4;
+	parity ^= parity >> 2;
+	parity ^= parity >> 1;
 
-	/* stop bits (2) */
-	pdi_write_bit(1);
-	pdi_write_bit(1);
+	/* start bit, data bits LSB first, parity and two stop bits */
+	pdi_phy_ops->tx((uint32_t)data << 1 | (parity & 1) << 9 | 3 << 10,
+			PHY_FRAME_BITS);
 }
 
 /**
  * \brief Write a BREAK byte to PDI
+ *
+ * Eight clocks with the data line idle.
  */
 static void pdi_write_break(void)
 {
-	int i;
-
-	for (i = 0; i < 8; i++) {
-		pdi_clk_low();
+	pdi_phy_ops->tx(0xFF, 8);
+}
 
-		/* wait the 1st half of our clock cycle (50us) */
-		__delay_cycles(PDI_CLK_RATE_DIV_2);
+/**
+ * \brief Resynchronise the PDI with a double BREAK.
+ *
+ * A BREAK is a frame of 12 low bits. Two of them in a row reset the PDI
+ * receiver whatever direction it was in, and clear the error state it
+ * enters after a parity or stop bit error. The NVM interface keeps its
+ * state.
+ */
+void pdi_send_break(void)
+{
+	pdi_data_tx_enable();
 
-		pdi_clk_high();
+	/* two BREAKs, then back to idle before the next frame */
+	pdi_phy_ops->tx(3 << (2 * PHY_FRAME_BITS), 2 * PHY_FRAME_BITS + 2);
+	pdi_trace(TRACE_BREAK, 0, 0);
+}
 
-		/* wait the 2nd half of our clock cycle (50us) */
-		__delay_cycles(PDI_CLK_RATE_DIV_2);
-	}
+/**
+ * \brief Clock idle bits, to keep an enabled PDI from timing out.
+ *
+ * Idle bits outside of a frame are ignored by the PDI, only the clock
+ * activity counts. PDI_CLK is shared, so every channel in use is kept.
+ * Not traced, nothing happens on the bus that a replay needs.
+ */
+void pdi_keepalive(void)
+{
+	pdi_data_tx_enable();
+	pdi_phy_ops->tx(0xFF, PDI_KEEPALIVE_BITS);
+	pdi_metrics.keepalives++;
 }
 
 /**
  * \brief Read a byte from PDI.
  *
  * \param value Pointer to buffer memory where data to be stored.
- * \param retries the retry count.
+ * \param timeout_us time budget to see the start bit, in microseconds.
  *
  * \retval STATUS_OK read successfully.
- * \retval ERR_TIMEOUT read fail.
+ * \retval ERR_TIMEOUT no start bit within the time budget.
+ * \retval ERR_BAD_DATA parity or stop bit error.
  *
  */
-enum status_code pdi_get_byte(uint8_t *value, uint32_t retries)
+enum status_code pdi_get_byte(uint8_t *value, uint32_t timeout_us)
 {
-	bool	bit;
-	uint8_t i, parity = 0;
+	struct deadline dl;
+	uint32_t frame;
+
+	deadline_set(&dl, timeout_us);
 
 	pdi_data_tx_disable();
 
 	/* Wait for start bit */
-	while (retries) {
-		if (!pdi_read_bit())
-			break;
-		retries--;
+	do {
+		frame = pdi_phy_ops->rx(PHY_HUNT_CLOCKS);
+	} while (frame == PHY_NO_START && !deadline_expired(&dl));
+
+	pdi_data_tx_enable();
+
+	if (frame == PHY_NO_START) {
+		pdi_metrics.rx_timeouts++;
+		pdi_trace(TRACE_RX_TIMEOUT, 0, 0);
+		return ERR_TIMEOUT;
 	}
-	if (retries == 0)
-		goto err_timeout;
-
-	/* Initialize value (clean) */
-	*value = 0;
-
-	/* LSB first */
-	for (i = 0; i < 8; i++) {
-		bit = pdi_read_bit();
-		if (bit) {
-			*value |= bit << i;
-			parity++;
-		}
+
+	if (!phy_frame_ok(frame)) {
+		pdi_metrics.frame_errors++;
+		pdi_trace(TRACE_RX_ERROR, frame & 0xFF, frame >> 8);
+		return ERR_BAD_DATA;
+	}
+
+	pdi_metrics.rx_frames++;
+	*value = frame & 0xFF;
+	pdi_trace(TRACE_RX, *value, 0);
+
+	return STATUS_OK;
+}
+
+/**
+ * \brief Set the PDI_CLK half period.
+ *
+ * The period actually used is the closest one the PHY can do that is not
+ * shorter than asked for.
+ *
+ * \param half_cycles PRU cycles per clock phase.
+ *
+ * \retval STATUS_OK the clock is set.
+ * \retval ERR_INVALID_ARG out of the PHY range, the clock is unchanged.
+ */
+enum status_code pdi_set_clock(uint32_t half_cycles)
+{
+	return pdi_phy_ops->set_clock(half_cycles);
+}
+
+/**
+ * \brief Switch to another PHY backend, at its default clock.
+ *
+ * Only while the PDI is disabled: the backends drive different pins.
+ *
+ * \param backend the PHY backend to use from now on.
+ *
+ * \retval STATUS_OK the backend is in use.
+ * \retval ERR_INVALID_ARG unknown backend, nothing changed.
+ */
+enum status_code pdi_phy_select(enum phy_backend backend)
+{
+	const struct pdi_phy_ops *ops;
+	uint32_t half = PDI_CLK_RATE_DIV_2;
+
+	switch (backend) {
+	case PHY_BITBANG:
+		ops = &pdi_phy_bitbang;
+		pdi_phy.clk = PDI_CLK_PIN;
+		pdi_phy.tx = pdi_channel_pins[pdi_channel].tx;
+		pdi_phy.rx = pdi_channel_pins[pdi_channel].rx;
+		pdi_phy.oe = pdi_channel_pins[pdi_channel].oe;
+		break;
+	case PHY_SHIFT:
+		/* a single data line */
+		if (pdi_channel_mask != 1)
+			return ERR_INVALID_ARG;
+		ops = &pdi_phy_shift;
+		pdi_phy.clk = PDI_SHIFT_CLK_PIN;
+		pdi_phy.tx = PDI_SHIFT_DATA_PIN_O;
+		pdi_phy.rx = PDI_SHIFT_DATA_PIN_I;
+		pdi_phy.oe = PHY_NO_PIN;
+		break;
+	default:
+		return ERR_INVALID_ARG;
 	}
 
-	/* parity bit */
-	bit = pdi_read_bit();
-	if (bit != (parity % 2))
-		goto err_timeout;
+	if (half < ops->min_half_cycles)
+		half = ops->min_half_cycles;
+	if (half > ops->max_half_cycles)
+		half = ops->max_half_cycles;
 
-	/* stop bits */
-	bit = pdi_read_bit();
-	if (bit != 1)
-		goto err_timeout;
+	pdi_phy_ops = ops;
+	pdi_phy.sample = 0;
 
-	bit = pdi_read_bit();
-	if (bit != 1)
-		goto err_timeout;
+	return ops->set_clock(half);
+}
 
-	pdi_data_tx_enable();
+/**
+ * \brief Choose the channels pdi_init() and pdi_deinit() drive.
+ *
+ * Only while the PDI is disabled. Talks to the lowest of them from now on.
+ *
+ * \param mask bit n for channel n.
+ *
+ * \retval STATUS_OK the channels are in use.
+ * \retval ERR_INVALID_ARG no such channel, or the PHY in use only has
+ * channel 0. Nothing changed.
+ */
+enum status_code pdi_set_channels(uint32_t mask)
+{
+	uint32_t ch;
+
+	if (mask == 0 || (mask & ~PDI_CHANNELS_ALL))
+		return ERR_INVALID_ARG;
+	if (pdi_phy_ops != &pdi_phy_bitbang && mask != 1)
+		return ERR_INVALID_ARG;
+
+	pdi_channel_mask = mask;
+	for (ch = 0; !(mask & 1 << ch); ch++)
+		;
+	pdi_select_channel(ch);
 
 	return STATUS_OK;
+}
 
-err_timeout:
-	pdi_data_tx_enable();
+/**
+ * \brief Talk to another channel, one of those pdi_set_channels() chose.
+ *
+ * Cheap enough to call around every operation: the PHY reads the pins of
+ * the channel in use from pdi_phy.
+ */
+void pdi_select_channel(uint32_t channel)
+{
+	if (channel == pdi_channel)
+		return;
+
+	pdi_channel = channel;
+	pdi_phy.tx = pdi_channel_pins[channel].tx;
+	pdi_phy.rx = pdi_channel_pins[channel].rx;
+	pdi_phy.oe = pdi_channel_pins[channel].oe;
+	pdi_trace(TRACE_CHANNEL, channel, 0);
+}
+
+/**
+ * \brief R30 bits of the data outputs of every channel in use.
+ *
+ * \param oe R30 bits of their output enables.
+ */
+static uint32_t pdi_channel_lines(uint32_t *oe)
+{
+	uint32_t ch, tx = 0;
 
-	return ERR_TIMEOUT;
+	*oe = 0;
+	if (pdi_phy_ops != &pdi_phy_bitbang) {
+		if (pdi_phy.oe != PHY_NO_PIN)
+			*oe = 1 << pdi_phy.oe;
+		return 1 << pdi_phy.tx;
+	}
+
+	for (ch = 0; ch < PDI_CHANNELS; ch++) {
+		if (!(pdi_channel_mask & 1 << ch))
+			continue;
+		tx |= 1 << pdi_channel_pins[ch].tx;
+		*oe |= 1 << pdi_channel_pins[ch].oe;
+	}
+
+	return tx;
 }
 
 /**
@@ -231,43 +444,97 @@ enum status_code pdi_write(const uint8_t *data, uint16_t length)
 
 	for (i = 0; i < length; i++)
 		pdi_write_frame(data[i]);
+	pdi_metrics.tx_frames += length;
+
+	if (pdi_trace_on && length)
+		pdi_trace(TRACE_TX, length - 1,
+			  crc16_update(CRC16_INIT, data, length));
 
 	return STATUS_OK;
 }
 
+/**
+ * \brief Clock out bits encoded by the host, LSB of the first word first.
+ *
+ * Frames, BREAKs and idle bits are all in there already, the words only
+ * get handed to the PHY.
+ *
+ * \param bits the bit words.
+ * \param nbits number of bits to send.
+ */
+void pdi_write_bits(const uint32_t *bits, uint32_t nbits)
+{
+	uint32_t n;
+
+	pdi_data_tx_enable();
+
+	for (n = nbits; n > 32; n -= 32)
+		pdi_phy_ops->tx(*bits++, 32);
+	if (n)
+		pdi_phy_ops->tx(*bits, n);
+	pdi_trace(TRACE_BITS, 0, nbits);
+}
+
 /**
  * \brief Read bulk bytes from PDI.
  *
+ * The line is turned around once for the whole burst and the PHY clocks in
+ * frame after frame straight into data, see pdi_phy_rx_burst(). Every byte
+ * gets the same time budget to start, a byte that fails is not retried: the
+ * target has moved on and the rest of the burst is lost anyway.
+ *
  * \param data Pointer to memory where data to be stored.
  * \param length Number of bytes to be read.
- * \param retries the retry count.
+ * \param timeout_us time budget for each byte to start, in microseconds.
  *
  * \retval non-zero the length of data.
  * \retval zero read fail.
  */
-uint16_t pdi_read(uint8_t *data, uint16_t length, uint32_t retries)
+uint16_t pdi_read(uint8_t *data, uint16_t length, uint32_t timeout_us)
 {
-	uint32_t count;
-	uint16_t bytes_read = 0;
-	uint8_t i, value = 0;
-
-	for (i = 0; i < length; i++) {
-		count = retries;
-		while (count != 0) {
-			if (pdi_get_byte(&value, retries) == STATUS_OK) {
-				*(data + i) = value;
-				bytes_read++;
-				break;
-			}
-			--count;
+	struct deadline dl;
+	uint32_t ret, n;
+	uint16_t i = 0;
+
+	deadline_set(&dl, timeout_us);
+
+	pdi_data_tx_disable();
+
+	while (i < length) {
+		ret = pdi_phy_ops->rx_burst(data + i, length - i,
+					    PHY_HUNT_CLOCKS);
+		n = PHY_BURST_COUNT(ret);
+		if (n) {
+			pdi_metrics.rx_frames += n;
+			deadline_set(&dl, timeout_us);
 		}
-		/* Read fail error */
-		if (count == 0) {
-			return 0;
+
+		if (pdi_trace_on)
+			while (n--)
+				pdi_trace(TRACE_RX, data[i++], 0);
+		else
+			i += n;
+
+		if (i == length)
+			break;
+
+		if (!(ret & PHY_NO_START)) {
+			pdi_metrics.frame_errors++;
+			pdi_trace(TRACE_RX_ERROR, PHY_BURST_FRAME(ret) & 0xFF,
+				  PHY_BURST_FRAME(ret) >> 8);
+			break;
+		}
+
+		if (deadline_expired(&dl)) {
+			pdi_metrics.rx_timeouts++;
+			pdi_trace(TRACE_RX_TIMEOUT, 0, 0);
+			break;
 		}
 	}
 
-	return bytes_read;
+	pdi_data_tx_enable();
+
+	return i == length ? length : 0;
 }
 
 /**
@@ -284,16 +551,22 @@ uint16_t pdi_read(uint8_t *data, uint16_t length, uint32_t retries)
  * the enabling procedure must start over again. 
  *
  * After this sequence, the PDI is enabled and ready to receive instructions.
+ * Every channel in use goes through it at once.
  */
 void pdi_init(void)
 {
+	uint32_t tx, oe;
 	uint8_t i;
 
-	pdi_data_tx_enable();
+	tx = pdi_channel_lines(&oe);
+
+	/* the pins are driven directly until the PHY starts */
+	pdi_phy_ops->stop();
+	PDI_OUTPUT_PORT |= oe;
 
 	/* Make PDI DATA low and PDI CLK high as idle states. */
 	pdi_clk_high();
-	pdi_data_tx_low();
+	PDI_OUTPUT_PORT &= ~tx;
 
 	/* Loop for 10ms to time out the PDI */
 	for (i = 0; i < 100; i++) {
@@ -301,18 +574,15 @@ void pdi_init(void)
 	}
 
 	/* Now set PDI DATA high, wait 1us, this then start a 100us window */
-	pdi_data_tx_high();
+	PDI_OUTPUT_PORT |= tx;
 
 	/* Now wait some usec to be in the middle of a 100us window */
 	__delay_cycles(1000);	/* 5us */
 
 	/* let run PDI_CLK for at least 16 cycles (must be faster than 10 KHz) */
-	for (i = 0; i < 32; i++) {
-		pdi_clk_low();
-		__delay_cycles(PDI_CLK_RATE_DIV_2);
-		pdi_clk_high();
-		__delay_cycles(PDI_CLK_RATE_DIV_2);
-	}
+	pdi_phy_ops->start();
+	pdi_phy_ops->tx(0xFFFFFFFF, 32);
+	pdi_trace(TRACE_ENABLE, 0, 0);
 
 	/*
 	 * At this point the PDI Hardware Interface in the xmega chip should be
@@ -326,18 +596,24 @@ void pdi_init(void)
  * 3.5 Exit the PDI programming 
  * If there is no activity on the PDI_CLK line for approximately 100μs, the PDI 
  * automatically disabled. Then set the PDI_CLK to High and set the PDI_DATA to
- * Low. 
+ * Low. Every channel in use is disabled at once.
  */
 void pdi_deinit( void )
 {
+	uint32_t tx, oe;
+
+	tx = pdi_channel_lines(&oe);
+
 	pdi_write_break();
+	pdi_phy_ops->stop();
 	pdi_clk_high();
 	__delay_cycles(60000);	/* 300us */
 	// pdi_data_tx_disable();
-	pdi_data_tx_low();
+	PDI_OUTPUT_PORT &= ~tx;
 	pdi_clk_low();
 	__delay_cycles(60000);	/* 300us */
 	pdi_clk_high();
+	pdi_trace(TRACE_DISABLE, 0, 0);
 
 /*
 	pdi_disable_clk();
@@ -19,27 +19,51 @@
 #include <stdint.h>
 
 #include "config.h"
+#include "pdi_phy.h"
 #include "status_codes.h"
 
 /**
  * \brief Set the PDI CLK pin low
  */
 #define pdi_clk_low() do { \
-	PDI_CLK_PORT &= ~(1 << PDI_CLK_PIN); \
+	PDI_CLK_PORT &= ~(1 << pdi_phy.clk); \
 } while (0)
 
 /**
  * \brief Set the PDI CLK pin high
  */
 #define pdi_clk_high() do { \
-	PDI_CLK_PORT |= (1 << PDI_CLK_PIN); \
+	PDI_CLK_PORT |= (1 << pdi_phy.clk); \
 } while (0)
 
 
+/*
+ * An enabled PDI disables itself after about 100 us without PDI_CLK
+ * activity. While a session is open and no command runs, the PRU clocks
+ * PDI_KEEPALIVE_BITS idle bits every PDI_KEEPALIVE_US, so that a slow
+ * host does not cost a new session.
+ */
+#define PDI_KEEPALIVE_US	50
+#define PDI_KEEPALIVE_BITS	2
+
+/* Counters for the host, see struct pdi_metrics */
+extern struct pdi_metrics pdi_metrics;
+
+/* Bus trace, see CMD_TRACE */
+extern bool pdi_trace_on;
+
 void pdi_init(void);
 void pdi_deinit(void);
+void pdi_send_break(void);
+void pdi_keepalive(void);
+enum status_code pdi_set_clock(uint32_t half_cycles);
+enum status_code pdi_set_channels(uint32_t mask);
+void pdi_select_channel(uint32_t channel);
 enum status_code pdi_write(const uint8_t *data, uint16_t length);
-enum status_code pdi_get_byte( uint8_t *ret, uint32_t retries);
-uint16_t pdi_read(uint8_t *data, uint16_t length, uint32_t retries);
+void pdi_write_bits(const uint32_t *bits, uint32_t nbits);
+enum status_code pdi_get_byte(uint8_t *ret, uint32_t timeout_us);
+uint16_t pdi_read(uint8_t *data, uint16_t length, uint32_t timeout_us);
+void pdi_trace_enable(bool on);
+void pdi_trace(enum trace_type type, uint8_t data, uint16_t arg);
 
 #endif
@@ -0,0 +1,348 @@
+/**
+ * Job metrics export.
+ *
+ * Writes the metrics of a job in two forms: a text file for the node
+ * exporter textfile collector, holding totals over every job run against
+ * it, and one JSON line per job appended to a log. The text file is
+ * replaced atomically, the collector never sees it half written.
+ *
+ * Copyright (C) 2015-2017 Toby Churchill Ltd.
+ *
+ * Enric Balletbo Serra <enric.balletbo@collabora.com>
+ *
+ * License
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+#include <errno.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "metrics.h"
+
+#define STAT(field)		offsetof(struct pdi_stats, field)
+#define PRU_SECONDS		(1.0 / PRU_CLOCK_HZ)
+
+#define PROM_KEY_SIZE		96
+#define PROM_SAMPLES_MAX	64
+
+/* Counters kept as totals over every job */
+static const struct {
+	const char *name;
+	const char *help;
+	size_t offset;
+	double scale;
+} counters[] = {
+	{ "pdi_elapsed_seconds_total", "Time spent running jobs",
+	  STAT(elapsed_us), 1e-6 },
+	{ "pdi_host_seconds_total", "Job time spent on the host between PRU commands",
+	  STAT(host_us), 1e-6 },
+	{ "pdi_pru_busy_seconds_total", "PRU time spent running commands",
+	  STAT(pru_cycles), PRU_SECONDS },
+	{ "pdi_nvm_busy_seconds_total", "PRU time spent waiting for the NVM controller",
+	  STAT(busy_cycles), PRU_SECONDS },
+	{ "pdi_programmed_bytes_total", "Flash bytes written",
+	  STAT(bytes_programmed), 1 },
+	{ "pdi_read_bytes_total", "Device bytes read",
+	  STAT(bytes_read), 1 },
+	{ "pdi_pages_written_total", "Flash pages written",
+	  STAT(pages_written), 1 },
+	{ "pdi_pages_erased_total", "Flash pages erased one by one",
+	  STAT(pages_erased), 1 },
+	{ "pdi_pages_skipped_total", "Flash pages that needed no write",
+	  STAT(pages_skipped), 1 },
+	{ "pdi_commands_total", "PRU commands run",
+	  STAT(commands), 1 },
+	{ "pdi_tx_frames_total", "PDI bytes sent",
+	  STAT(tx_frames), 1 },
+	{ "pdi_rx_frames_total", "PDI bytes received",
+	  STAT(rx_frames), 1 },
+	{ "pdi_frame_errors_total", "PDI bytes received with a parity or stop bit error",
+	  STAT(frame_errors), 1 },
+	{ "pdi_rx_timeouts_total", "PDI responses that never started",
+	  STAT(rx_timeouts), 1 },
+	{ "pdi_retries_total", "PDI instruction groups sent again",
+	  STAT(retries), 1 },
+	{ "pdi_busy_polls_total", "NVM controller status reads",
+	  STAT(busy_polls), 1 },
+	{ "pdi_keepalives_total", "Idle clock bursts keeping a PDI session open between commands",
+	  STAT(keepalives), 1 },
+	{ "pdi_polled_completions_total", "PRU command completions caught spinning",
+	  STAT(polled), 1 },
+	{ "pdi_polled_roundtrip_seconds_total", "Round trips of the commands caught spinning",
+	  STAT(polled_us), 1e-6 },
+	{ "pdi_irq_completions_total", "PRU command completions taken by interrupt",
+	  STAT(irqs), 1 },
+	{ "pdi_irq_roundtrip_seconds_total", "Round trips of the commands taken by interrupt",
+	  STAT(irq_us), 1e-6 },
+	{ "pdi_spin_seconds_total", "Time spent spinning on commands that took longer",
+	  STAT(spin_us), 1e-6 },
+};
+
+struct prom {
+	FILE *f;
+	struct {
+		char key[PROM_KEY_SIZE];
+		double value;
+	} old[PROM_SAMPLES_MAX];
+	unsigned int nold;
+};
+
+static uint64_t stat_value(const struct pdi_stats *st, size_t offset)
+{
+	return *(const uint64_t *)((const char *)st + offset);
+}
+
+/**
+ * \brief Bytes moved per second over the whole job.
+ */
+static double throughput(const struct pdi_stats *st)
+{
+	if (!st->elapsed_us)
+		return 0;
+
+	return (st->bytes_programmed + st->bytes_read) * 1e6 / st->elapsed_us;
+}
+
+/**
+ * \brief Load the totals of a previous text file, if any.
+ */
+static void prom_load(struct prom *p, const char *path)
+{
+	char line[256], *sp;
+	FILE *f;
+
+	f = fopen(path, "r");
+	if (!f)
+		return;
+
+	while (p->nold < PROM_SAMPLES_MAX && fgets(line, sizeof(line), f)) {
+		if (line[0] == '#')
+			continue;
+		sp = strrchr(line, ' ');
+		if (!sp || sp - line >= PROM_KEY_SIZE)
+			continue;
+
+		*sp = '\0';
+		strcpy(p->old[p->nold].key, line);
+		p->old[p->nold].value = strtod(sp + 1, NULL);
+		p->nold++;
+	}
+
+	fclose(f);
+}
+
+static void prom_help(struct prom *p, const char *name, const char *help,
+		      const char *type)
+{
+	fprintf(p->f, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+static void prom_total(struct prom *p, const char *name, const char *labels,
+		       double value)
+{
+	char key[PROM_KEY_SIZE];
+	unsigned int i;
+
+	snprintf(key, sizeof(key), "%s%s", name, labels);
+	for (i = 0; i < p->nold; i++) {
+		if (!strcmp(p->old[i].key, key)) {
+			value += p->old[i].value;
+			break;
+		}
+	}
+
+	fprintf(p->f, "%s %.15g\n", key, value);
+}
+
+/**
+ * \brief Add a job to the totals of a node exporter text file.
+ *
+ * The totals carry over from the file as it is, so it must only ever be
+ * written by this function. Gauges describe the last job.
+ *
+ * \param job name of the job, a label of the last job gauges.
+ * \param status how the job ended.
+ *
+ * \retval 0 written.
+ * \retval -1 failed, errno set, the previous file is left alone.
+ */
+int metrics_write_prom(const char *path, const char *job, int status,
+		       const struct pdi_stats *st)
+{
+	struct prom *p;
+	char tmp[4096], labels[64];
+	unsigned int i;
+	int ret = 0;
+
+	if (snprintf(tmp, sizeof(tmp), "%s.tmp", path) >= (int)sizeof(tmp))
+		return -1;
+
+	p = calloc(1, sizeof(*p));
+	if (!p)
+		return -1;
+	prom_load(p, path);
+
+	p->f = fopen(tmp, "w");
+	if (!p->f) {
+		free(p);
+		return -1;
+	}
+
+	prom_help(p, "pdi_jobs_total", "Jobs run, by result", "counter");
+	prom_total(p, "pdi_jobs_total", "{result=\"ok\"}", status == 0);
+	prom_total(p, "pdi_jobs_total", "{result=\"failed\"}", status != 0);
+
+	prom_help(p, "pdi_phase_seconds_total",
+		  "Time spent in PRU command round trips, by phase", "counter");
+	for (i = 0; i < PDI_PHASE_NUM; i++) {
+		snprintf(labels, sizeof(labels), "{phase=\"%s\"}",
+			 pdi_phase_name(i));
+		prom_total(p, "pdi_phase_seconds_total", labels,
+			   st->phase_us[i] * 1e-6);
+	}
+
+	for (i = 0; i < sizeof(counters) / sizeof(counters[0]); i++) {
+		prom_help(p, counters[i].name, counters[i].help, "counter");
+		prom_total(p, counters[i].name, "",
+			   stat_value(st, counters[i].offset) *
+			   counters[i].scale);
+	}
+
+	snprintf(labels, sizeof(labels), "{job=\"%s\"}", job);
+	prom_help(p, "pdi_last_job_timestamp_seconds",
+		  "When the last job ended", "gauge");
+	fprintf(p->f, "pdi_last_job_timestamp_seconds%s %lld\n", labels,
+		(long long)time(NULL));
+	prom_help(p, "pdi_last_job_success",
+		  "Whether the last job succeeded", "gauge");
+	fprintf(p->f, "pdi_last_job_success%s %d\n", labels, status == 0);
+	prom_help(p, "pdi_last_job_duration_seconds",
+		  "How long the last job took", "gauge");
+	fprintf(p->f, "pdi_last_job_duration_seconds%s %.6f\n", labels,
+		st->elapsed_us * 1e-6);
+	prom_help(p, "pdi_last_job_throughput_bytes_per_second",
+		  "Bytes programmed and read per second by the last job",
+		  "gauge");
+	fprintf(p->f, "pdi_last_job_throughput_bytes_per_second%s %.0f\n",
+		labels, throughput(st));
+
+	if (fclose(p->f) != 0 || rename(tmp, path) < 0) {
+		remove(tmp);
+		ret = -1;
+	}
+	free(p);
+
+	return ret;
+}
+
+/*
+ * Copy s into dst, size bytes, as the body of a JSON string. Cut short
+ * rather than split an escape.
+ */
+static void json_escape(char *dst, size_t size, const char *s)
+{
+	char esc[8];
+	size_t n = 0;
+	int len;
+
+	for (; *s; s++) {
+		unsigned char c = *s;
+
+		if (c == '"' || c == '\\')
+			len = snprintf(esc, sizeof(esc), "\\%c", c);
+		else if (c < 0x20)
+			len = snprintf(esc, sizeof(esc), "\\u%04x", c);
+		else
+			len = snprintf(esc, sizeof(esc), "%c", c);
+		if (n + len >= size)
+			break;
+		memcpy(dst + n, esc, len);
+		n += len;
+	}
+	dst[n] = '\0';
+}
+
+/*
+ * Append to line, size bytes of which n are used. The count returned
+ * never passes size - 1, reaching it means the line did not fit.
+ */
+static int line_add(char *line, size_t size, int n, const char *fmt, ...)
+{
+	va_list ap;
+	int len;
+
+	va_start(ap, fmt);
+	len = vsnprintf(line + n, size - n, fmt, ap);
+	va_end(ap);
+
+	if (len < 0 || (size_t)len >= size - n)
+		return size - 1;
+
+	return n + len;
+}
+
+/**
+ * \brief Append the metrics of a job to a log, as one line of JSON.
+ *
+ * \retval 0 written.
+ * \retval -1 failed, errno set, EOVERFLOW if the line did not fit.
+ */
+int metrics_log_json(const char *path, const char *job, int status,
+		     const struct pdi_stats *st)
+{
+	char line[2048], name[256];
+	unsigned int i;
+	int n;
+	FILE *f;
+
+	json_escape(name, sizeof(name), job);
+	n = line_add(line, sizeof(line), 0,
+		     "{\"time\":%lld,\"job\":\"%s\",\"status\":%d,"
+		     "\"elapsed_us\":%llu,\"host_us\":%llu,\"phase_us\":{",
+		     (long long)time(NULL), name, status,
+		     (unsigned long long)st->elapsed_us,
+		     (unsigned long long)st->host_us);
+	for (i = 0; i < PDI_PHASE_NUM; i++)
+		n = line_add(line, sizeof(line), n, "%s\"%s\":%llu",
+			     i ? "," : "", pdi_phase_name(i),
+			     (unsigned long long)st->phase_us[i]);
+	n = line_add(line, sizeof(line), n, "}");
+
+	/* the counters under their text file names, minus the suffix */
+	for (i = 0; i < sizeof(counters) / sizeof(counters[0]); i++) {
+		if (counters[i].offset == STAT(elapsed_us) ||
+		    counters[i].offset == STAT(host_us))
+			continue;
+		n = line_add(line, sizeof(line), n, ",\"%.*s\":%.15g",
+			     (int)(strlen(counters[i].name) - strlen("pdi_") -
+				   strlen("_total")),
+			     counters[i].name + strlen("pdi_"),
+			     stat_value(st, counters[i].offset) *
+			     counters[i].scale);
+	}
+	n = line_add(line, sizeof(line), n,
+		     ",\"throughput_bytes_per_second\":%.0f}\n",
+		     throughput(st));
+
+	/* half a line would break every reader of the log */
+	if (n >= (int)sizeof(line) - 1) {
+		errno = EOVERFLOW;
+		return -1;
+	}
+
+	f = fopen(path, "a");
+	if (!f)
+		return -1;
+
+	/* a single write, lines of concurrent runs do not interleave */
+	fputs(line, f);
+
+	return fclose(f) == 0 ? 0 : -1;
+}
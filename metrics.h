@@ -0,0 +1,25 @@
+/**
+ * Job metrics export.
+ *
+ * Copyright (C) 2015-2017 Toby Churchill Ltd.
+ *
+ * Enric Balletbo Serra <enric.balletbo@collabora.com>
+ *
+ * License
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+#ifndef METRICS_H_INCLUDED
+#define METRICS_H_INCLUDED
+
+#include "libpdi.h"
+
+int metrics_write_prom(const char *path, const char *job, int status,
+		       const struct pdi_stats *st);
+int metrics_log_json(const char *path, const char *job, int status,
+		     const struct pdi_stats *st);
+
+#endif
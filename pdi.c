@@ -13,74 +13,1445 @@
  */
 
 #include <stdio.h>
-#include <pthread.h>
 #include <string.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <unistd.h>
 #include <signal.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
-#include <prussdrv.h>
-#include <pruss_intc_mapping.h>
+#include "libpdi.h"
+#include "snapshot.h"
+#include "metrics.h"
+#include "plan.h"
+#include "journal.h"
+#include "atxmega16d4_nvm_regs.h"
 
-#include "prog.h"
+/* read by the event loop, which cancels the job at its next command */
+static volatile sig_atomic_t finish;
 
-#define PRU_NUM 0
+static void signal_handler(int signal) {
+	finish = 1;
+}
+
+enum pdi_mode {
+	MODE_SIGNATURE,
+	MODE_INFO,
+	MODE_PHY,
+	MODE_CALIBRATE,
+	MODE_DUMP,
+	MODE_COMPARE,
+	MODE_PROGRAM,
+	MODE_PLAN,
+	MODE_PEEK,
+	MODE_POKE,
+	MODE_VERIFY,
+};
+
+static const char * const mode_names[] = {
+	[MODE_SIGNATURE]	= "signature",
+	[MODE_INFO]		= "info",
+	[MODE_PHY]		= "phy",
+	[MODE_CALIBRATE]	= "calibrate",
+	[MODE_DUMP]		= "dump",
+	[MODE_COMPARE]		= "compare",
+	[MODE_PROGRAM]		= "program",
+	[MODE_PLAN]		= "plan",
+	[MODE_PEEK]		= "peek",
+	[MODE_POKE]		= "poke",
+	[MODE_VERIFY]		= "verify",
+};
+
+/**
+ * \brief State shared between the CLI and its job callbacks.
+ */
+struct pdi_cli {
+	enum pdi_mode mode;
+	int status;
+	int done;
+
+	/* dump and compare */
+	struct snapshot snap;
+	struct compare_state cmp;
+
+	const uint8_t *image;
+	size_t image_size;
+
+	/* program */
+	const uint8_t *current;
+	unsigned int flags;
+	int precompiled;	/* the image is a plan */
+	const char *journal_path;
+	struct journal journal;
 
-#ifndef START_ADDR
-#error "START_ADDR must be defined"
-#endif
+	/* patch slots, declared by plan, given values by program and verify */
+	struct plan_patch slots[PLAN_PATCHES_MAX];
+	unsigned int nslots;
+	const char *defines[PLAN_PATCHES_MAX];	/* NAME=HEX */
+	unsigned int ndefines;
+	const char *csv_path;
+	FILE *csv;
+	char *csv_names;	/* header row */
+	char *csv_row;
+	size_t csv_size;
+	int csv_ready;		/* csv_row read ahead, not used yet */
 
-int finish = 0;
+	/* peek and poke, data space */
+	uint32_t address;
+	uint32_t length;
+	uint8_t *bytes;
 
-void init_pru_program() {
-	tpruss_intc_initdata pruss_intc_initdata = PRUSS_INTC_INITDATA;
-	prussdrv_init();
-	prussdrv_open(PRU_EVTOUT_0);
-	prussdrv_pruintc_init(&pruss_intc_initdata);
+	int backend;		/* enum phy_backend, -1 for the one in use */
+	uint32_t clk_hz;
+	unsigned int targets;	/* programmed at once, on channels 0 and up */
+	uint32_t reads;		/* calibrate */
 
-	prussdrv_load_datafile(PRU_NUM, "./data.bin");
-	prussdrv_exec_program_at(PRU_NUM, "./text.bin", START_ADDR);
+	/* metrics of the job, and where they go */
+	struct pdi_stats stats;
+	const char *prom_path;
+	const char *json_path;
+
+	/* how completions are collected, -1 for the default */
+	int completion;
+	uint32_t spin_us;
+
+	/* bus trace */
+	const char *trace_path;
+	FILE *trace;
+
+	/* watch: board after board, until interrupted */
+	int watch;
+	int present;		/* waiting for a board, or for its removal */
+	unsigned int boards;
+	unsigned int failed;
+	struct pdi *h;
+	struct pdi_job *job;	/* the one to cancel */
+};
+
+static const char * const backend_names[] = {
+	[PHY_BITBANG]	= "bitbang",
+	[PHY_SHIFT]	= "shift",
+};
+
+/* Device signature first, then one read region per snapshot region */
+#define DUMP_SIGNATURE_REGION	0
+
+static void print_row(const char *name, const uint8_t *data,
+		      unsigned int length)
+{
+	unsigned int i;
+
+	for (i = 0; i < length; i++) {
+		if (i % 16 == 0)
+			printf("%s%-12s %04x:", i ? "\n" : "", i ? "" : name, i);
+		printf(" %02x", data[i]);
+	}
+	printf("\n");
 }
 
-void signal_handler(int signal) {
-	finish = 1;
+/**
+ * \brief Print the device information block.
+ */
+static void print_devinfo(const struct devinfo *info)
+{
+	unsigned int i;
+
+	printf("%-12s 0x%02x%02x%02x\n", "signature", info->signature[0],
+	       info->signature[1], info->signature[2]);
+	printf("%-12s %c\n", "revision", 'A' + info->revision);
+	for (i = 0; i < DEVINFO_FUSES; i++)
+		printf("fusebyte%-4u 0x%02x\n", i, info->fuses[i]);
+	printf("%-12s 0x%02x\n", "lockbits", info->lockbits);
+	print_row("calibration", info->calibration, DEVINFO_CALIBRATION);
+	print_row("usersig", info->user_sign, DEVINFO_USER_SIGN);
 }
 
-int main(int argc, const char *argv[]) {
+/**
+ * \brief Print the PHY cycle budgets.
+ */
+static void print_phy(const struct phy_info *phy)
+{
+	printf("backend      %s\n", phy->backend == PHY_SHIFT ?
+	       backend_names[PHY_SHIFT] : backend_names[PHY_BITBANG]);
+	printf("PDI_CLK      %u Hz (%u to %u Hz)\n",
+	       phy->cpu_hz / (2 * phy->half_cycles),
+	       phy->cpu_hz / (2 * phy->max_half_cycles),
+	       phy->cpu_hz / (2 * phy->min_half_cycles));
+	printf("clock phase  %u cycles, %u of them bit handling\n",
+	       phy->half_cycles, phy->fixed_cycles);
+	printf("frame        %u cycles\n", phy->frame_cycles);
+	printf("double BREAK %u cycles\n", phy->break_cycles);
+	printf("start hunt   %u clocks per time check\n", phy->hunt_clocks);
+	printf("sampling     point %u of 0 to %u, %u cycles after the edge\n",
+	       phy->sample, phy->max_sample, phy->sample_cycles);
+}
+
+/**
+ * \brief Print a sampling point sweep and the window found.
+ */
+static void print_calibration(const struct phy_calibration *cal)
+{
+	unsigned int ns = 1000000000 / PRU_CLOCK_HZ, i;
+
+	printf("point  delay   reads\n");
+	for (i = 0; i < cal->points && i < CALIB_POINTS_MAX; i++)
+		printf("%5u  %3u ns  %u/%u%s\n", i, cal->cycles[i] * ns,
+		       cal->pass[i], cal->reads,
+		       i == cal->sample ? "  <" : "");
+
+	if (cal->first > cal->last) {
+		printf("no sampling point passed, keeping point %u\n",
+		       cal->sample);
+		return;
+	}
+
+	printf("window %u to %u ns, using %u ns, margins %u ns before and "
+	       "%u ns after\n", cal->cycles[cal->first] * ns,
+	       cal->cycles[cal->last] * ns, cal->cycles[cal->sample] * ns,
+	       (cal->cycles[cal->sample] - cal->cycles[cal->first]) * ns,
+	       (cal->cycles[cal->last] - cal->cycles[cal->sample]) * ns);
+}
+
+/**
+ * \brief Print what a plan does.
+ */
+static void print_plan(const struct plan_header *plan)
+{
+	const struct stage_header *stage = plan_stage(plan);
+	unsigned int i;
+
+	printf("device       0x%02x%02x%02x\n", plan->signature[0],
+	       plan->signature[1], plan->signature[2]);
+	printf("image        %u bytes, CRC 0x%04x up to 0x%05x\n",
+	       plan->image_size, plan->image_crc, plan->end);
+	printf("pages        %u of %u staged, %u bytes\n", stage->npages,
+	       plan->end / plan->page_size, plan->stage_size);
+	printf("app: %s, boot: %s\n", erase_plan_name(plan->erase[AREA_APP]),
+	       erase_plan_name(plan->erase[AREA_BOOT]));
+	for (i = 0; i < plan->nops; i++) {
+		printf("%u: %s", i, plan_op_name(plan->ops[i].type));
+		if (plan->ops[i].type == PLAN_OP_ERASE)
+			printf(" %s", plan->ops[i].arg == AREA_CHIP ? "chip" :
+			       plan->ops[i].arg == AREA_BOOT ? "boot" : "app");
+		printf("\n");
+	}
+	for (i = 0; i < plan->npatches; i++)
+		printf("slot %-16s %s 0x%05x, %u bytes\n",
+		       plan->patches[i].name,
+		       plan_patch_area_name(plan->patches[i].area),
+		       plan->patches[i].offset, plan->patches[i].length);
+}
+
+/**
+ * \brief Completion of the clock setting job queued ahead of the real one.
+ */
+static void clock_done(struct pdi_job *job, int status, void *user)
+{
+	struct pdi_cli *cli = user;
+
+	if (status == STATUS_OK)
+		return;
+
+	if (cli->backend >= 0)
+		fprintf(stderr, "Cannot switch to the %s PHY at %u Hz (%d)\n",
+			backend_names[cli->backend], cli->clk_hz, status);
+	else
+		fprintf(stderr, "Cannot set PDI_CLK to %u Hz (%d)\n",
+			cli->clk_hz, status);
+	cli->status = status;
+	cli->done = 1;
+}
+
+/**
+ * \brief Completion of the trace job queued ahead of everything else.
+ */
+static void trace_done(struct pdi_job *job, int status, void *user)
+{
+	struct pdi_cli *cli = user;
+
+	if (status == STATUS_OK)
+		return;
+
+	fprintf(stderr, "%s: cannot start the bus trace (%d)\n",
+		cli->trace_path, status);
+	cli->status = status;
+	cli->done = 1;
+}
+
+/**
+ * \brief Add the metrics of the last job to the files asked for.
+ */
+static void write_metrics(const struct pdi_cli *cli)
+{
+	if (cli->prom_path &&
+	    metrics_write_prom(cli->prom_path, mode_names[cli->mode],
+			       cli->status, &cli->stats) < 0)
+		fprintf(stderr, "%s: %s\n", cli->prom_path, strerror(errno));
+	if (cli->json_path &&
+	    metrics_log_json(cli->json_path, mode_names[cli->mode],
+			     cli->status, &cli->stats) < 0)
+		fprintf(stderr, "%s: %s\n", cli->json_path, strerror(errno));
+}
+
+static void watch_wait(struct pdi_cli *cli, int present);
+
+/**
+ * \brief Give the verdict on the board just handled, then wait for it to
+ * be removed.
+ */
+static void board_done(struct pdi_cli *cli, int status)
+{
+	if (status == STATUS_OK) {
+		printf("Board %u: PASS\n", cli->boards);
+	} else {
+		printf("Board %u: FAIL (%d)\n", cli->boards, status);
+		cli->failed++;
+	}
+	fflush(stdout);
+	write_metrics(cli);
+
+	cli->done = 0;
+	watch_wait(cli, 0);
+}
+
+static void job_done(struct pdi_job *job, int status, void *user)
+{
+	struct pdi_cli *cli = user;
+	const struct devinfo *info;
+	const struct erase_plan *plan;
+	const struct pdi_mismatch *m;
+	unsigned int i, n;
+
+	cli->status = status;
+	cli->done = 1;
+	cli->job = NULL;
+	cli->stats = *pdi_job_stats(job);
+
+	switch (cli->mode) {
+	case MODE_SIGNATURE:
+		info = pdi_job_devinfo(job);
+		if (status == STATUS_OK)
+			printf("Device signature = 0x%02x%02x%02x\n",
+			       info->signature[0], info->signature[1],
+			       info->signature[2]);
+		break;
+	case MODE_INFO:
+		if (status == STATUS_OK)
+			print_devinfo(pdi_job_devinfo(job));
+		break;
+	case MODE_PHY:
+		if (status == STATUS_OK)
+			print_phy(pdi_job_phy_info(job));
+		break;
+	case MODE_CALIBRATE:
+		if (status == STATUS_OK || status == ERR_BAD_DATA)
+			print_calibration(pdi_job_calibration(job));
+		break;
+	case MODE_PROGRAM:
+		plan = pdi_job_erase_plan(job);
+		printf("app: %s, boot: %s\n",
+		       erase_plan_name(plan->erase[AREA_APP]),
+		       erase_plan_name(plan->erase[AREA_BOOT]));
+		if (pdi_job_resumed(job))
+			printf("resumed at page %u\n", pdi_job_resumed(job));
+		printf("%u pages programmed\n", pdi_job_count(job));
+		break;
+	case MODE_PEEK:
+		if (pdi_job_count(job))
+			printf("\n");
+		break;
+	case MODE_POKE:
+		printf("%u bytes written\n", pdi_job_count(job));
+		break;
+	case MODE_VERIFY:
+		m = pdi_job_mismatches(job, &n);
+		for (i = 0; i < n; i++)
+			printf("page 0x%05x differs from byte %u on\n",
+			       m[i].address, m[i].offset);
+		printf("%u pages verified, %u differ\n", pdi_job_count(job),
+		       n);
+		break;
+	default:
+		break;
+	}
+
+	if (!cli->watch || status == ERR_FLUSHED)
+		return;
+
+	board_done(cli, status);
+}
+
+/**
+ * \brief Print data space bytes as they come, 16 to a row.
+ */
+static void peek_chunk(struct pdi_job *job, unsigned int region,
+		       uint32_t offset, const uint8_t *data, uint32_t length,
+		       void *user)
+{
+	struct pdi_cli *cli = user;
+	uint32_t i;
+
+	for (i = 0; i < length; i++, offset++) {
+		if (offset % 16 == 0)
+			printf("%s%04x:", offset ? "\n" : "",
+			       cli->address + offset);
+		printf(" %02x", data[i]);
+	}
+}
+
+/**
+ * \brief Store a chunk into the snapshot and compare it while the PRU is
+ * already reading the next one.
+ */
+static void dump_chunk(struct pdi_job *job, unsigned int region,
+		       uint32_t offset, const uint8_t *data, uint32_t length,
+		       void *user)
+{
+	struct pdi_cli *cli = user;
+	struct snapshot_region *r;
+	uint8_t *dst;
+
+	if (region == DUMP_SIGNATURE_REGION) {
+		memcpy(cli->snap.hdr->signature, data, 3);
+		return;
+	}
+
+	r = &cli->snap.hdr->region[region - 1];
+	dst = cli->snap.map + r->offset + offset;
+	memcpy(dst, data, length);
+	r->valid = offset + length;
+
+	if (cli->image && r->type == SNAPSHOT_FLASH && offset < cli->image_size)
+		compare_chunk(&cli->cmp, offset, dst, cli->image + offset,
+			      offset + length > cli->image_size ?
+			      cli->image_size - offset : length);
+}
+
+static int hex_digit(char c)
+{
+	if (c >= '0' && c <= '9')
+		return c - '0';
+	if (c >= 'a' && c <= 'f')
+		return c - 'a' + 10;
+	if (c >= 'A' && c <= 'F')
+		return c - 'A' + 10;
+	return -1;
+}
+
+/**
+ * \brief Give the slot called name, n characters, the value in hex, m
+ * digits.
+ *
+ * \retval index of the slot, or -1.
+ */
+static int patch_value(struct pdi_cli *cli, struct pdi_job *job,
+		       const char *name, size_t n, const char *hex, size_t m)
+{
+	const struct plan_header *plan = (const struct plan_header *)cli->image;
+	char slot[PLAN_PATCH_NAME_SIZE];
+	uint8_t data[SHM_DATA_MAX];
+	int hi, lo, s = -1;
+	size_t i;
+
+	if (n < sizeof(slot)) {
+		memcpy(slot, name, n);
+		slot[n] = 0;
+		s = plan_patch_find(plan, slot);
+	}
+	if (s < 0) {
+		fprintf(stderr, "%.*s: no such slot in the plan\n", (int)n,
+			name);
+		return -1;
+	}
+
+	if (m != 2 * plan->patches[s].length)
+		goto err;
+	for (i = 0; i < m / 2; i++) {
+		hi = hex_digit(hex[2 * i]);
+		lo = hex_digit(hex[2 * i + 1]);
+		if (hi < 0 || lo < 0)
+			goto err;
+		data[i] = hi << 4 | lo;
+	}
+
+	if (pdi_job_patch(job, slot, data, m / 2) < 0) {
+		fprintf(stderr, "%s: %s\n", slot, strerror(errno));
+		return -1;
+	}
+	return s;
+
+err:
+	fprintf(stderr, "%s: the value is not %u bytes in hex\n", slot,
+		plan->patches[s].length);
+	return -1;
+}
+
+/*
+ * Read the next row of the CSV file ahead, unless it is already. Empty
+ * lines are skipped.
+ */
+static int csv_next(struct pdi_cli *cli)
+{
+	while (!cli->csv_ready) {
+		if (getline(&cli->csv_row, &cli->csv_size, cli->csv) < 0)
+			return -1;
+		cli->csv_ready = strcspn(cli->csv_row, "\r\n") != 0;
+	}
+
+	return 0;
+}
+
+/*
+ * Values of the next row of the CSV file, in the columns of its header.
+ */
+static int patch_row(struct pdi_cli *cli, struct pdi_job *job,
+		     uint32_t *given)
+{
+	const char *name, *value;
+	size_t n, m;
+	int s;
+
+	if (csv_next(cli) < 0) {
+		fprintf(stderr, "%s: no values left\n", cli->csv_path);
+		return -1;
+	}
+	cli->csv_ready = 0;
+
+	for (name = cli->csv_names, value = cli->csv_row;;
+	     name++, value++) {
+		n = strcspn(name, ",\r\n");
+		m = strcspn(value, ",\r\n");
+		s = patch_value(cli, job, name, n, value, m);
+		if (s < 0)
+			return -1;
+		*given |= 1u << s;
+		name += n;
+		value += m;
+		if (*name != ',' || *value != ',')
+			break;
+	}
+	if (*name == ',' || *value == ',') {
+		fprintf(stderr, "%s: not as many values as slots\n",
+			cli->csv_path);
+		return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * \brief Give the patch slots of a plan job their values: -d ones, then
+ * the next row of the CSV file.
+ *
+ * A slot the job needs and has no value for fails it, before anything is
+ * written.
+ */
+static int patch_values(struct pdi_cli *cli, struct pdi_job *job)
+{
+	const struct plan_header *plan = (const struct plan_header *)cli->image;
+	uint32_t given = 0;
+	unsigned int i;
+	const char *eq;
+	int s;
+
+	for (i = 0; i < cli->ndefines; i++) {
+		eq = strchr(cli->defines[i], '=');
+		s = patch_value(cli, job, cli->defines[i],
+				eq - cli->defines[i], eq + 1, strlen(eq + 1));
+		if (s < 0)
+			return -1;
+		given |= 1u << s;
+	}
+
+	if (cli->csv && patch_row(cli, job, &given) < 0)
+		return -1;
+
+	/* verify only compares the flash */
+	for (i = 0; i < plan->npatches; i++) {
+		if (given & 1u << i || (cli->mode == MODE_VERIFY &&
+					plan->patches[i].area != PLAN_PATCH_FLASH))
+			continue;
+		fprintf(stderr, "%s: no value\n", plan->patches[i].name);
+		return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * \brief Give a new plan job its slot values, or drop it.
+ *
+ * A slot left without a value fails the job before anything is written.
+ * Returns NULL with errno EINVAL if the values are refused.
+ */
+static struct pdi_job *patch_job(struct pdi_cli *cli, struct pdi_job *job)
+{
+	if (job && patch_values(cli, job) < 0) {
+		pdi_job_discard(job);
+		errno = EINVAL;
+		return NULL;
+	}
+
+	return job;
+}
+
+/**
+ * \brief Build the job for the selected mode.
+ */
+static struct pdi_job *make_job(struct pdi_cli *cli, const char *snapshot_path)
+{
+	struct pdi_region regions[SNAPSHOT_REGION_NUM + 1];
+	unsigned int i;
+
+	switch (cli->mode) {
+	case MODE_SIGNATURE:
+	case MODE_INFO:
+		return pdi_job_identify(job_done, cli);
+	case MODE_PHY:
+		return pdi_job_phy_select(cli->backend, cli->clk_hz, job_done,
+					  cli);
+	case MODE_CALIBRATE:
+		return pdi_job_calibrate(cli->reads, job_done, cli);
+	case MODE_PROGRAM:
+		if (!cli->precompiled)
+			return pdi_job_program(cli->image, cli->image_size,
+					       cli->current, cli->flags,
+					       job_done, cli);
+		return patch_job(cli, pdi_job_program_plan(
+			(const struct plan_header *)cli->image,
+			cli->image_size, job_done, cli));
+	case MODE_VERIFY:
+		return patch_job(cli, pdi_job_verify_plan(
+			(const struct plan_header *)cli->image,
+			cli->image_size, job_done, cli));
+	case MODE_PEEK:
+		regions[0].address = cli->address;
+		regions[0].size = cli->length;
+		return pdi_job_read_data(regions, 1, peek_chunk, job_done,
+					 cli);
+	case MODE_POKE:
+		return pdi_job_write_data(cli->address, cli->bytes,
+					  cli->length, job_done, cli);
+	case MODE_DUMP:
+	case MODE_COMPARE:
+	case MODE_PLAN:
+		break;
+	}
+
+	if (snapshot_create(&cli->snap, snapshot_path) < 0) {
+		fprintf(stderr, "%s: %s\n", snapshot_path ? snapshot_path :
+			"snapshot", strerror(errno));
+		return NULL;
+	}
+	compare_init(&cli->cmp, stdout, 0);
+
+	regions[DUMP_SIGNATURE_REGION].address = XNVM_DATA_BASE + NVM_MCU_CONTROL;
+	regions[DUMP_SIGNATURE_REGION].size = 3;
+	for (i = 0; i < cli->snap.hdr->nregions; i++) {
+		regions[i + 1].address = cli->snap.hdr->region[i].address;
+		regions[i + 1].size = cli->snap.hdr->region[i].size;
+	}
+
+	return pdi_job_read(regions, cli->snap.hdr->nregions + 1, dump_chunk,
+			    job_done, cli);
+}
+
+/**
+ * \brief A board showed up, program it, or it went away, wait for another.
+ */
+static void detect_done(struct pdi_job *job, int status, void *user)
+{
+	struct pdi_cli *cli = user;
+
+	cli->job = NULL;
+
+	if (status != STATUS_OK) {
+		if (status != ERR_FLUSHED)
+			fprintf(stderr, "Target detection failed (%d)\n",
+				status);
+		cli->status = status;
+		cli->done = 1;
+		return;
+	}
+
+	if (!cli->present) {
+		printf("Board %u removed, waiting for the next one\n",
+		       cli->boards);
+		fflush(stdout);
+		watch_wait(cli, 1);
+		return;
+	}
+
+	cli->boards++;
+	printf("Board %u: connected\n", cli->boards);
+	fflush(stdout);
+
+	/* no snapshot, every board is a new device */
+	cli->job = make_job(cli, NULL);
+	if (!cli->job && errno == EINVAL) {
+		/* its slot values were refused, nothing was written */
+		cli->status = ERR_INVALID_ARG;
+		memset(&cli->stats, 0, sizeof(cli->stats));
+		board_done(cli, cli->status);
+		return;
+	}
+	if (!cli->job || pdi_submit(cli->h, cli->job) < 0) {
+		cli->status = ERR_NO_MEMORY;
+		cli->done = 1;
+	}
+}
+
+/**
+ * \brief Queue the wait for a board to be connected, or removed.
+ */
+static void watch_wait(struct pdi_cli *cli, int present)
+{
+	/* out of rows, no board is waited for that could not be programmed */
+	if (present && cli->csv && csv_next(cli) < 0) {
+		printf("%s: no values left\n", cli->csv_path);
+		cli->done = 1;
+		return;
+	}
+
+	cli->present = present;
+	cli->job = pdi_job_detect(present, 0, detect_done, cli);
+	if (pdi_submit(cli->h, cli->job) < 0) {
+		cli->status = ERR_NO_MEMORY;
+		cli->done = 1;
+	}
+}
+
+/**
+ * \brief Report the result of a dump or compare and release the snapshot.
+ */
+static int dump_finish(struct pdi_cli *cli)
+{
+	struct snapshot_header *hdr = cli->snap.hdr;
+	unsigned int i, ranges;
+	int ret = 0;
+
+	ranges = compare_finish(&cli->cmp);
+
+	if (cli->status != STATUS_OK) {
+		fprintf(stderr, "Device read failed (%d)\n", cli->status);
+		ret = 1;
+	} else {
+		printf("Device signature = 0x%02x%02x%02x\n",
+		       hdr->signature[0], hdr->signature[1], hdr->signature[2]);
+		for (i = 0; i < hdr->nregions; i++)
+			printf("%-12s 0x%07x %5u bytes\n",
+			       snapshot_region_name(hdr->region[i].type),
+			       hdr->region[i].address, hdr->region[i].valid);
+		if (cli->image)
+			printf("%u mismatching range(s)\n", ranges);
+		ret = ranges != 0;
+	}
+
+	snapshot_close(&cli->snap);
+
+	return ret;
+}
+
+static const char * const timeout_names[PDI_TIMEOUT_NUM] = {
+	[PDI_TIMEOUT_BYTE]	= "byte",
+	[PDI_TIMEOUT_NVMEN]	= "nvmen",
+	[PDI_TIMEOUT_BUSY]	= "busy",
+	[PDI_TIMEOUT_ERASE]	= "erase",
+};
+
+/**
+ * \brief Parse a NAME=US time budget override.
+ */
+static int parse_timeout(const char *arg, uint32_t *timeouts)
+{
+	const char *eq = strchr(arg, '=');
+	unsigned int i;
+	char *end;
+
+	if (!eq)
+		return -1;
+
+	for (i = 0; i < PDI_TIMEOUT_NUM; i++) {
+		if (strlen(timeout_names[i]) == (size_t)(eq - arg) &&
+		    !strncmp(arg, timeout_names[i], eq - arg))
+			break;
+	}
+	if (i == PDI_TIMEOUT_NUM)
+		return -1;
+
+	timeouts[i] = strtoul(eq + 1, &end, 0);
+	if (*end || timeouts[i] == 0)
+		return -1;
+
+	return 0;
+}
+
+/**
+ * \brief Parse a "MODE[=US]" completion option.
+ */
+static int parse_completion(const char *arg, struct pdi_cli *cli)
+{
+	size_t len = strcspn(arg, "=");
+	unsigned int i;
+	char *end;
+
+	for (i = 0; i < PDI_COMPLETION_NUM; i++) {
+		if (strlen(pdi_completion_name(i)) == len &&
+		    !strncmp(arg, pdi_completion_name(i), len))
+			break;
+	}
+	if (i == PDI_COMPLETION_NUM)
+		return -1;
+
+	cli->completion = i;
+	cli->spin_us = 0;
+	if (arg[len]) {
+		cli->spin_us = strtoul(arg + len + 1, &end, 0);
+		if (*end || cli->spin_us == 0)
+			return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * \brief Command round trips, by how their completion was collected.
+ */
+static void print_completion(const struct pdi_cli *cli)
+{
+	const struct pdi_stats *st = &cli->stats;
+
+	printf("completion %s: %llu polled", pdi_completion_name(cli->completion),
+	       (unsigned long long)st->polled);
+	if (st->polled)
+		printf(", %.1f us mean round trip",
+		       (double)st->polled_us / st->polled);
+	printf(", %llu by interrupt", (unsigned long long)st->irqs);
+	if (st->irqs)
+		printf(", %.1f us mean round trip",
+		       (double)st->irq_us / st->irqs);
+	printf(", %llu us spun in vain\n", (unsigned long long)st->spin_us);
+}
+
+static void usage(void)
+{
+	fprintf(stderr,
+		"usage: pdi [OPTION]... [COMMAND]\n"
+		"\n"
+		"  (none)                    print the device signature\n"
+		"  info                      print the device information block\n"
+		"  phy                       print the PDI clock and PHY timing\n"
+		"  calibrate [READS]         find the best input sampling point\n"
+		"  dump SNAPSHOT             read the whole device into SNAPSHOT\n"
+		"  compare IMAGE [SNAPSHOT]  compare the flash with IMAGE\n"
+		"  program IMAGE [SNAPSHOT]  program IMAGE into the flash\n"
+		"  program PLAN              run a plan\n"
+		"  plan IMAGE PLAN           compile IMAGE into PLAN, no device\n"
+		"                            needed\n"
+		"  verify PLAN               check the pages PLAN writes\n"
+		"  peek ADDRESS [LENGTH]     read LENGTH (1) bytes of the data\n"
+		"                            space, SRAM or I/O registers\n"
+		"  poke ADDRESS BYTE...      write bytes to the data space\n"
+		"\n"
+		"  -t NAME=US  time budget override in microseconds, NAME is one\n"
+		"              of byte, nvmen, busy or erase\n"
+		"  -f KHZ      PDI_CLK frequency\n"
+		"  -p PHY      PDI PHY backend, bitbang (default) or shift, the\n"
+		"              shift PHY needs its own wiring\n"
+		"  -c          allow a chip erase, which also erases the EEPROM\n"
+		"  -g N        run a plan on N targets at once, wired to the\n"
+		"              channels 0 to N-1 of the bit-bang PHY\n"
+		"  -w MODE     how command completions are collected: irq\n"
+		"              (default), poll, spinning up to 100 us per\n"
+		"              command, or hybrid, spinning only for commands\n"
+		"              that took less before. MODE=US sets the spin\n"
+		"              budget. Prints the command round trips\n"
+		"  -e ENGINE   what runs a plan, firmware (default) or sequencer,\n"
+		"              which replays bits compiled on the host, not\n"
+		"              on the shift PHY\n"
+		"  -m FILE     add the job metrics to FILE, a node exporter text\n"
+		"              file holding totals over every run\n"
+		"  -j FILE     append the job metrics to FILE as a JSON line\n"
+		"  -T FILE     record every PDI bus event into FILE, for\n"
+		"              pdi-replay\n"
+		"  -W          program board after board until interrupted:\n"
+		"              wait for a target, program it, report PASS or\n"
+		"              FAIL and wait for it to be removed\n"
+		"  -J FILE     keep the progress of a plan in FILE, and resume\n"
+		"              from it on the same device\n"
+		"  -s NAME=AREA:OFFSET:LENGTH\n"
+		"              declare a patch slot in a new plan, AREA is one\n"
+		"              of flash, eeprom or usersig\n"
+		"  -d NAME=HEX give the slot NAME its value for this device\n"
+		"  -D FILE     take slot values from FILE, a CSV file with the\n"
+		"              slot names in its first row, one row per board\n"
+		"\n"
+		"verify reads back every page a plan writes or erases and\n"
+		"compares it on the PRU, only the pages that differ come back.\n"
+		"\n"
+		"peek and poke take data space addresses, 0 to 0xffff. Up to\n"
+		"512 bytes go in a single PDI burst.\n"
+		"\n"
+		"calibrate reads the signature READS (32) times at each sampling\n"
+		"point and keeps the middle of the window where all of them\n"
+		"read back right, for the clock in use.\n"
+		"\n"
+		"program erases only what it has to. A SNAPSHOT of the device,\n"
+		"taken with dump, lets it erase only the pages that change.\n"
+		"\n"
+		"A plan holds the erases and the pages to write, worked out\n"
+		"once for a whole batch. It erases every section the image\n"
+		"reaches, or the chip with -c, and refuses other devices.\n"
+		"With -g the targets share PDI_CLK, each on data lines of its\n"
+		"own, and one loads a page while the others write theirs.\n"
+		"With -W the PRU probes for a target every 20 ms, and the\n"
+		"stage of a plan is copied for the first board only.\n"
+		"With -J a plan cut short, by SIGINT or otherwise, carries on\n"
+		"from the last pages it wrote, once the last of them reads\n"
+		"back right. SIGINT and SIGTERM let the page being written\n"
+		"complete and leave programming mode.\n"
+		"\n"
+		"Patch slots are bytes that differ from one board to the next,\n"
+		"a serial number or calibration data. A plan runs only once\n"
+		"each of them has a value: flash slots are patched into the\n"
+		"staged pages under them, EEPROM and usersig slots are written\n"
+		"after the flash. With -W every board takes the next row of\n"
+		"the -D file, the watch stops when there are none left.\n");
+}
+
+/**
+ * \brief Get the current flash contents out of a complete snapshot.
+ */
+static int load_current(struct pdi_cli *cli, const char *path)
+{
+	struct snapshot_header *hdr;
+	unsigned int i;
+
+	if (snapshot_open(&cli->snap, path) < 0) {
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+		return -1;
+	}
+
+	hdr = cli->snap.hdr;
+	for (i = 0; i < hdr->nregions; i++) {
+		if (hdr->region[i].type == SNAPSHOT_FLASH &&
+		    hdr->region[i].size == XNVM_FLASH_SIZE &&
+		    hdr->region[i].valid == XNVM_FLASH_SIZE) {
+			cli->current = snapshot_data(&cli->snap, SNAPSHOT_FLASH);
+			return 0;
+		}
+	}
+
+	fprintf(stderr, "%s: no complete flash dump\n", path);
+	snapshot_close(&cli->snap);
+
+	return -1;
+}
+
+/**
+ * \brief Map a whole file read-only.
+ */
+static const uint8_t *map_file(const char *path, size_t *size)
+{
+	struct stat st;
+	void *map;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return NULL;
+
+	if (fstat(fd, &st) < 0 || st.st_size == 0) {
+		close(fd);
+		return NULL;
+	}
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return NULL;
+
+	*size = st.st_size;
+	return map;
+}
+
+/**
+ * \brief Compile the image into a plan and show what it does.
+ */
+static int make_plan(struct pdi_cli *cli, const char *path)
+{
+	const uint8_t *plan;
+	size_t size;
+
+	if (plan_compile(path, cli->image, cli->image_size,
+			 cli->flags & PDI_PROGRAM_CHIP_ERASE, cli->slots,
+			 cli->nslots) < 0) {
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+		return 1;
+	}
+
+	plan = map_file(path, &size);
+	if (!plan) {
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+		return 1;
+	}
+	print_plan((const struct plan_header *)plan);
+	munmap((void *)plan, size);
+
+	return 0;
+}
+
+/**
+ * \brief Parse a NAME=AREA:OFFSET:LENGTH patch slot.
+ *
+ * Whether it fits its area is checked when the plan is compiled.
+ */
+static int parse_slot(const char *arg, struct plan_patch *slot)
+{
+	const char *eq = strchr(arg, '=');
+	unsigned long offset, length;
+	size_t len;
+	char *end;
+
+	if (!eq || eq == arg || eq - arg >= PLAN_PATCH_NAME_SIZE)
+		return -1;
+
+	memset(slot, 0, sizeof(*slot));
+	memcpy(slot->name, arg, eq - arg);
+
+	len = strcspn(++eq, ":");
+	for (slot->area = 0; slot->area <= PLAN_PATCH_USER_SIGN; slot->area++) {
+		if (strlen(plan_patch_area_name(slot->area)) == len &&
+		    !strncmp(eq, plan_patch_area_name(slot->area), len))
+			break;
+	}
+	if (slot->area > PLAN_PATCH_USER_SIGN || eq[len] != ':')
+		return -1;
+
+	offset = strtoul(eq + len + 1, &end, 0);
+	if (*end != ':')
+		return -1;
+	length = strtoul(end + 1, &end, 0);
+	if (*end || offset > XNVM_FLASH_SIZE || length > SHM_DATA_MAX)
+		return -1;
+
+	slot->offset = offset;
+	slot->length = length;
+	return 0;
+}
+
+/**
+ * \brief Open the CSV file of patch slot values and read its header row.
+ */
+static int open_csv(struct pdi_cli *cli)
+{
+	size_t size = 0;
+
+	cli->csv = fopen(cli->csv_path, "r");
+	if (!cli->csv) {
+		fprintf(stderr, "%s: %s\n", cli->csv_path, strerror(errno));
+		return -1;
+	}
+
+	if (getline(&cli->csv_names, &size, cli->csv) < 0 ||
+	    strcspn(cli->csv_names, ",\r\n") == 0) {
+		fprintf(stderr, "%s: no header row\n", cli->csv_path);
+		fclose(cli->csv);
+		free(cli->csv_names);
+		return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * \brief Parse the arguments of peek and poke, argv[1] is the command.
+ */
+static int parse_data(struct pdi_cli *cli, int argc, const char *argv[])
+{
+	unsigned long value;
+	char *end;
 	int i;
-	void *p;
-	volatile uint32_t *shared_ram;
-	uint8_t dev_id[3];
 
-	/* Listen to SIGINT signals (program termination) */
+	cli->address = strtoul(argv[2], &end, 0);
+	if (*end || cli->address >= DATA_SPACE_SIZE)
+		return -1;
+
+	if (!strcmp(argv[1], "peek")) {
+		cli->mode = MODE_PEEK;
+		cli->length = 1;
+		if (argc == 4) {
+			cli->length = strtoul(argv[3], &end, 0);
+			if (*end || cli->length == 0)
+				return -1;
+		}
+	} else {
+		cli->mode = MODE_POKE;
+		cli->length = argc - 3;
+		cli->bytes = malloc(cli->length);
+		if (!cli->bytes)
+			return -1;
+		for (i = 3; i < argc; i++) {
+			value = strtoul(argv[i], &end, 0);
+			if (*end || value > 0xFF)
+				return -1;
+			cli->bytes[i - 3] = value;
+		}
+	}
+
+	return cli->length > DATA_SPACE_SIZE - cli->address ? -1 : 0;
+}
+
+int main(int argc, const char *argv[]) {
+	struct pdi_cli cli = { 0 };
+	struct pdi *h;
+	struct pollfd pfd;
+	const char *snapshot_path = NULL;
+	uint32_t timeouts[PDI_TIMEOUT_NUM] = { 0 };
+	enum pdi_engine engine = PDI_ENGINE_FIRMWARE;
+	int opt, ret = 0;
+	char *end;
+
+	cli.backend = -1;
+	cli.completion = -1;
+
+	while ((opt = getopt(argc, (char * const *)argv, "D:J:T:Wcd:e:f:g:j:m:p:s:t:w:")) != -1) {
+		switch (opt) {
+		case 'D':
+			cli.csv_path = optarg;
+			break;
+		case 'J':
+			cli.journal_path = optarg;
+			break;
+		case 'T':
+			cli.trace_path = optarg;
+			break;
+		case 'W':
+			cli.watch = 1;
+			break;
+		case 'c':
+			cli.flags |= PDI_PROGRAM_CHIP_ERASE;
+			break;
+		case 'd':
+			if (cli.ndefines == PLAN_PATCHES_MAX ||
+			    !strchr(optarg, '=')) {
+				usage();
+				return 1;
+			}
+			cli.defines[cli.ndefines++] = optarg;
+			break;
+		case 'e':
+			if (!strcmp(optarg, "firmware"))
+				engine = PDI_ENGINE_FIRMWARE;
+			else if (!strcmp(optarg, "sequencer"))
+				engine = PDI_ENGINE_SEQUENCER;
+			else {
+				usage();
+				return 1;
+			}
+			break;
+		case 'g':
+			cli.targets = strtoul(optarg, &end, 0);
+			if (*end || cli.targets == 0 ||
+			    cli.targets > PDI_CHANNELS) {
+				usage();
+				return 1;
+			}
+			break;
+		case 'f':
+			cli.clk_hz = strtoul(optarg, &end, 0) * 1000;
+			if (*end || cli.clk_hz == 0) {
+				usage();
+				return 1;
+			}
+			break;
+		case 'j':
+			cli.json_path = optarg;
+			break;
+		case 'm':
+			cli.prom_path = optarg;
+			break;
+		case 'p':
+			if (!strcmp(optarg, backend_names[PHY_BITBANG]))
+				cli.backend = PHY_BITBANG;
+			else if (!strcmp(optarg, backend_names[PHY_SHIFT]))
+				cli.backend = PHY_SHIFT;
+			else {
+				usage();
+				return 1;
+			}
+			break;
+		case 's':
+			if (cli.nslots < PLAN_PATCHES_MAX &&
+			    parse_slot(optarg, &cli.slots[cli.nslots]) == 0) {
+				cli.nslots++;
+				break;
+			}
+			usage();
+			return 1;
+		case 'w':
+			if (parse_completion(optarg, &cli) == 0)
+				break;
+			usage();
+			return 1;
+		case 't':
+			if (parse_timeout(optarg, timeouts) == 0)
+				break;
+			/* fall through */
+		default:
+			usage();
+			return 1;
+		}
+	}
+
+	/* make argv[1] the command */
+	argc -= optind - 1;
+	argv += optind - 1;
+
+	if (argc == 1) {
+		cli.mode = MODE_SIGNATURE;
+	} else if (!strcmp(argv[1], "info") && argc == 2) {
+		cli.mode = MODE_INFO;
+	} else if (!strcmp(argv[1], "phy") && argc == 2) {
+		cli.mode = MODE_PHY;
+	} else if (!strcmp(argv[1], "calibrate") && (argc == 2 || argc == 3)) {
+		cli.mode = MODE_CALIBRATE;
+		cli.reads = 32;
+		if (argc == 3) {
+			cli.reads = strtoul(argv[2], &end, 0);
+			if (*end || cli.reads == 0 || cli.reads > 0xFFFF) {
+				usage();
+				return 1;
+			}
+		}
+	} else if (!strcmp(argv[1], "dump") && argc == 3) {
+		cli.mode = MODE_DUMP;
+		snapshot_path = argv[2];
+	} else if (!strcmp(argv[1], "compare") && (argc == 3 || argc == 4)) {
+		cli.mode = MODE_COMPARE;
+		if (argc == 4)
+			snapshot_path = argv[3];
+	} else if (!strcmp(argv[1], "program") && (argc == 3 || argc == 4)) {
+		cli.mode = MODE_PROGRAM;
+		if (argc == 4)
+			snapshot_path = argv[3];
+	} else if (!strcmp(argv[1], "plan") && argc == 4) {
+		cli.mode = MODE_PLAN;
+	} else if (!strcmp(argv[1], "verify") && argc == 3) {
+		cli.mode = MODE_VERIFY;
+	} else if ((!strcmp(argv[1], "peek") && (argc == 3 || argc == 4)) ||
+		   (!strcmp(argv[1], "poke") && argc >= 4)) {
+		if (parse_data(&cli, argc, argv) < 0) {
+			free(cli.bytes);
+			usage();
+			return 1;
+		}
+	} else {
+		usage();
+		return 1;
+	}
+
+	if (cli.mode == MODE_COMPARE || cli.mode == MODE_PROGRAM ||
+	    cli.mode == MODE_PLAN || cli.mode == MODE_VERIFY) {
+		cli.image = map_file(argv[2], &cli.image_size);
+		if (!cli.image) {
+			fprintf(stderr, "%s: %s\n", argv[2], strerror(errno));
+			return 1;
+		}
+		cli.precompiled = (cli.mode == MODE_PROGRAM ||
+				   cli.mode == MODE_VERIFY) &&
+			cli.image_size >= sizeof(struct plan_header) &&
+			((const struct plan_header *)cli.image)->magic ==
+			PLAN_MAGIC;
+		if (cli.precompiled) {
+			if (snapshot_path) {
+				usage();
+				return 1;
+			}
+			if (plan_check((const struct plan_header *)cli.image,
+				       cli.image_size) < 0) {
+				fprintf(stderr, "%s: not a valid plan\n",
+					argv[2]);
+				return 1;
+			}
+		} else if (cli.mode == MODE_VERIFY) {
+			fprintf(stderr, "%s: not a plan\n", argv[2]);
+			return 1;
+		} else if (cli.image_size > XNVM_FLASH_SIZE) {
+			fprintf(stderr, "%s: larger than flash\n", argv[2]);
+			return 1;
+		}
+	}
+
+	/* several targets only run plans, on the firmware */
+	if (cli.targets > 1 &&
+	    (!cli.precompiled || cli.mode != MODE_PROGRAM ||
+	     engine != PDI_ENGINE_FIRMWARE ||
+	     cli.backend == PHY_SHIFT)) {
+		usage();
+		return 1;
+	}
+
+	/* the shift PHY cannot replay bits split across words */
+	if (engine == PDI_ENGINE_SEQUENCER && cli.backend == PHY_SHIFT) {
+		usage();
+		return 1;
+	}
+
+	/* every board is a new device, a snapshot would be of another */
+	if (cli.watch && (cli.mode != MODE_PROGRAM || snapshot_path)) {
+		usage();
+		return 1;
+	}
+
+	/* slots are declared by a new plan, given values when one runs */
+	if ((cli.nslots && cli.mode != MODE_PLAN) ||
+	    ((cli.ndefines || cli.csv_path) &&
+	     (!cli.precompiled || cli.targets > 1))) {
+		usage();
+		return 1;
+	}
+
+	/* the journal follows pages of a plan, written one target at a time */
+	if (cli.journal_path &&
+	    (!cli.precompiled || engine != PDI_ENGINE_FIRMWARE ||
+	     cli.targets > 1)) {
+		usage();
+		return 1;
+	}
+
+	if (cli.mode == MODE_PROGRAM && snapshot_path &&
+	    load_current(&cli, snapshot_path) < 0)
+		return 1;
+
+	if (cli.mode == MODE_PLAN)
+		return make_plan(&cli, argv[3]);
+
+	if (cli.csv_path && open_csv(&cli) < 0)
+		return 1;
+
+	if (cli.trace_path) {
+		cli.trace = fopen(cli.trace_path, "wb");
+		if (!cli.trace) {
+			fprintf(stderr, "%s: %s\n", cli.trace_path,
+				strerror(errno));
+			return 1;
+		}
+	}
+
+	if (cli.journal_path && journal_open(&cli.journal, cli.journal_path) < 0) {
+		fprintf(stderr, "%s: %s\n", cli.journal_path, strerror(errno));
+		if (cli.trace)
+			fclose(cli.trace);
+		return 1;
+	}
+
+	/* Listen to SIGINT and SIGTERM signals (program termination) */
 	signal(SIGINT, signal_handler);
+	signal(SIGTERM, signal_handler);
 
 	/* Load and run binary into pru0 */
-	init_pru_program();
+	h = pdi_open();
+	if (!h) {
+		fprintf(stderr, "Cannot set up the PRU\n");
+		if (cli.trace)
+			fclose(cli.trace);
+		return 1;
+	}
+	pdi_set_timeouts(h, timeouts);
+	pdi_set_engine(h, engine);
+	if (cli.journal_path)
+		pdi_set_journal(h, &cli.journal);
+	if (cli.targets)
+		pdi_set_channels(h, (1u << cli.targets) - 1);
+	if (cli.completion >= 0)
+		pdi_set_completion(h, cli.completion, cli.spin_us);
 
-	/* Get pointer to shared ram */
-	prussdrv_map_prumem(PRUSS0_SHARED_DATARAM, &p);
-	shared_ram = (uint32_t *)p;
+	/* first, so that the trace holds every command of the session */
+	if (cli.trace && pdi_submit(h, pdi_job_trace(cli.trace, trace_done,
+						     &cli)) < 0) {
+		ret = 1;
+		goto out;
+	}
 
-	for (i = 0; i < 3 ; i++) {
-		shared_ram[1] = i;
-		shared_ram[0] = CMD_READ_SIGNATURE;
+	/* the PHY and clock hold for the jobs queued after this one */
+	if ((cli.clk_hz || cli.backend >= 0) && cli.mode != MODE_PHY &&
+	    pdi_submit(h, pdi_job_phy_select(cli.backend, cli.clk_hz,
+					     clock_done, &cli)) < 0) {
+		ret = 1;
+		goto out;
+	}
+
+	cli.h = h;
+	if (cli.watch) {
+		watch_wait(&cli, 1);
+	} else {
+		cli.job = make_job(&cli, snapshot_path);
+		if (!cli.job || pdi_submit(h, cli.job) < 0) {
+			ret = 1;
+			goto out;
+		}
+	}
 
-		printf("Wait for interrupt from PRU\n");
-		prussdrv_pru_wait_event(PRU_EVTOUT_0);
-		prussdrv_pru_clear_event(PRU_EVTOUT_0, PRU0_ARM_INTERRUPT);
+	/*
+	 * The event loop. Anything else the station has to do can wait on
+	 * its own descriptors next to this one.
+	 */
+	pfd.fd = pdi_fd(h);
+	pfd.events = POLLIN;
+	while (!cli.done) {
+		if (poll(&pfd, 1, -1) < 0 && errno != EINTR)
+			break;
+		if (finish && cli.job)
+			pdi_cancel(h, cli.job);
+		pdi_process(h);
+	}
 
-		printf("Got interrupt from PRU\n");
-		dev_id[i] = shared_ram[2];
+	if (cli.watch) {
+		printf("%u board(s) programmed, %u failed\n", cli.boards,
+		       cli.failed);
+		ret = cli.failed || (cli.status != STATUS_OK &&
+				     cli.status != ERR_FLUSHED);
+	} else if (cli.mode == MODE_DUMP || cli.mode == MODE_COMPARE)
+		ret = dump_finish(&cli);
+	else if (cli.status != STATUS_OK) {
+		fprintf(stderr, "Failed (%d)\n", cli.status);
+		ret = 1;
 	}
 
-	printf("Device signature = 0x%02x%02x%02x\n", dev_id[0], dev_id[1],
-	       dev_id[2]);
+	if (cli.completion >= 0)
+		print_completion(&cli);
 
+	/* in watch mode every board got its own */
+	if (!cli.watch)
+		write_metrics(&cli);
+
+out:
 	printf("Disabling PRU.\n");
-	prussdrv_pru_disable(PRU_NUM);
-	prussdrv_exit();
+	pdi_close(h);
 
-	return 0;
+	if (cli.trace && fclose(cli.trace) != 0) {
+		fprintf(stderr, "%s: %s\n", cli.trace_path, strerror(errno));
+		ret = 1;
+	}
+
+	if (cli.current)
+		snapshot_close(&cli.snap);
+
+	if (cli.journal_path)
+		journal_close(&cli.journal);
+
+	if (cli.csv) {
+		fclose(cli.csv);
+		free(cli.csv_names);
+		free(cli.csv_row);
+	}
+
+	free(cli.bytes);
+
+	return ret;
 }
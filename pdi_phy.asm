@@ -0,0 +1,286 @@
+;
+; PDI physical layer.
+;
+; Copyright (C) 2015-2017 Toby Churchill Ltd.
+;
+; Enric Balletbo Serra <enric.balletbo@collabora.com>
+;
+; License
+;
+; This program is free software; you can redistribute it and/or modify
+; it under the terms of the GNU General Public License version 2 as
+; published by the Free Software Foundation.
+;
+; Every PRU instruction used between two clock edges takes one cycle, so
+; the cycle counts in the comments are exact. Each clock phase, low and
+; high, is 5 cycles plus a delay loop of 2 cycles per iteration on every
+; path, see PHY_HALF_CYCLES() in pdi_phy.h. The configuration is loaded
+; before the first edge and the return happens after the last one, neither
+; is part of a bit.
+;
+; The receiver samples PDI_DATA one cycle after the rising edge, or, when
+; phy->sample is not zero, 2 + 2 * sample cycles after it; see
+; PHY_SAMPLE_CYCLES() in pdi_phy.h. The late paths pay for the delay out
+; of the high phase, which keeps its length.
+;
+; Calling convention (clpru): arguments in r14, r15, r16..., result in r14,
+; return address in r3.w2, r0, r1 and r14-r29 are free to use.
+;
+
+	.asg	r17, CLK		; struct pdi_phy, in this order
+	.asg	r18, TX
+	.asg	r19, RX
+	.asg	r20, HALF
+	.asg	r21, SAMPLE
+	.asg	r22, BIT_REST		; HALF - SAMPLE - 2
+	.asg	r23, HUNT_REST		; HALF - SAMPLE - 1
+
+	.text
+
+;
+; void pdi_phy_tx(const struct pdi_phy *phy, uint32_t bits, uint32_t nbits)
+;
+; r15 bits still to send, LSB next
+; r16 bits left
+;
+	.global	pdi_phy_tx
+pdi_phy_tx:
+	LBBO	&CLK, r14, 0, 20
+
+tx_bit:						; low phase
+	CLR	r30, r30, CLK			; 1	falling edge
+	QBBC	tx_zero, r15, 0			; 1
+	SET	r30, r30, TX			; 1
+	QBA	tx_low				; 1
+tx_zero:
+	CLR	r30, r30, TX			; 1
+	NOP					; 1
+tx_low:
+	MOV	r0, HALF			; 1
+tx_low_wait:
+	SUB	r0, r0, 1			; 2 * HALF
+	QBNE	tx_low_wait, r0, 0
+
+	SET	r30, r30, CLK			; 1	rising edge, high phase
+	LSR	r15, r15, 1			; 1
+	SUB	r16, r16, 1			; 1
+	MOV	r0, HALF			; 1
+tx_high_wait:
+	SUB	r0, r0, 1			; 2 * HALF
+	QBNE	tx_high_wait, r0, 0
+	QBNE	tx_bit, r16, 0			; 1
+
+	JMP	r3.w2
+
+;
+; uint32_t pdi_phy_rx(const struct pdi_phy *phy, uint32_t hunt)
+;
+; r1  index of the next frame bit
+; r14 frame bits received
+; r15 hunt clocks left
+;
+; The input is sampled by the instruction right after the rising edge.
+;
+	.global	pdi_phy_rx
+pdi_phy_rx:
+	LBBO	&CLK, r14, 0, 20
+	LDI	r14, 0
+	LDI	r1, 0
+	QBNE	rx_late, SAMPLE, 0
+
+rx_hunt:					; low phase
+	CLR	r30, r30, CLK			; 1	falling edge
+	NOP					; 1
+	NOP					; 1
+	NOP					; 1
+	MOV	r0, HALF			; 1
+rx_hunt_low_wait:
+	SUB	r0, r0, 1			; 2 * HALF
+	QBNE	rx_hunt_low_wait, r0, 0
+
+	SET	r30, r30, CLK			; 1	rising edge, high phase
+	QBBC	rx_start, r31, RX		; 1	start bit
+	SUB	r15, r15, 1			; 1
+	MOV	r0, HALF			; 1
+rx_hunt_high_wait:
+	SUB	r0, r0, 1			; 2 * HALF
+	QBNE	rx_hunt_high_wait, r0, 0
+	QBNE	rx_hunt, r15, 0			; 1
+
+	SET	r14, r14, 31			; PHY_NO_START
+	JMP	r3.w2
+
+rx_start:					; high phase, continued
+	MOV	r0, HALF			; 1
+rx_start_wait:
+	SUB	r0, r0, 1			; 2 * HALF
+	QBNE	rx_start_wait, r0, 0
+	NOP					; 1
+	NOP					; 1
+
+rx_bit:						; low phase
+	CLR	r30, r30, CLK			; 1	falling edge
+	NOP					; 1
+	NOP					; 1
+	NOP					; 1
+	MOV	r0, HALF			; 1
+rx_bit_low_wait:
+	SUB	r0, r0, 1			; 2 * HALF
+	QBNE	rx_bit_low_wait, r0, 0
+
+	SET	r30, r30, CLK			; 1	rising edge, high phase
+	QBBC	rx_zero, r31, RX		; 1
+	SET	r14, r14, r1			; 1
+	QBA	rx_next				; 1
+rx_zero:
+	NOP					; 1
+	NOP					; 1
+rx_next:
+	ADD	r1, r1, 1			; 1
+	SUB	r0, HALF, 1			; 1	one iteration short,
+rx_bit_high_wait:				;	paid for above
+	SUB	r0, r0, 1			; 2 * (HALF - 1)
+	QBNE	rx_bit_high_wait, r0, 0
+	QBNE	rx_bit, r1, 11			; 1	PHY_FRAME_BITS - 1
+
+	JMP	r3.w2
+
+;
+; pdi_phy_rx() with the input sampled late, same registers.
+;
+rx_late:
+	SUB	HUNT_REST, HALF, SAMPLE
+	SUB	HUNT_REST, HUNT_REST, 1
+	SUB	BIT_REST, HUNT_REST, 1
+
+rx_late_hunt:					; low phase
+	CLR	r30, r30, CLK			; 1	falling edge
+	NOP					; 1
+	NOP					; 1
+	NOP					; 1
+	MOV	r0, HALF			; 1
+rx_late_hunt_low_wait:
+	SUB	r0, r0, 1			; 2 * HALF
+	QBNE	rx_late_hunt_low_wait, r0, 0
+
+	SET	r30, r30, CLK			; 1	rising edge, high phase
+	MOV	r0, SAMPLE			; 1
+rx_late_hunt_sample:
+	SUB	r0, r0, 1			; 2 * SAMPLE
+	QBNE	rx_late_hunt_sample, r0, 0
+	QBBC	rx_late_start, r31, RX		; 1	start bit
+	SUB	r15, r15, 1			; 1
+	MOV	r0, HUNT_REST			; 1
+rx_late_hunt_high_wait:
+	SUB	r0, r0, 1			; 2 * HUNT_REST
+	QBNE	rx_late_hunt_high_wait, r0, 0
+	NOP					; 1
+	QBNE	rx_late_hunt, r15, 0		; 1
+
+	SET	r14, r14, 31			; PHY_NO_START
+	JMP	r3.w2
+
+rx_late_start:					; high phase, continued
+	ADD	r0, HUNT_REST, 1		; 1
+rx_late_start_wait:
+	SUB	r0, r0, 1			; 2 * (HUNT_REST + 1)
+	QBNE	rx_late_start_wait, r0, 0
+	NOP					; 1
+
+rx_late_bit:					; low phase
+	CLR	r30, r30, CLK			; 1	falling edge
+	NOP					; 1
+	NOP					; 1
+	NOP					; 1
+	MOV	r0, HALF			; 1
+rx_late_bit_low_wait:
+	SUB	r0, r0, 1			; 2 * HALF
+	QBNE	rx_late_bit_low_wait, r0, 0
+
+	SET	r30, r30, CLK			; 1	rising edge, high phase
+	MOV	r0, SAMPLE			; 1
+rx_late_bit_sample:
+	SUB	r0, r0, 1			; 2 * SAMPLE
+	QBNE	rx_late_bit_sample, r0, 0
+	QBBC	rx_late_zero, r31, RX		; 1
+	SET	r14, r14, r1			; 1
+	QBA	rx_late_next			; 1
+rx_late_zero:
+	NOP					; 1
+	NOP					; 1
+rx_late_next:
+	ADD	r1, r1, 1			; 1
+	MOV	r0, BIT_REST			; 1
+rx_late_bit_high_wait:
+	SUB	r0, r0, 1			; 2 * BIT_REST
+	QBNE	rx_late_bit_high_wait, r0, 0
+	NOP					; 1
+	QBNE	rx_late_bit, r1, 11		; 1	PHY_FRAME_BITS - 1
+
+	JMP	r3.w2
+
+;
+; uint32_t pdi_phy_rx_burst(const struct pdi_phy *phy, uint8_t *data,
+;			    uint32_t length, uint32_t hunt)
+;
+; Frame after frame with pdi_phy_rx(). Between two frames PDI_CLK is high
+; and the target waits for the next edge, so checking and storing a frame
+; there costs time but no bits; none of it is cycle counted.
+;
+; r24 phy
+; r25 where the next byte goes
+; r26 bytes left
+; r27 hunt clocks per frame
+; r28 bytes stored
+; r29 return address
+;
+	.global	pdi_phy_rx_burst
+pdi_phy_rx_burst:
+	MOV	r24, r14
+	MOV	r25, r15
+	MOV	r26, r16
+	MOV	r27, r17
+	LDI	r28, 0
+	MOV	r29.w0, r3.w2
+	QBEQ	burst_done, r26, 0
+
+burst_frame:
+	MOV	r14, r24
+	MOV	r15, r27
+	JAL	r3.w2, pdi_phy_rx
+	QBBS	burst_no_start, r14, 31
+
+	LSR	r0, r14, 9			; stop bits
+	AND	r0, r0, 3
+	QBNE	burst_bad, r0, 3
+
+	LSR	r0, r14, 8			; parity (even) over data and
+	AND	r0, r0, 1			; parity bit
+	XOR	r1, r14, r0
+	AND	r1, r1, 0xFF
+	LSR	r0, r1, 4
+	XOR	r1, r1, r0
+	LSR	r0, r1, 2
+	XOR	r1, r1, r0
+	LSR	r0, r1, 1
+	XOR	r1, r1, r0
+	QBBS	burst_bad, r1, 0
+
+	SBBO	&r14, r25, 0, 1
+	ADD	r25, r25, 1
+	ADD	r28, r28, 1
+	SUB	r26, r26, 1
+	QBNE	burst_frame, r26, 0
+
+burst_done:
+	MOV	r14, r28
+	JMP	r29.w0
+
+burst_no_start:
+	SET	r14, r28, 31			; PHY_NO_START
+	JMP	r29.w0
+
+burst_bad:
+	LSL	r14, r14, 16			; PHY_BURST_FRAME()
+	OR	r14, r14, r28
+	JMP	r29.w0
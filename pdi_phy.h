@@ -0,0 +1,164 @@
+/**
+ * PDI physical layer.
+ *
+ * Two backends move the bits: pdi_phy.asm bit-bangs them in cycle exact
+ * loops, pdi_phy_shift.c hands whole words to the serial shift modes of
+ * the enhanced GP ports. pdi_phy_ops points at the one in use.
+ *
+ * Copyright (C) 2015-2017 Toby Churchill Ltd.
+ *
+ * Enric Balletbo Serra <enric.balletbo@collabora.com>
+ *
+ * License
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+#ifndef PDI_PHY_H_INCLUDED
+#define PDI_PHY_H_INCLUDED
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "prog.h"
+#include "status_codes.h"
+
+/*
+ * Both clock phases, low and high, take PHY_HALF_CYCLES(half) PRU cycles
+ * on every path through pdi_phy.asm: 5 cycles of bit handling plus a delay
+ * loop of 2 cycles per iteration. The delay loop needs at least 2
+ * iterations; PHY_HALF_MIN is one more, which bounds PDI_CLK to
+ * 200 MHz / 22 = 9.1 MHz, under the 10 MHz PDI maximum.
+ *
+ * Between two calls PDI_CLK is left high. The PDI is synchronous, so the
+ * longer high phase in the gap between frames is harmless; only the bits of
+ * a frame are guaranteed to be evenly spaced.
+ */
+#define PHY_HALF_FIXED		5
+#define PHY_HALF_MIN		3
+#define PHY_HALF_MAX		4997	/* just above 10 kHz, the PDI minimum */
+#define PHY_HALF_CYCLES(half)	(PHY_HALF_FIXED + 2 * (half))
+
+/*
+ * The receiver samples PDI_DATA PHY_SAMPLE_CYCLES(sample) cycles after the
+ * rising edge. A late sample is paid for out of the high phase, which
+ * needs at least one delay loop iteration left, so it takes half >= 4 and
+ * sample <= PHY_SAMPLE_MAX(half).
+ */
+#define PHY_SAMPLE_CYCLES(sample)	((sample) ? 2 + 2 * (sample) : 1)
+#define PHY_SAMPLE_MAX(half)		((half) > 3 ? (half) - 3 : 0)
+
+/* Bits of a frame, start bit included */
+#define PHY_FRAME_BITS		12
+
+/* Clocks spent hunting for a start bit between two deadline checks */
+#define PHY_HUNT_CLOCKS		16
+
+/* pdi_phy_rx() return value when no start bit showed up */
+#define PHY_NO_START		0x80000000
+
+/* rx_burst() return value: frames stored, and the bad frame if any */
+#define PHY_BURST_COUNT(ret)	((ret) & 0xFFFF)
+#define PHY_BURST_FRAME(ret)	((ret) >> 16 & 0x7FF)
+
+/* struct pdi_phy pin that is not wired */
+#define PHY_NO_PIN		0xFFFFFFFF
+
+/**
+ * \brief Pins and timing of the PHY.
+ *
+ * The first five fields are read by the assembly code in this order, do
+ * not reorder. The pins are also driven directly, outside of frames, by
+ * the PDI enable and disable sequences whichever the backend.
+ */
+struct pdi_phy {
+	uint32_t clk;		/* R30 bit of PDI_CLK */
+	uint32_t tx;		/* R30 bit of the data output */
+	uint32_t rx;		/* R31 bit of the data input */
+	uint32_t half;		/* delay loop iterations per clock phase */
+	uint32_t sample;	/* input sampling delay after the rising edge */
+	uint32_t oe;		/* R30 bit of the output enable, or PHY_NO_PIN */
+};
+
+extern struct pdi_phy pdi_phy;
+
+/**
+ * \brief A PHY backend.
+ *
+ * tx(), rx() and rx_burst() behave as pdi_phy_tx(), pdi_phy_rx() and
+ * pdi_phy_rx_burst() below. start() is
+ * called once the PDI_DATA and PDI_CLK lines are idle high, before the
+ * enable clocks, stop() before the lines are driven directly again.
+ * set_sample() moves the input sampling point, kept in pdi_phy.sample, up
+ * to max_sample() at the clock in use; set_clock() keeps it if it still
+ * fits.
+ */
+struct pdi_phy_ops {
+	void (*start)(void);
+	void (*stop)(void);
+	void (*tx)(uint32_t bits, uint32_t nbits);
+	uint32_t (*rx)(uint32_t hunt);
+	uint32_t (*rx_burst)(uint8_t *data, uint32_t length, uint32_t hunt);
+	enum status_code (*set_clock)(uint32_t half_cycles);
+	uint32_t (*half_cycles)(void);
+	enum status_code (*set_sample)(uint32_t sample);
+	uint32_t (*max_sample)(void);
+	uint32_t (*sample_cycles)(uint32_t sample);
+	uint32_t min_half_cycles;
+	uint32_t max_half_cycles;
+	uint32_t fixed_cycles;		/* CPU cycles per clock phase, 0 if none */
+};
+
+extern const struct pdi_phy_ops pdi_phy_bitbang;
+extern const struct pdi_phy_ops pdi_phy_shift;
+extern const struct pdi_phy_ops *pdi_phy_ops;
+
+enum status_code pdi_phy_select(enum phy_backend backend);
+
+/**
+ * \brief Clock out the nbits low bits of bits, LSB first.
+ *
+ * Data changes right after the falling edge, the target samples it on the
+ * rising edge. Takes nbits * 2 * PHY_HALF_CYCLES(phy->half) cycles.
+ */
+void pdi_phy_tx(const struct pdi_phy *phy, uint32_t bits, uint32_t nbits);
+
+/**
+ * \brief Hunt for a start bit for up to hunt clocks, then clock in a frame.
+ *
+ * Returns the 11 bits following the start bit, LSB first: data in bits
+ * 0-7, parity in bit 8, stop bits in 9 and 10. PHY_NO_START if no start bit
+ * was seen.
+ */
+uint32_t pdi_phy_rx(const struct pdi_phy *phy, uint32_t hunt);
+
+/**
+ * \brief Clock in up to length frames back to back, into data.
+ *
+ * Each frame gets hunt clocks to start. Parity and stop bits are checked,
+ * and the byte stored, in the gap between two frames while PDI_CLK is high.
+ * Returns the number of bytes stored; when short of length, PHY_NO_START
+ * is set if the next frame did not start, otherwise PHY_BURST_FRAME() is
+ * the frame that failed its check.
+ */
+uint32_t pdi_phy_rx_burst(const struct pdi_phy *phy, uint8_t *data,
+			  uint32_t length, uint32_t hunt);
+
+/**
+ * \brief Check the even parity and the stop bits of a pdi_phy_rx() frame.
+ */
+static inline bool phy_frame_ok(uint32_t frame)
+{
+	uint32_t parity = frame & 0x1FF;
+
+	parity ^= parity >> 8;
+	parity ^= parity >> 4;
+	parity ^= parity >> 2;
+	parity ^= parity >> 1;
+
+	return !(parity & 1) && (frame & (3 << 9)) == (3 << 9);
+}
+
+#endif
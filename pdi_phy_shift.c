@@ -0,0 +1,320 @@
+/**
+ * PDI physical layer on the GP port serial shift modes.
+ *
+ * The GPO shifter clocks R30[15:0] out LSB first on PRU0_DATAOUT (r30[0])
+ * with the shift clock on r30[1], alternating between two shadow
+ * registers; a write to R30[15:0] loads the one not being shifted. The GPI
+ * shifter samples r31[0] on the same divided clock into R31[27:0], newest
+ * bit in bit 0. Both run from the same dividers, so every flip of the GPO
+ * shadow select brings exactly 16 new input bits, and the CPU only loads
+ * and unloads words.
+ *
+ * PDI_CLK comes out of the divider and never stops: between frames the
+ * data line idles high, which the PDI takes as idle bits. Frame sync on
+ * the input is done here, the hardware start bit detection is not used.
+ *
+ * Copyright (C) 2015-2017 Toby Churchill Ltd.
+ *
+ * Enric Balletbo Serra <enric.balletbo@collabora.com>
+ *
+ * License
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+#include <stdint.h>
+
+#include "pdi_phy.h"
+#include "timer.h"
+
+/* Macro for accessing a hardware register (32 bit) */
+#define HWREG(x) (*((volatile unsigned int *)(x)))
+
+/* PRU registers */
+volatile register unsigned int __R30;
+volatile register unsigned int __R31;
+
+/*
+ * AM335x PRU-ICSS Reference Guide, GPCFG0 register. Dividers go from 1 to
+ * 16 in steps of 0.5, only the whole ones are used to keep a 50% duty
+ * cycle on PDI_CLK.
+ */
+#define GPCFG0			0x26008
+#define GPI_MODE_28BIT_SHIFT	(2 << 0)
+#define GPI_DIV0(div)		(((div) - 1) * 2 << 3)
+#define GPI_DIV1(div)		(((div) - 1) * 2 << 8)
+#define GPO_MODE_SERIAL		(1 << 14)
+#define GPO_DIV0(div)		(((div) - 1) * 2 << 15)
+#define GPO_DIV1(div)		(((div) - 1) * 2 << 20)
+#define GPO_SH_SEL		(1 << 25)	/* shadow being shifted */
+
+#define SHIFT_DIV_MAX		16
+#define SHIFT_ENABLE		(1 << 29)	/* R30, GPO shifter running */
+#define SHIFT_WORD_BITS		16
+#define SHIFT_WORD_MASK		0xFFFF
+#define SHIFT_IDLE		0xFFFF
+#define SHIFT_IN_BITS		28	/* R31 input window */
+
+/*
+ * Clock phases in PRU cycles: 10 MHz at most, and 781 kHz, the slowest
+ * the dividers reach. Slower clocks need the bit-bang PHY.
+ */
+#define SHIFT_HALF_MIN		10
+#define SHIFT_HALF_MAX		(SHIFT_DIV_MAX * SHIFT_DIV_MAX / 2)
+
+static uint32_t div0 = SHIFT_DIV_MAX, div1 = SHIFT_DIV_MAX;
+static uint32_t running;
+
+/* Shadow select last seen, to tell when the shifter moves on */
+static uint32_t sh_sel;
+
+/* Cycle count of the bit boundary behind the last input bit taken */
+static uint32_t mark;
+
+/* Input bits not yet framed, oldest in bit 0 */
+static uint32_t fifo, nfifo;
+
+static uint32_t shift_config(void)
+{
+	return GPI_MODE_28BIT_SHIFT | GPI_DIV0(div0) | GPI_DIV1(div1) |
+	       GPO_MODE_SERIAL | GPO_DIV0(div0) | GPO_DIV1(div1);
+}
+
+/**
+ * \brief Wait for the shifter to move on to the other shadow register.
+ *
+ * Every 16 clocks. A flip that happened since the last call counts, so the
+ * caller has that long to come back without losing a word.
+ */
+static void shift_wait(void)
+{
+	while ((HWREG(GPCFG0) & GPO_SH_SEL) == sh_sel)
+		;
+	sh_sel ^= GPO_SH_SEL;
+	mark = timer_cycles();
+}
+
+/**
+ * \brief Load the shadow register that is not being shifted.
+ */
+static inline void shift_load(uint32_t word)
+{
+	__R30 = (__R30 & ~SHIFT_WORD_MASK) | (word & SHIFT_WORD_MASK);
+}
+
+/**
+ * \brief Take in the 16 bits following the last ones taken.
+ *
+ * The input shifter does not stop for the CPU, so the word is located by
+ * time rather than by the shadow flip: the bits that came in after it sit
+ * below it in R31. Up to 12 clocks late are fine, later and input was lost.
+ *
+ * \retval false the word was already shifted out of R31.
+ */
+static bool shift_in(void)
+{
+	uint32_t period = div0 * div1;
+	uint32_t next = mark + SHIFT_WORD_BITS * period;
+	uint32_t now, in, late, bits = 0;
+	int i;
+
+	while ((int32_t)(timer_cycles() - next) < 0)
+		;
+	now = timer_cycles();
+	in = __R31;
+
+	late = (now - next) / period;
+	if (late > SHIFT_IN_BITS - SHIFT_WORD_BITS)
+		return false;
+	in >>= late;
+	mark = next;
+
+	/* newest bit first in R31, oldest first in the fifo */
+	for (i = 0; i < SHIFT_WORD_BITS; i++) {
+		bits = bits << 1 | (in & 1);
+		in >>= 1;
+	}
+
+	fifo |= bits << nfifo;
+	nfifo += SHIFT_WORD_BITS;
+
+	return true;
+}
+
+static void shift_start(void)
+{
+	HWREG(GPCFG0) = shift_config();
+
+	/* idle in both shadow registers before the shifter starts */
+	shift_load(SHIFT_IDLE);
+	__R30 |= SHIFT_ENABLE;
+	sh_sel = HWREG(GPCFG0) & GPO_SH_SEL;
+	shift_load(SHIFT_IDLE);
+	shift_wait();
+
+	nfifo = 0;
+	fifo = 0;
+	running = 1;
+}
+
+static void shift_stop(void)
+{
+	running = 0;
+	__R30 &= ~SHIFT_ENABLE;
+
+	/* back to direct GPI/GPO for the pin sequences */
+	HWREG(GPCFG0) = 0;
+}
+
+/**
+ * \brief Clock out the nbits low bits of bits, LSB first.
+ *
+ * Sent in 16-bit words padded with idle bits. Starts on a shadow flip, so
+ * this takes up to 16 clocks more than the bits, and returns once the last
+ * bit is out with idle loaded behind it.
+ */
+static void shift_tx(uint32_t bits, uint32_t nbits)
+{
+	uint32_t n;
+
+	/* whatever came in so far is our own echo */
+	nfifo = 0;
+	fifo = 0;
+
+	sh_sel = HWREG(GPCFG0) & GPO_SH_SEL;
+	shift_wait();
+
+	while (nbits) {
+		n = nbits < SHIFT_WORD_BITS ? nbits : SHIFT_WORD_BITS;
+		shift_load(bits | SHIFT_IDLE << n);
+		shift_wait();
+		bits = n < 32 ? bits >> n : 0;
+		nbits -= n;
+	}
+
+	/* the last word is out once idle starts, then idle in both */
+	shift_load(SHIFT_IDLE);
+	shift_wait();
+	shift_load(SHIFT_IDLE);
+}
+
+/**
+ * \brief Hunt for a start bit for up to hunt clocks, then frame 11 bits.
+ *
+ * Bits past the frame are kept for the next call, which must come within
+ * 12 clocks, the input bits R31 holds beyond a word, or it finds no start.
+ */
+static uint32_t shift_rx(uint32_t hunt)
+{
+	uint32_t frame;
+
+	for (;;) {
+		/* drop idle bits ahead of the start bit */
+		while (nfifo && (fifo & 1)) {
+			if (!hunt)
+				return PHY_NO_START;
+			hunt--;
+			fifo >>= 1;
+			nfifo--;
+		}
+
+		if (nfifo >= PHY_FRAME_BITS) {
+			frame = fifo >> 1 & 0x7FF;
+			fifo >>= PHY_FRAME_BITS;
+			nfifo -= PHY_FRAME_BITS;
+			return frame;
+		}
+
+		if (!shift_in())
+			return PHY_NO_START;
+	}
+}
+
+/**
+ * \brief shift_rx() frame after frame, checked and stored as they come.
+ */
+static uint32_t shift_rx_burst(uint8_t *data, uint32_t length, uint32_t hunt)
+{
+	uint32_t frame, n;
+
+	for (n = 0; n < length; n++) {
+		frame = shift_rx(hunt);
+		if (frame == PHY_NO_START)
+			return n | PHY_NO_START;
+		if (!phy_frame_ok(frame))
+			return n | frame << 16;
+		data[n] = frame;
+	}
+
+	return n;
+}
+
+/**
+ * \brief Set the dividers to the shortest even period not under 2 phases.
+ */
+static enum status_code shift_set_clock(uint32_t half_cycles)
+{
+	uint32_t d0, d1, best = 0;
+
+	if (half_cycles < SHIFT_HALF_MIN || half_cycles > SHIFT_HALF_MAX)
+		return ERR_INVALID_ARG;
+
+	for (d0 = 1; d0 <= SHIFT_DIV_MAX; d0++) {
+		for (d1 = d0; d1 <= SHIFT_DIV_MAX; d1++) {
+			if (d0 * d1 & 1 || d0 * d1 < 2 * half_cycles)
+				continue;
+			if (!best || d0 * d1 < best) {
+				best = d0 * d1;
+				div0 = d0;
+				div1 = d1;
+			}
+		}
+	}
+
+	if (running)
+		HWREG(GPCFG0) = shift_config();
+
+	return STATUS_OK;
+}
+
+static uint32_t shift_half_cycles(void)
+{
+	return div0 * div1 / 2;
+}
+
+/*
+ * The GPI shifter samples on its own clock, in step with the GPO one: the
+ * sampling point cannot be moved.
+ */
+static enum status_code shift_set_sample(uint32_t sample)
+{
+	return sample ? ERR_INVALID_ARG : STATUS_OK;
+}
+
+static uint32_t shift_max_sample(void)
+{
+	return 0;
+}
+
+static uint32_t shift_sample_cycles(uint32_t sample)
+{
+	return 0;
+}
+
+const struct pdi_phy_ops pdi_phy_shift = {
+	shift_start,
+	shift_stop,
+	shift_tx,
+	shift_rx,
+	shift_rx_burst,
+	shift_set_clock,
+	shift_half_cycles,
+	shift_set_sample,
+	shift_max_sample,
+	shift_sample_cycles,
+	SHIFT_HALF_MIN,
+	SHIFT_HALF_MAX,
+	0,
+};
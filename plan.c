@@ -0,0 +1,391 @@
+/**
+ * Precompiled programming plans.
+ *
+ * A plan is everything a program job works out from an image, done once
+ * ahead of time: the erase operations, and the stage CMD_PROGRAM_IMAGE
+ * reads, with its sparse page map, page CRCs and page aligned payloads.
+ * Running a plan takes a signature check and a copy of the stage to DDR.
+ *
+ * Without a device at hand the flash contents are unknown, so every
+ * section the image reaches is erased as a whole, or the chip if allowed.
+ *
+ * A plan may name patch slots, bytes of flash, EEPROM or user signature
+ * that take a different value on every device, a serial number or a
+ * calibration value. They are supplied when the plan runs.
+ *
+ * Copyright (C) 2015-2017 Toby Churchill Ltd.
+ *
+ * Enric Balletbo Serra <enric.balletbo@collabora.com>
+ *
+ * License
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "plan.h"
+#include "stage.h"
+#include "crc16.h"
+#include "atxmega16d4_nvm_regs.h"
+
+#define PAGE_SIZE	XNVM_FLASH_PAGE_SIZE
+
+#define align(x, a)	(((x) + (a) - 1) & ~((a) - 1))
+
+static const char * const op_names[] = {
+	[PLAN_OP_ERASE]		= "erase",
+	[PLAN_OP_PROGRAM]	= "program",
+};
+
+static const char * const patch_area_names[] = {
+	[PLAN_PATCH_FLASH]	= "flash",
+	[PLAN_PATCH_EEPROM]	= "eeprom",
+	[PLAN_PATCH_USER_SIGN]	= "usersig",
+};
+
+static const uint32_t patch_area_sizes[] = {
+	[PLAN_PATCH_FLASH]	= XNVM_FLASH_SIZE,
+	[PLAN_PATCH_EEPROM]	= XNVM_EEPROM_SIZE,
+	[PLAN_PATCH_USER_SIGN]	= XNVM_USER_SIGN_SIZE,
+};
+
+/**
+ * \brief Check that patch slots are named, unique and fit their area.
+ */
+static int plan_patches_check(const struct plan_patch *patches,
+			      unsigned int npatches)
+{
+	const struct plan_patch *p;
+	unsigned int i, j;
+
+	if (npatches > PLAN_PATCHES_MAX)
+		return -1;
+
+	for (i = 0; i < npatches; i++) {
+		p = &patches[i];
+		if (!p->name[0] ||
+		    !memchr(p->name, 0, sizeof(p->name)) ||
+		    p->area > PLAN_PATCH_USER_SIGN ||
+		    p->length == 0 || p->length > SHM_DATA_MAX ||
+		    p->offset >= patch_area_sizes[p->area] ||
+		    p->length > patch_area_sizes[p->area] - p->offset)
+			return -1;
+
+		for (j = 0; j < i; j++) {
+			if (!strcmp(p->name, patches[j].name))
+				return -1;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Whether every page under the flash slots is in the stage with a payload.
+ */
+static int plan_patches_staged(const struct plan_header *hdr)
+{
+	const struct stage_header *stage = plan_stage(hdr);
+	const struct stage_page *map;
+	const struct plan_patch *p;
+	uint32_t address, i;
+	unsigned int s;
+
+	map = (const struct stage_page *)((const uint8_t *)stage +
+					  stage->map_offset);
+	for (s = 0; s < hdr->npatches; s++) {
+		p = &hdr->patches[s];
+		if (p->area != PLAN_PATCH_FLASH)
+			continue;
+
+		for (address = p->offset - p->offset % PAGE_SIZE;
+		     address < p->offset + p->length; address += PAGE_SIZE) {
+			for (i = 0; i < stage->npages; i++) {
+				if (map[i].address == address)
+					break;
+			}
+			if (i == stage->npages ||
+			    (map[i].flags & STAGE_PAGE_ERASE))
+				return -1;
+		}
+	}
+
+	return 0;
+}
+
+static void plan_add_op(struct plan_header *hdr, enum plan_op_type type,
+			uint16_t arg)
+{
+	hdr->ops[hdr->nops].type = type;
+	hdr->ops[hdr->nops].arg = arg;
+	hdr->nops++;
+}
+
+/**
+ * \brief Compile a raw flash image into a plan file, for this device.
+ *
+ * Flash slots are filled with 0x00 placeholders, which may extend the
+ * image, and the plan is worked out from that, image_crc included.
+ *
+ * \param allow_chip a chip erase, which also erases the EEPROM, is fine.
+ * \param patches per-device slots, npatches of them.
+ *
+ * \retval 0 on success, -1 with errno set otherwise, no file left behind.
+ */
+int plan_compile(const char *path, const uint8_t *image, size_t size,
+		 int allow_chip, const struct plan_patch *patches,
+		 unsigned int npatches)
+{
+	static const int unknown[PLAN_SECTIONS] = { -1, -1 };
+	uint8_t page[PAGE_SIZE] __attribute__((aligned(4)));
+	struct plan_header *hdr;
+	struct erase_plan ep;
+	struct stage st;
+	uint32_t offset, address, npages;
+	uint16_t crc;
+	unsigned int s;
+	size_t room, image_size;
+	uint8_t *map, *copy;
+	int fd;
+
+	if (size == 0 || size > XNVM_FLASH_SIZE ||
+	    plan_patches_check(patches, npatches) < 0) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	image_size = size;
+	for (s = 0; s < npatches; s++) {
+		if (patches[s].area == PLAN_PATCH_FLASH &&
+		    patches[s].offset + patches[s].length > size)
+			size = patches[s].offset + patches[s].length;
+	}
+
+	copy = malloc(size);
+	if (!copy)
+		return -1;
+	memset(copy, 0xff, size);
+	memcpy(copy, image, image_size);
+	for (s = 0; s < npatches; s++) {
+		if (patches[s].area == PLAN_PATCH_FLASH)
+			memset(copy + patches[s].offset, 0, patches[s].length);
+	}
+	image = copy;
+
+	erase_plan(&ep, image, size, NULL, unknown, allow_chip);
+
+	/* room for every page the plan covers, trimmed once staged */
+	npages = ep.end / PAGE_SIZE;
+	offset = align(sizeof(*hdr), PLAN_ALIGN);
+	room = offset + align(sizeof(struct stage_header) +
+			      npages * sizeof(struct stage_page), PAGE_SIZE) +
+	       npages * PAGE_SIZE;
+
+	fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+		goto err_free;
+
+	if (ftruncate(fd, room) < 0)
+		goto err_close;
+
+	map = mmap(NULL, room, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED)
+		goto err_close;
+
+	st.ddr = map + offset;
+	st.size = room - offset;
+	st.phys = 0;
+	st.hdr = (struct stage_header *)st.ddr;
+	if (stage_image(&st, image, size, NULL, &ep) < 0)
+		goto err_unmap;
+
+	hdr = (struct plan_header *)map;
+	hdr->magic = PLAN_MAGIC;
+	hdr->version = PLAN_VERSION;
+	hdr->signature[0] = XNVM_DEVID0;
+	hdr->signature[1] = XNVM_DEVID1;
+	hdr->signature[2] = XNVM_DEVID2;
+	hdr->signature_address = XNVM_DATA_BASE + NVM_MCU_CONTROL;
+	hdr->flash_size = XNVM_FLASH_SIZE;
+	hdr->page_size = PAGE_SIZE;
+	hdr->image_size = image_size;
+	hdr->end = ep.end;
+	hdr->stage_offset = offset;
+	hdr->stage_size = stage_size(st.hdr);
+	hdr->stage_crc = crc16_update(CRC16_INIT, st.ddr, hdr->stage_size);
+
+	crc = CRC16_INIT;
+	for (address = 0; address < ep.end; address += PAGE_SIZE) {
+		image_page(page, image, size, address);
+		crc = crc16_update(crc, page, PAGE_SIZE);
+	}
+	hdr->image_crc = crc;
+
+	/* a chip erase shows up in every section, it is done once */
+	for (s = 0; s < PLAN_SECTIONS; s++) {
+		hdr->erase[s] = ep.erase[s];
+		if (ep.erase[s] == PLAN_SECTION)
+			plan_add_op(hdr, PLAN_OP_ERASE, s);
+		else if (ep.erase[s] == PLAN_CHIP && s == 0)
+			plan_add_op(hdr, PLAN_OP_ERASE, AREA_CHIP);
+	}
+	plan_add_op(hdr, PLAN_OP_PROGRAM, 0);
+
+	hdr->npatches = npatches;
+	memcpy(hdr->patches, patches, npatches * sizeof(*patches));
+
+	free(copy);
+	offset += hdr->stage_size;
+	if (munmap(map, room) < 0 || ftruncate(fd, offset) < 0 ||
+	    close(fd) < 0) {
+		remove(path);
+		return -1;
+	}
+
+	return 0;
+
+err_unmap:
+	munmap(map, room);
+err_close:
+	close(fd);
+	remove(path);
+err_free:
+	free(copy);
+	return -1;
+}
+
+/**
+ * \brief Check that a mapped plan is complete and intact.
+ *
+ * Whether it suits the device is only known once its signature is read.
+ *
+ * \retval 0 the plan can be run, -1 with errno set to EINVAL otherwise.
+ */
+int plan_check(const struct plan_header *hdr, size_t size)
+{
+	const struct stage_header *stage;
+	const struct stage_page *map;
+	unsigned int i;
+
+	if (size < sizeof(*hdr) || hdr->magic != PLAN_MAGIC ||
+	    hdr->version != PLAN_VERSION || hdr->nops > PLAN_OPS_MAX ||
+	    hdr->page_size != PAGE_SIZE || hdr->end > hdr->flash_size ||
+	    hdr->stage_offset % PLAN_ALIGN ||
+	    hdr->stage_offset < sizeof(*hdr) ||
+	    hdr->stage_size < sizeof(*stage) ||
+	    hdr->stage_offset > size ||
+	    hdr->stage_size > size - hdr->stage_offset)
+		goto err;
+
+	for (i = 0; i < hdr->nops; i++) {
+		if (hdr->ops[i].type > PLAN_OP_PROGRAM ||
+		    (hdr->ops[i].type == PLAN_OP_ERASE &&
+		     hdr->ops[i].arg > AREA_CHIP))
+			goto err;
+	}
+
+	/* sizes come from the file, so compare without sums that wrap */
+	stage = plan_stage(hdr);
+	if (stage->magic != STAGE_MAGIC || stage->page_size != PAGE_SIZE ||
+	    stage->map_offset > hdr->stage_size ||
+	    stage->npages > (hdr->stage_size - stage->map_offset) /
+			    sizeof(*map))
+		goto err;
+
+	map = (const struct stage_page *)((const uint8_t *)stage +
+					  stage->map_offset);
+	for (i = 0; i < stage->npages; i++) {
+		if (!(map[i].flags & STAGE_PAGE_ERASE) &&
+		    (hdr->stage_size < PAGE_SIZE ||
+		     map[i].offset > hdr->stage_size - PAGE_SIZE))
+			goto err;
+	}
+
+	if (crc16_update(CRC16_INIT, (const uint8_t *)stage,
+			 hdr->stage_size) != hdr->stage_crc)
+		goto err;
+
+	if (plan_patches_check(hdr->patches, hdr->npatches) < 0 ||
+	    plan_patches_staged(hdr) < 0)
+		goto err;
+
+	return 0;
+
+err:
+	errno = EINVAL;
+	return -1;
+}
+
+/**
+ * \brief Stage of a plan, ready to be copied to DDR as it is.
+ */
+const struct stage_header *plan_stage(const struct plan_header *hdr)
+{
+	return (const struct stage_header *)((const uint8_t *)hdr +
+					     hdr->stage_offset);
+}
+
+const char *plan_op_name(enum plan_op_type type)
+{
+	return op_names[type];
+}
+
+const char *plan_patch_area_name(enum plan_patch_area area)
+{
+	return patch_area_names[area];
+}
+
+/**
+ * \brief Look up a patch slot by name.
+ *
+ * \retval index of the slot, or -1 if the plan has none by that name.
+ */
+int plan_patch_find(const struct plan_header *hdr, const char *name)
+{
+	unsigned int s;
+
+	for (s = 0; s < hdr->npatches; s++) {
+		if (!strncmp(hdr->patches[s].name, name,
+			     PLAN_PATCH_NAME_SIZE))
+			return s;
+	}
+
+	return -1;
+}
+
+/**
+ * \brief Bytes taken by the values of all the patch slots, back to back.
+ */
+uint32_t plan_patch_size(const struct plan_header *hdr)
+{
+	uint32_t size = 0;
+	unsigned int s;
+
+	for (s = 0; s < hdr->npatches; s++)
+		size += hdr->patches[s].length;
+
+	return size;
+}
+
+/**
+ * \brief PDI address of the first byte of a patch slot.
+ */
+uint32_t plan_patch_address(const struct plan_patch *patch)
+{
+	static const uint32_t base[] = {
+		[PLAN_PATCH_FLASH]	= XNVM_FLASH_BASE,
+		[PLAN_PATCH_EEPROM]	= XNVM_EEPROM_BASE,
+		[PLAN_PATCH_USER_SIGN]	= XNVM_SIGNATURE_BASE,
+	};
+
+	return base[patch->area] + patch->offset;
+}
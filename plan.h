@@ -0,0 +1,105 @@
+/**
+ * Precompiled programming plans.
+ *
+ * Copyright (C) 2015-2017 Toby Churchill Ltd.
+ *
+ * Enric Balletbo Serra <enric.balletbo@collabora.com>
+ *
+ * License
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+#ifndef PLAN_H_INCLUDED
+#define PLAN_H_INCLUDED
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "prog.h"
+#include "erase.h"
+
+#define PLAN_MAGIC		0x4e4c5050	/* "PPLN" */
+#define PLAN_VERSION		2
+
+/* The stage starts on a page boundary, its payloads stay page aligned */
+#define PLAN_ALIGN		256
+
+/* An erase per section at most, then the write */
+#define PLAN_OPS_MAX		(PLAN_SECTIONS + 1)
+
+enum plan_op_type {
+	PLAN_OP_ERASE,		/* CMD_ERASE, arg is an enum nvm_area */
+	PLAN_OP_PROGRAM,	/* CMD_PROGRAM_IMAGE with the plan stage */
+};
+
+struct plan_op {
+	uint16_t type;		/* enum plan_op_type */
+	uint16_t arg;
+};
+
+#define PLAN_PATCHES_MAX	8
+#define PLAN_PATCH_NAME_SIZE	16
+
+enum plan_patch_area {
+	PLAN_PATCH_FLASH,	/* in the stage, pages patched in DDR */
+	PLAN_PATCH_EEPROM,	/* CMD_WRITE_NVM, once the stage is written */
+	PLAN_PATCH_USER_SIGN,	/* CMD_WRITE_NVM, once the stage is written */
+};
+
+/**
+ * \brief A per-device slot: bytes that differ from one board to the next.
+ *
+ * The plan carries placeholder bytes in flash slots, so that the pages
+ * under them are always in the stage and erased ahead of the write; every
+ * run puts the bytes of the device over them.
+ */
+struct plan_patch {
+	char name[PLAN_PATCH_NAME_SIZE];	/* NUL terminated */
+	uint16_t area;				/* enum plan_patch_area */
+	uint16_t length;			/* up to SHM_DATA_MAX */
+	uint32_t offset;			/* in the area */
+};
+
+/**
+ * \brief On-disk header, at the start of the plan file.
+ *
+ * The stage is a struct stage_header with its page map and payloads, laid
+ * out exactly as CMD_PROGRAM_IMAGE reads it from DDR, so it is copied
+ * there as a whole. The page map holds the CRC-16 of every payload.
+ */
+struct plan_header {
+	uint32_t magic;
+	uint16_t version;
+	uint16_t nops;
+	uint8_t signature[4];		/* device the plan is for */
+	uint32_t signature_address;	/* where to read it, PDI address */
+	uint32_t flash_size;
+	uint32_t page_size;
+	uint32_t image_size;		/* bytes in the source image */
+	uint32_t end;			/* end of the flash the plan covers */
+	uint16_t image_crc;		/* CRC-16 of the flash up to end,
+					   placeholders in flash slots */
+	uint16_t stage_crc;		/* CRC-16 of the stage */
+	uint32_t stage_offset;		/* from the plan header */
+	uint32_t stage_size;
+	uint32_t erase[PLAN_SECTIONS];	/* enum plan_erase, as planned */
+	struct plan_op ops[PLAN_OPS_MAX];
+	uint32_t npatches;
+	struct plan_patch patches[PLAN_PATCHES_MAX];
+};
+
+int plan_compile(const char *path, const uint8_t *image, size_t size,
+		 int allow_chip, const struct plan_patch *patches,
+		 unsigned int npatches);
+int plan_check(const struct plan_header *hdr, size_t size);
+const struct stage_header *plan_stage(const struct plan_header *hdr);
+const char *plan_op_name(enum plan_op_type type);
+const char *plan_patch_area_name(enum plan_patch_area area);
+int plan_patch_find(const struct plan_header *hdr, const char *name);
+uint32_t plan_patch_size(const struct plan_header *hdr);
+uint32_t plan_patch_address(const struct plan_patch *patch);
+
+#endif
@@ -15,12 +15,368 @@
 #ifndef PROG_H_INCLUDED
 #define PROG_H_INCLUDED
 
+#include <stdint.h>
+
+#include "layout.h"
+
 #define CMD_ENTER_PROGMODE	0x10
 #define CMD_LEAVE_PROGMODE	0x11
 #define CMD_READ_SIGNATURE	0x12
 #define CMD_CHIP_ERASE		0x13
 #define CMD_PROGRAM_FLASH	0x14
 #define CMD_READ_FLASH		0x15
+#define CMD_READ_MEMORY		0x16
+#define CMD_PROGRAM_IMAGE	0x17
+#define CMD_SET_TIMEOUTS	0x18
+#define CMD_IDENTIFY		0x19
+#define CMD_ERASE		0x1A
+#define CMD_SECTION_CRC		0x1B
+#define CMD_PHY_INFO		0x1C
+#define CMD_PHY_SELECT		0x1D
+#define CMD_CALIBRATE		0x1E
+#define CMD_SEQUENCE		0x1F
+#define CMD_TRACE		0x20
+#define CMD_DETECT		0x21
+#define CMD_READ_DATA		0x22
+#define CMD_WRITE_DATA		0x23
+#define CMD_VERIFY_IMAGE	0x24
+#define CMD_WRITE_NVM		0x25
 
-#endif
+/*
+ * Shared RAM layout, in 32-bit words from LAYOUT_MAILBOX.
+ *
+ * The host fills in the arguments, writes the command word last and rings
+ * the doorbell, ARM_PRU0_INTERRUPT. The PRU waits on the doorbell in R31,
+ * reads the arguments once, then clears the command word and raises
+ * PRU0_ARM_INTERRUPT once it is done.
+ */
+#define PRU_DOORBELL_EVENT	21		/* ARM_PRU0_INTERRUPT */
+#define PRU_DOORBELL_R31	(1u << 30)	/* host interrupt 0, to PRU0 */
+
+#define SHM_CMD			0	/* command */
+#define SHM_ARG			1	/* argument (address, index) */
+#define SHM_RESULT		2	/* result value or enum status_code */
+#define SHM_LENGTH		3	/* transfer length in bytes */
+#define SHM_SLOT		4	/* data slot used by the transfer */
+#define SHM_DATA		5	/* start of the data area */
+
+/*
+ * CMD_READ_MEMORY packs the bytes read into one of two data slots, so the
+ * host can consume a slot while the PRU fills the other one.
+ * CMD_READ_FLASH and CMD_PROGRAM_FLASH move their flash page, packed the
+ * same way, through slot 0.
+ */
+#define SHM_SLOT_SIZE		256	/* bytes */
+#define SHM_SLOT_NUM		2
+#define SHM_SLOT_OFFSET(n)	(SHM_DATA + (n) * (SHM_SLOT_SIZE / 4))
+
+/*
+ * CMD_READ_DATA and CMD_WRITE_DATA move SHM_LENGTH bytes between the data
+ * space of the target (SRAM, I/O registers), from address SHM_ARG on, and
+ * the data slots, from slot SHM_SLOT on: a range may run on into the next
+ * slot. Either is a single pointer set and REPEAT burst on the wire. Both
+ * need an open PDI session.
+ *
+ * CMD_WRITE_NVM takes the same arguments, SHM_ARG a PDI address in the
+ * EEPROM or in the user signature row, the range within one of them. The
+ * bytes around the range are kept.
+ */
+#define SHM_DATA_MAX		(SHM_SLOT_NUM * SHM_SLOT_SIZE)
+#define DATA_SPACE_SIZE		0x10000
+
+/*
+ * Counters the PRU keeps from the moment it starts, copied to SHM_METRICS
+ * after every command, before the completion is raised. They wrap at 2^32,
+ * the host diffs them around each command. They follow the data slots,
+ * the data of no command may reach past those.
+ */
+#define SHM_METRICS		SHM_SLOT_OFFSET(SHM_SLOT_NUM)
+
+struct pdi_metrics {
+	uint32_t commands;		/* commands completed */
+	uint32_t command_cycles;	/* PRU cycles spent running them */
+	uint32_t tx_frames;		/* PDI bytes sent */
+	uint32_t rx_frames;		/* PDI bytes received */
+	uint32_t frame_errors;		/* parity or stop bit errors */
+	uint32_t rx_timeouts;		/* no start bit within the budget */
+	uint32_t retries;		/* instruction groups sent again */
+	uint32_t busy_polls;		/* NVM controller status reads */
+	uint32_t busy_cycles;		/* PRU cycles waiting for the NVM */
+	uint32_t pages_written;		/* flash pages written */
+	uint32_t pages_erased;		/* flash pages erased on their own */
+	uint32_t keepalives;		/* idle clock bursts between commands */
+};
+
+/*
+ * The host sets SHM_ABORT, and clears it with every new command, to have
+ * the running command stop early and return ERR_FLUSHED: CMD_PROGRAM_IMAGE
+ * once the page in flight is done, CMD_DETECT before its next probe.
+ * The other commands run to the end.
+ */
+#define SHM_ABORT		(SHM_METRICS + sizeof(struct pdi_metrics) / 4)
+
+#define SHM_END			(SHM_ABORT + 1)
+
+/*
+ * CMD_SET_TIMEOUTS takes a struct xnvm_timeouts at SHM_DATA, in
+ * microseconds. Zero fields keep their current value, the values in force
+ * are written back on return.
+ */
+#define SHM_TIMEOUTS_NUM	4
+
+/*
+ * CMD_SET_TIMEOUTS also starts every job, its SHM_ARG selects the channels
+ * the job drives: bit n for channel n, zero for channel 0 alone. Refused
+ * with ERR_BUSY while a PDI session is open, the timeouts left as they
+ * were.
+ *
+ * A channel is a target on PDI_DATA lines of its own. All of them share
+ * PDI_CLK, so every target sees the clock run while another is talked to
+ * and none drops out of its session. CMD_ENTER_PROGMODE, CMD_LEAVE_PROGMODE,
+ * CMD_CHIP_ERASE, CMD_ERASE and CMD_PROGRAM_IMAGE run on each channel, the
+ * pages of CMD_PROGRAM_IMAGE interleaved: a target loads its next page
+ * while the others are busy writing theirs. CMD_READ_MEMORY reads channel
+ * n into slot n, whatever SHM_SLOT says. The other target commands are
+ * refused with ERR_INVALID_ARG if more than one channel is selected. Only
+ * the bit-bang PHY drives channels other than 0.
+ */
+#define PDI_CHANNELS		2
+#define PDI_CHANNELS_ALL	((1u << PDI_CHANNELS) - 1)
+
+/*
+ * CMD_IDENTIFY fills in a struct devinfo at SHM_DATA, all of it read with
+ * REPEAT bursts in one PDI session. The session is opened and closed around
+ * the reads unless CMD_ENTER_PROGMODE already opened one.
+ */
+#define DEVINFO_FUSES		6	/* FUSEBYTE0 to FUSEBYTE5 */
+#define DEVINFO_CALIBRATION	64	/* production signature row */
+#define DEVINFO_USER_SIGN	256	/* user signature row */
+
+struct devinfo {
+	uint8_t signature[3];	/* MCU DEVID0 to DEVID2 */
+	uint8_t revision;	/* MCU REVID */
+	uint8_t fuses[DEVINFO_FUSES];
+	uint8_t lockbits;
+	uint8_t reserved;
+	uint8_t calibration[DEVINFO_CALIBRATION];
+	uint8_t user_sign[DEVINFO_USER_SIGN];
+};
+
+/*
+ * CMD_ERASE erases the area SHM_ARG selects. CMD_SECTION_CRC computes the
+ * NVM CRC of the flash section SHM_ARG selects and returns it in
+ * SHM_LENGTH. Both need an open PDI session.
+ */
+enum nvm_area {
+	AREA_APP,		/* application section */
+	AREA_BOOT,		/* boot loader section */
+	AREA_EEPROM,
+	AREA_CHIP,		/* flash and EEPROM, CMD_ERASE only */
+};
+
+#define PRU_CLOCK_HZ		200000000
+
+/*
+ * CMD_PHY_SELECT switches to the PHY backend SHM_ARG selects, at its
+ * default clock, and fills in a struct phy_info like CMD_PHY_INFO. It is
+ * refused with ERR_BUSY while a PDI session is open.
+ */
+enum phy_backend {
+	PHY_BITBANG,		/* cycle exact CPU loops, any pins */
+	PHY_SHIFT,		/* GP port serial shift modes, fixed pins */
+};
+
+/*
+ * CMD_PHY_INFO sets the PDI_CLK half period to SHM_ARG PRU cycles, unless
+ * it is zero, and fills in a struct phy_info at SHM_DATA. Every count is
+ * exact: the bit-bang PHY runs a fixed number of cycles per clock phase,
+ * the shift PHY is clocked by a divider.
+ */
+struct phy_info {
+	uint32_t backend;		/* enum phy_backend */
+	uint32_t cpu_hz;		/* PRU cycles per second */
+	uint32_t half_cycles;		/* each clock phase, low and high */
+	uint32_t min_half_cycles;
+	uint32_t max_half_cycles;
+	uint32_t fixed_cycles;		/* CPU bit handling within a phase */
+	uint32_t frame_cycles;		/* one 12-bit frame */
+	uint32_t break_cycles;		/* double BREAK and 2 idle bits */
+	uint32_t hunt_clocks;		/* start bit hunt between time checks */
+	uint32_t sample;		/* input sampling point in use */
+	uint32_t sample_cycles;		/* its delay after the rising edge */
+	uint32_t max_sample;		/* at this clock */
+};
 
+/*
+ * CMD_CALIBRATE sweeps the point where the PHY samples PDI_DATA, from
+ * right after the rising edge of PDI_CLK on, reading the device signature
+ * SHM_LENGTH times at each point. SHM_ARG holds the expected signature,
+ * DEVID0 in bits 0-7, or zero to trust a first read at the current point.
+ * The middle of the widest run of points where every read matched is kept,
+ * until the clock or backend changes; with no such run the point is left
+ * alone and ERR_BAD_DATA returned. The sweep comes back as a struct
+ * phy_calibration at SHM_DATA. Needs an open PDI session.
+ */
+#define CALIB_POINTS_MAX	64
+
+struct phy_calibration {
+	uint32_t points;			/* sample points swept */
+	uint32_t reads;				/* reads at each point */
+	uint32_t first;				/* pass window, */
+	uint32_t last;				/* first > last if none */
+	uint32_t sample;			/* point in use now */
+	uint16_t cycles[CALIB_POINTS_MAX];	/* after the rising edge */
+	uint16_t pass[CALIB_POINTS_MAX];	/* reads that matched */
+};
+
+/*
+ * Image staged in DDR (the prussdrv external RAM) for CMD_PROGRAM_IMAGE.
+ *
+ * SHM_ARG holds the physical address of the stage header. The page map and
+ * the page payloads follow, at the offsets given in the header. Programming
+ * starts at page SHM_LENGTH of the map and covers SHM_SLOT pages, or the
+ * rest of the map if zero. On return SHM_LENGTH holds the index of the
+ * first page not programmed, the map size once all of it is.
+ *
+ * Pages are erased and written unless their flags say otherwise.
+ */
+#define STAGE_MAGIC		0x47545350	/* "PSTG" */
+
+#define STAGE_PAGE_WRITE	0x0001	/* page is erased, write only */
+#define STAGE_PAGE_ERASE	0x0002	/* erase only, the page has no payload */
+
+struct stage_page {
+	uint32_t address;	/* flash offset of the page */
+	uint32_t offset;	/* payload offset from the stage header */
+	uint16_t crc;		/* CRC-16 of the payload */
+	uint16_t flags;
+};
+
+struct stage_header {
+	uint32_t magic;
+	uint32_t page_size;
+	uint32_t npages;
+	uint32_t map_offset;	/* page map offset from the stage header */
+};
+
+/*
+ * CMD_VERIFY_IMAGE reads back the pages of an image staged like for
+ * CMD_PROGRAM_IMAGE and compares them with it on the PRU, erase only pages
+ * with 0xFF. SHM_ARG holds the stage address, verifying starts at page
+ * SHM_LENGTH of the map and covers up to VERIFY_PAGES_MAX pages. On return
+ * SHM_LENGTH holds the index of the first page not verified, and a struct
+ * verify_result at SHM_DATA the verdict: bit n of the bitmap, and first[n],
+ * are for page SHM_LENGTH + n of the map as it was on entry. Pages that
+ * differ are no error. Needs an open PDI session.
+ */
+#define VERIFY_PAGES_MAX	128
+
+struct verify_result {
+	uint32_t pages;				/* compared */
+	uint32_t failed;			/* that differ */
+	uint32_t bitmap[VERIFY_PAGES_MAX / 32];	/* set if page differs */
+	uint16_t first[VERIFY_PAGES_MAX];	/* its first differing byte */
+};
+
+/*
+ * CMD_SEQUENCE replays a PDI bit sequence compiled on the host, see
+ * bitstream.c. SHM_ARG holds its physical address in DDR, SHM_LENGTH its
+ * length in words, and on return the words of the operations that
+ * completed. The PDI session must already be open. Not on the shift PHY,
+ * which pads every transmit to whole words with idle bits and so cannot
+ * send the bits of a frame in two parts: ERR_UNSUPPORTED_DEV.
+ *
+ * A sequence is a list of operations, each an operation word and the words
+ * that follow it. Transmitted bits are sent as they are, LSB of the first
+ * word first: frames, BREAKs and idle bits are all encoded by the host.
+ * Check words hold a mask in bits 15:8 and the expected value in bits 7:0
+ * for each response byte, two bytes to a word, low half first.
+ */
+#define SEQ_OP(word)		((word) >> 28)
+#define SEQ_BITS(word)		((word) & 0xFFFF)
+
+/* [27:16] frames, [15:0] bits, then the bit words */
+#define SEQ_TX			0x1
+#define SEQ_TX_FRAMES(word)	((word) >> 16 & 0xFFF)
+#define SEQ_TX_FRAMES_MAX	0xFFF
+
+/* [15:0] response bytes, then their check words */
+#define SEQ_RX			0x2
+
+/*
+ * [27:24] time budget, the index of a CMD_SET_TIMEOUTS field, [23:16]
+ * frames, [15:0] bits of a request, then the request words and one check
+ * word. The request is sent and a byte read back until it passes.
+ */
+#define SEQ_POLL		0x3
+#define SEQ_POLL_BUDGET(word)	((word) >> 24 & 0xF)
+#define SEQ_POLL_FRAMES(word)	((word) >> 16 & 0xFF)
+
+#define SEQ_BUDGET_BYTE		0	/* struct xnvm_timeouts fields */
+#define SEQ_BUDGET_NVMEN	1
+#define SEQ_BUDGET_BUSY		2
+#define SEQ_BUDGET_ERASE	3
+
+/* [0] set for a page erased, clear for a page written */
+#define SEQ_PAGE		0x4
+#define SEQ_PAGE_ERASED		0x1
+
+#define SEQ_WORD(op, arg)	((uint32_t)(op) << 28 | (arg))
+#define SEQ_CHECK(expect, mask)	((uint32_t)(mask) << 8 | (expect))
+
+/*
+ * CMD_DETECT waits for a target to be connected, SHM_ARG non zero, or
+ * disconnected, SHM_ARG zero. Every SHM_LENGTH ms, DETECT_PERIOD_MS if
+ * zero and at most DETECT_WINDOW_MS, it enables the PDI, reads the PDI
+ * STATUS register and disables the PDI again; a target answers the read.
+ * The enable sequence resets the target. With several channels all of
+ * them must answer, or none. DETECT_GONE_PROBES probes in a row must go
+ * unanswered, so a contact that bounces does not count as the board being
+ * removed. It gives up with ERR_TIMEOUT after DETECT_WINDOW_MS, for the
+ * host to ask again or stop, and is refused with ERR_BUSY while a PDI
+ * session is open.
+ */
+#define DETECT_PERIOD_MS	20
+#define DETECT_GONE_PROBES	3
+#define DETECT_WINDOW_MS	500
+
+/*
+ * CMD_TRACE starts recording the bus into the ring at LAYOUT_TRACE if
+ * SHM_ARG is non zero, from an empty ring, and stops it otherwise.
+ *
+ * Every frame group sent, byte received, error and BREAK is an event,
+ * stamped with the cycle counter when it is over. A group of frames sent
+ * by pdi_write() is a single event: its length and the CRC-16 of its bytes.
+ * head counts the events written so far, event n is at n % TRACE_EVENTS.
+ * The PRU never waits for the host, events it overwrites are lost.
+ */
+enum trace_type {
+	TRACE_CMD = 1,		/* command started, data is the command */
+	TRACE_END,		/* command done, data is its status */
+	TRACE_ENABLE,		/* pdi_init() */
+	TRACE_DISABLE,		/* pdi_deinit() */
+	TRACE_TX,		/* data + 1 frames sent, arg is their CRC-16 */
+	TRACE_BITS,		/* arg bits sent as the host encoded them */
+	TRACE_BREAK,		/* double BREAK */
+	TRACE_RX,		/* data received */
+	TRACE_RX_ERROR,		/* parity or stop bit error, frame in data/arg */
+	TRACE_RX_TIMEOUT,	/* no start bit within the budget */
+	TRACE_CHANNEL,		/* data is the channel talked to from now on */
+};
+
+struct trace_event {
+	uint32_t cycles;
+	uint8_t type;		/* enum trace_type */
+	uint8_t data;
+	uint16_t arg;
+};
+
+#define TRACE_EVENTS	((LAYOUT_TRACE_SIZE - 16) / sizeof(struct trace_event))
+
+struct trace_ring {
+	uint32_t head;
+	uint32_t reserved[3];
+	struct trace_event events[TRACE_EVENTS];
+};
+
+#endif
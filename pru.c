@@ -18,7 +18,11 @@
 
 #include "xmega_pdi_nvm.h"
 #include "low_level_pdi.h"
+#include "pdi_phy.h"
 #include "prog.h"
+#include "layout.h"
+#include "timer.h"
+#include "sequencer.h"
 
 #include "atxmega16d4_nvm_regs.h"
 
@@ -34,21 +38,436 @@
 #define SYSCFG	0x26004
 #define GPCFG0	0x26008
 
+/*
+ * AM335x PRU-ICSS Reference Guide (Rev. A), p. 227
+ *
+ * System Interrupt Status Indexed Clear Register of the PRU-ICSS INTC.
+ */
+#define INTC_SICR	0x20024
+
 volatile register uint32_t __R31;
 
-#define BUFSIZE	256
+#define BUFSIZE	XNVM_FLASH_PAGE_SIZE
 #define half(x)	((x)/2)
 
+#if BUFSIZE != LAYOUT_PAGE_SIZE
+#error "flash pages do not fit the LAYOUT_PAGES buffers"
+#endif
+
+#if BUFSIZE > SHM_SLOT_SIZE
+#error "a CMD_READ_FLASH page would run into SHM_METRICS"
+#endif
+
+#if PDI_CHANNELS > 2 || PDI_CHANNELS > SHM_SLOT_NUM
+#error "a channel has no page buffer or no CMD_READ_MEMORY slot"
+#endif
+
+/*
+ * Ping-pong page buffers for images staged in DDR, and the page buffer of
+ * CMD_READ_FLASH and CMD_PROGRAM_FLASH, in PRU1 data RAM.
+ */
+#pragma DATA_SECTION(stage_buffer, ".pdi_pages")
+static uint8_t stage_buffer[2][BUFSIZE];
+#pragma DATA_SECTION(page_buffer, ".pdi_pages")
+static uint8_t page_buffer[BUFSIZE];
+
+/*
+ * The command block, at the start of shared RAM. See table 4.7 Local
+ * Memory Map in page 204 of manual. It is sized to the words prog.h lays
+ * out, the linker refuses it if they outgrow LAYOUT_MAILBOX_SIZE.
+ */
+#pragma DATA_SECTION(shared_ram, ".pdi_mailbox")
+static volatile uint32_t shared_ram[SHM_END];
+
+/**
+ * \brief Check whether the host wants the running command to stop early.
+ */
+static bool aborted(void)
+{
+	return shared_ram[SHM_ABORT] != 0;
+}
+
+/**
+ * \brief A target being programmed by program_channels().
+ */
+struct channel {
+	uint32_t next;		/* pages done, and the one in flight */
+	bool busy;		/* page next is being erased or written */
+	struct deadline dl;	/* of page next */
+	uint8_t *buf;		/* its payload */
+};
+
+/**
+ * \brief Move one channel of program_channels() forward, if it can.
+ *
+ * Completes the page in flight, unless the target is still busy with it,
+ * then starts the next one before end. Starting a page is where the PDI
+ * time goes: its payload is loaded into the target page buffer.
+ *
+ * \retval STATUS_OK the channel moved on.
+ * \retval ERR_BUSY the target is still busy, nothing was done.
+ */
+static enum status_code channel_step(const struct stage_header *stage,
+				     const struct stage_page *map,
+				     struct channel *ch, uint32_t end)
+{
+	const struct stage_page *page;
+	enum status_code ret;
+
+	if (ch->busy) {
+		ret = xnvm_poll_flash_page(&ch->dl);
+		if (ret)
+			return ret;
+
+		if (map[ch->next].flags & STAGE_PAGE_ERASE)
+			pdi_metrics.pages_erased++;
+		else
+			pdi_metrics.pages_written++;
+		ch->busy = false;
+		ch->next++;
+	}
+
+	if (ch->next >= end)
+		return STATUS_OK;
+
+	page = &map[ch->next];
+	if (page->flags & STAGE_PAGE_ERASE) {
+		ret = xnvm_start_erase_flash_page(page->address);
+	} else {
+		ret = xnvm_stage_fetch(stage, page, ch->buf);
+		if (ret)
+			return ret;
+
+		if (page->flags & STAGE_PAGE_WRITE)
+			ret = xnvm_start_program_flash_page(page->address,
+							    ch->buf, BUFSIZE);
+		else
+			ret = xnvm_start_erase_program_flash_page(page->address,
+								  ch->buf,
+								  BUFSIZE);
+	}
+	if (ret)
+		return ret;
+
+	deadline_set(&ch->dl, xnvm_timeouts.busy_us);
+	ch->busy = true;
+
+	return STATUS_OK;
+}
+
+/**
+ * \brief Program an image staged in DDR into every channel in mask.
+ *
+ * A cooperative round robin over the channels: each one loads and starts
+ * its next page as soon as its target is done with the previous one, and
+ * is otherwise left alone. The targets write their pages while the PDI
+ * time goes to the others, so a few boards take little longer than one.
+ * The first failure stops them all. If the host aborts, the pages in
+ * flight are completed and no other is started.
+ *
+ * \param stage the stage header.
+ * \param mask the channels, bit n for channel n.
+ * \param first, count the pages to program, as for xnvm_program_stage().
+ * \param done index of the first page not every channel programmed.
+ */
+static enum status_code program_channels(const struct stage_header *stage,
+					 uint32_t mask, uint32_t first,
+					 uint32_t count, uint32_t *done)
+{
+	struct channel ch[PDI_CHANNELS];
+	const struct stage_page *map;
+	enum status_code ret = STATUS_OK;
+	uint32_t c, end, active = mask;
+	bool stop = false;
+
+	*done = first;
+
+	if (stage->magic != STAGE_MAGIC || stage->page_size != BUFSIZE)
+		return ERR_BAD_FORMAT;
+
+	if (first > stage->npages)
+		return ERR_INVALID_ARG;
+
+	end = xnvm_stage_end(stage, first, count);
+	map = (const struct stage_page *)((const uint8_t *)stage +
+					  stage->map_offset);
+
+	for (c = 0; c < PDI_CHANNELS; c++) {
+		ch[c].next = first;
+		ch[c].busy = false;
+		ch[c].buf = stage_buffer[c];
+	}
+
+	while (active && ret == STATUS_OK) {
+		/* no new page once the host aborts, the busy ones complete */
+		if (!stop && aborted()) {
+			stop = true;
+			end = 0;
+		}
+
+		for (c = 0; c < PDI_CHANNELS && ret == STATUS_OK; c++) {
+			if (!(active & 1 << c))
+				continue;
+
+			pdi_select_channel(c);
+			ret = channel_step(stage, map, &ch[c], end);
+			if (ret == ERR_BUSY)
+				ret = STATUS_OK;
+			else if (ret == STATUS_OK && !ch[c].busy)
+				active &= ~(1 << c);
+		}
+	}
+
+	*done = stage->npages;
+	for (c = 0; c < PDI_CHANNELS; c++) {
+		if ((mask & 1 << c) && ch[c].next < *done)
+			*done = ch[c].next;
+	}
+
+	if (ret == STATUS_OK && stop)
+		ret = ERR_FLUSHED;
+
+	return ret;
+}
+
+/**
+ * \brief Run an NVM operation on each channel in mask, in turn.
+ *
+ * \retval STATUS_OK it worked on every channel.
+ * \retval other the status of the first channel it failed on, the
+ * channels after it were left alone.
+ */
+static enum status_code each_channel(uint32_t mask,
+				     enum status_code (*op)(void))
+{
+	enum status_code ret = STATUS_OK;
+	uint32_t c;
+
+	for (c = 0; c < PDI_CHANNELS && ret == STATUS_OK; c++) {
+		if (mask & 1 << c) {
+			pdi_select_channel(c);
+			ret = op();
+		}
+	}
+
+	return ret;
+}
+
+/**
+ * \brief Wait for the targets of the job to be connected, or removed.
+ *
+ * See CMD_DETECT. The PDI is only enabled for the probes, in between the
+ * targets run, or sit in reset if there are none.
+ *
+ * \param present wait for every target to answer, or for none to.
+ * \param period_ms time from one probe to the next.
+ *
+ * \retval STATUS_OK the targets are there, or gone.
+ * \retval ERR_TIMEOUT no change within DETECT_WINDOW_MS.
+ */
+static enum status_code detect(bool present, uint32_t mask, uint32_t period_ms)
+{
+	struct deadline window, next;
+	uint32_t c, found, gone = 0;
+
+	deadline_set(&window, DETECT_WINDOW_MS * 1000);
+
+	for (;;) {
+		deadline_set(&next, period_ms * 1000);
+
+		pdi_init();
+		found = 0;
+		for (c = 0; c < PDI_CHANNELS; c++) {
+			if (!(mask & 1 << c))
+				continue;
+			pdi_select_channel(c);
+			if (xnvm_probe() == STATUS_OK)
+				found |= 1 << c;
+		}
+		pdi_deinit();
+
+		gone = found ? 0 : gone + 1;
+		if (present ? found == mask : gone >= DETECT_GONE_PROBES)
+			return STATUS_OK;
+
+		if (deadline_expired(&window))
+			return ERR_TIMEOUT;
+
+		while (!deadline_expired(&next))
+			if (aborted())
+				return ERR_FLUSHED;
+	}
+}
+
+/**
+ * \brief Check whether a command runs on every channel of the job.
+ *
+ * The others talk to a single target, or to none.
+ */
+static bool channel_command(uint32_t cmd)
+{
+	switch (cmd) {
+	case CMD_ENTER_PROGMODE:
+	case CMD_LEAVE_PROGMODE:
+	case CMD_CHIP_ERASE:
+	case CMD_ERASE:
+	case CMD_PROGRAM_IMAGE:
+	case CMD_READ_MEMORY:
+	case CMD_DETECT:
+	/* no target involved */
+	case CMD_SET_TIMEOUTS:
+	case CMD_PHY_INFO:
+	case CMD_PHY_SELECT:
+	case CMD_TRACE:
+		return true;
+	default:
+		return false;
+	}
+}
+
+/**
+ * \brief Read the device information block in one PDI session.
+ *
+ * Every field is a single REPEAT burst, so the whole block costs five
+ * transfers. A session is opened, and closed again, only if the host has
+ * not opened one already.
+ */
+static enum status_code identify(struct devinfo *info, bool session)
+{
+	enum status_code ret = STATUS_OK;
+
+	if (!session) {
+		ret = xnvm_init();
+		if (ret != STATUS_OK)
+			goto out;
+	}
+
+	/* DEVID0-2 and REVID are contiguous in the MCU control block */
+	if (xnvm_read_memory(XNVM_DATA_BASE + NVM_MCU_CONTROL,
+			     info->signature, 4) == 0 ||
+	    xnvm_read_memory(XNVM_FUSE_BASE, info->fuses,
+			     DEVINFO_FUSES) == 0 ||
+	    xnvm_read_memory(XNVM_FUSE_BASE + NVM_LOCKBIT_ADDR,
+			     &info->lockbits, 1) == 0 ||
+	    xnvm_read_memory(XNVM_CALIBRATION_BASE, info->calibration,
+			     DEVINFO_CALIBRATION) == 0 ||
+	    xnvm_read_memory(XNVM_SIGNATURE_BASE, info->user_sign,
+			     DEVINFO_USER_SIGN) == 0)
+		ret = ERR_TIMEOUT;
+	info->reserved = 0;
+
+out:
+	if (!session) {
+		xnvm_pull_dev_out_of_reset();
+		pdi_deinit();
+	}
+
+	return ret;
+}
+
+/**
+ * \brief Describe the PHY timing for the host.
+ */
+static void phy_info(struct phy_info *info)
+{
+	uint32_t half = pdi_phy_ops->half_cycles();
+
+	info->backend = pdi_phy_ops == &pdi_phy_shift ? PHY_SHIFT : PHY_BITBANG;
+	info->cpu_hz = PRU_CLOCK_HZ;
+	info->half_cycles = half;
+	info->min_half_cycles = pdi_phy_ops->min_half_cycles;
+	info->max_half_cycles = pdi_phy_ops->max_half_cycles;
+	info->fixed_cycles = pdi_phy_ops->fixed_cycles;
+	info->frame_cycles = PHY_FRAME_BITS * 2 * half;
+	info->break_cycles = (2 * PHY_FRAME_BITS + 2) * 2 * half;
+	info->hunt_clocks = PHY_HUNT_CLOCKS;
+	info->sample = pdi_phy.sample;
+	info->sample_cycles = pdi_phy_ops->sample_cycles(pdi_phy.sample);
+	info->max_sample = pdi_phy_ops->max_sample();
+}
+
+/**
+ * \brief Read the signature at every sampling point and keep the best one.
+ *
+ * Reads are not retried, every bad one counts. The kept point is the
+ * middle of the widest run of points where every read matched.
+ *
+ * \param expected the signature, DEVID0 in bits 0-7, or 0 to read it first.
+ * \param reads reads at each point.
+ *
+ * \retval STATUS_OK the point in the middle of the pass window is in use.
+ * \retval ERR_BAD_DATA no point passed, the sampling point is unchanged.
+ */
+static enum status_code calibrate(struct phy_calibration *cal,
+				  uint32_t expected, uint32_t reads)
+{
+	uint32_t s, i, max, run = 0, old = pdi_phy.sample;
+	uint8_t sig[3];
+
+	if (reads == 0 || reads > 0xFFFF)
+		return ERR_INVALID_ARG;
+
+	if (!expected) {
+		if (xnvm_read_memory(XNVM_DATA_BASE + NVM_MCU_CONTROL, sig, 3) == 0)
+			return ERR_TIMEOUT;
+		expected = sig[0] | sig[1] << 8 | (uint32_t)sig[2] << 16;
+	}
+
+	max = pdi_phy_ops->max_sample();
+	if (max >= CALIB_POINTS_MAX)
+		max = CALIB_POINTS_MAX - 1;
+
+	cal->points = max + 1;
+	cal->reads = reads;
+	cal->first = 1;
+	cal->last = 0;
+
+	for (s = 0; s <= max; s++) {
+		pdi_phy_ops->set_sample(s);
+		cal->cycles[s] = pdi_phy_ops->sample_cycles(s);
+		cal->pass[s] = 0;
+
+		for (i = 0; i < reads; i++) {
+			if (xnvm_probe_memory(XNVM_DATA_BASE + NVM_MCU_CONTROL,
+					      sig, 3) == 3 &&
+			    (sig[0] | sig[1] << 8 | (uint32_t)sig[2] << 16) ==
+			    expected)
+				cal->pass[s]++;
+		}
+
+		if (cal->pass[s] != reads)
+			continue;
+
+		/* s ends a run of passing points, keep the widest */
+		if (s == 0 || cal->pass[s - 1] != reads)
+			run = s;
+		if (cal->first > cal->last ||
+		    s - run > cal->last - cal->first) {
+			cal->first = run;
+			cal->last = s;
+		}
+	}
+
+	if (cal->first > cal->last) {
+		pdi_phy_ops->set_sample(old);
+		cal->sample = old;
+		return ERR_BAD_DATA;
+	}
+
+	cal->sample = (cal->first + cal->last) / 2;
+	pdi_phy_ops->set_sample(cal->sample);
+
+	return STATUS_OK;
+}
+
 int main(int argc, const char *argv[]) {
 	int i;
-	uint8_t page_buffer[BUFSIZE], dev_id[3];
+	static uint8_t dev_id[3];
 	unsigned int finish = 0;
-
-	/*
-	 * Shared ram is at address 0x10000.
-	 * See table 4.7 Local Memory Map in page 204 of manual
-	 */
-	volatile uint32_t* shared_ram = (uint32_t *)0x10000;
+	uint32_t cmd, arg, length, slot, *timeouts, start, c, idle = 0;
+	uint8_t *data;
+	uint32_t channels = 1;		/* of the job, see PDI_CHANNELS */
+	bool session = false;
 
 	/*
 	 * Enable OCP so we can access the whole memory map for the
@@ -61,65 +480,312 @@ int main(int argc, const char *argv[]) {
 	 */
 	HWREG(GPCFG0) = 0;
 
+	/* Time budgets are measured with the cycle counter */
+	timer_init();
+	memcpy((void *)&shared_ram[SHM_METRICS], &pdi_metrics,
+	       sizeof(pdi_metrics));
+
 	while (!finish) {
 		/*
 		 * Wait until an interrupt request to this PRU happens.
 		 * If bit 30 of register 31 is set. That means someone sent 
-		 * an interrupt request to this PRU.
+		 * an interrupt request to this PRU. Only R31 is read while
+		 * waiting, shared RAM is left to the host. An open session
+		 * is kept alive meanwhile, until CMD_LEAVE_PROGMODE.
 		 */
-		if (shared_ram[0] == 0)
+		if (!(__R31 & PRU_DOORBELL_R31)) {
+			if (session && timer_cycles() - idle >=
+			    PDI_KEEPALIVE_US * TIMER_CYCLES_PER_US) {
+				pdi_keepalive();
+				idle = timer_cycles();
+			}
+			continue;
+		}
+		HWREG(INTC_SICR) = PRU_DOORBELL_EVENT;
+
+		/* The descriptor is read once, results go back as they come */
+		cmd = shared_ram[SHM_CMD];
+		arg = shared_ram[SHM_ARG];
+		length = shared_ram[SHM_LENGTH];
+		slot = shared_ram[SHM_SLOT];
+		if (cmd == 0)
 			continue;
 
-		switch (shared_ram[0]) {
+		start = timer_cycles();
+		pdi_trace(TRACE_CMD, cmd, 0);
+
+		/* Commands that cannot run on several targets at once */
+		if ((channels & (channels - 1)) && !channel_command(cmd)) {
+			shared_ram[SHM_RESULT] = ERR_INVALID_ARG;
+			goto done;
+		}
+
+		switch (cmd) {
+		case CMD_ENTER_PROGMODE:
+			/* Initialize the PDI interface, of every channel */
+			pdi_init();
+			shared_ram[SHM_RESULT] = each_channel(channels,
+							      xnvm_attach);
+			session = shared_ram[SHM_RESULT] == STATUS_OK;
+			break;
+		case CMD_LEAVE_PROGMODE:
+			/* every target is let go, whatever the others say */
+			shared_ram[SHM_RESULT] = STATUS_OK;
+			for (c = 0; c < PDI_CHANNELS; c++) {
+				if (!(channels & 1 << c))
+					continue;
+				pdi_select_channel(c);
+				if (xnvm_pull_dev_out_of_reset() != STATUS_OK)
+					shared_ram[SHM_RESULT] = ERR_IO_ERROR;
+			}
+			pdi_deinit();
+			session = false;
+			break;
+		case CMD_IDENTIFY:
+			shared_ram[SHM_RESULT] = identify(
+				(struct devinfo *)&shared_ram[SHM_DATA], session);
+			break;
 		case CMD_READ_SIGNATURE:
-			if (shared_ram[1] == 0) {
+			if (arg == 0) {
 				/* Initialize the PDI interface */
 				xnvm_init();
 				/* Read device ID */
 				xnvm_read_memory(XNVM_DATA_BASE + NVM_MCU_CONTROL, dev_id, 3);
 				shared_ram[2] = dev_id[0];
-			} else if (shared_ram[1] == 1) {
+			} else if (arg == 1) {
 				shared_ram[2] = dev_id[1];
-			} else if (shared_ram[1] == 2) {
+			} else if (arg == 2) {
 				shared_ram[2] = dev_id[2];
 			}
 			break;
 		case CMD_CHIP_ERASE:
-			xnvm_chip_erase();
+			shared_ram[SHM_RESULT] = each_channel(channels,
+							      xnvm_chip_erase);
+			break;
+		case CMD_ERASE:
+			switch (arg) {
+			case AREA_APP:
+				shared_ram[SHM_RESULT] = each_channel(channels,
+					xnvm_erase_app_section);
+				break;
+			case AREA_BOOT:
+				shared_ram[SHM_RESULT] = each_channel(channels,
+					xnvm_erase_boot_section);
+				break;
+			case AREA_EEPROM:
+				shared_ram[SHM_RESULT] = each_channel(channels,
+					xnvm_erase_eeprom);
+				break;
+			case AREA_CHIP:
+				shared_ram[SHM_RESULT] = each_channel(channels,
+					xnvm_chip_erase);
+				break;
+			default:
+				shared_ram[SHM_RESULT] = ERR_INVALID_ARG;
+				break;
+			}
+			break;
+		case CMD_SECTION_CRC:
+			if (arg != AREA_APP && arg != AREA_BOOT) {
+				shared_ram[SHM_RESULT] = ERR_INVALID_ARG;
+				break;
+			}
+			shared_ram[SHM_RESULT] = xnvm_section_crc(
+				arg == AREA_BOOT,
+				(uint32_t *)&shared_ram[SHM_LENGTH]);
+			break;
+		case CMD_PHY_INFO:
+			shared_ram[SHM_RESULT] = STATUS_OK;
+			if (arg)
+				shared_ram[SHM_RESULT] = pdi_set_clock(arg);
+			phy_info((struct phy_info *)&shared_ram[SHM_DATA]);
+			break;
+		case CMD_PHY_SELECT:
+			shared_ram[SHM_RESULT] = ERR_BUSY;
+			if (!session)
+				shared_ram[SHM_RESULT] =
+					pdi_phy_select(arg);
+			phy_info((struct phy_info *)&shared_ram[SHM_DATA]);
+			break;
+		case CMD_CALIBRATE:
+			/* The PDI session must already be open */
+			shared_ram[SHM_RESULT] = calibrate(
+				(struct phy_calibration *)&shared_ram[SHM_DATA],
+				arg, length);
+			break;
+		case CMD_SET_TIMEOUTS:
+			/* nothing changes under an open session */
+			if (session) {
+				shared_ram[SHM_RESULT] = ERR_BUSY;
+				break;
+			}
+
+			timeouts = (uint32_t *)&xnvm_timeouts;
+			for (i = 0; i < SHM_TIMEOUTS_NUM; i++) {
+				if (shared_ram[SHM_DATA + i])
+					timeouts[i] = shared_ram[SHM_DATA + i];
+				shared_ram[SHM_DATA + i] = timeouts[i];
+			}
+
+			/* the channels of the job starting */
+			shared_ram[SHM_RESULT] = pdi_set_channels(arg ? arg : 1);
+			if (shared_ram[SHM_RESULT] == STATUS_OK)
+				channels = arg ? arg : 1;
+			break;
+		case CMD_PROGRAM_IMAGE:
+			/* The PDI session must already be open */
+			if (channels & (channels - 1))
+				shared_ram[SHM_RESULT] = program_channels(
+					(const struct stage_header *)arg,
+					channels, length, slot,
+					(uint32_t *)&shared_ram[SHM_LENGTH]);
+			else
+				shared_ram[SHM_RESULT] = xnvm_program_stage(
+					(const struct stage_header *)arg,
+					length, slot, stage_buffer, aborted,
+					(uint32_t *)&shared_ram[SHM_LENGTH]);
+			break;
+		case CMD_VERIFY_IMAGE:
+			/* The PDI session must already be open */
+			shared_ram[SHM_RESULT] = xnvm_verify_stage(
+				(const struct stage_header *)arg, length,
+				(struct verify_result *)&shared_ram[SHM_DATA],
+				stage_buffer, aborted,
+				(uint32_t *)&shared_ram[SHM_LENGTH]);
+			break;
+		case CMD_WRITE_NVM:
+			/* The PDI session must already be open */
+			if (slot >= SHM_SLOT_NUM || length == 0 ||
+			    length > (SHM_SLOT_NUM - slot) * SHM_SLOT_SIZE) {
+				shared_ram[SHM_RESULT] = ERR_INVALID_ARG;
+				break;
+			}
+
+			data = (uint8_t *)&shared_ram[SHM_SLOT_OFFSET(slot)];
+			shared_ram[SHM_RESULT] = xnvm_write_nvm(arg, data, length,
+								 page_buffer);
+			break;
+		case CMD_SEQUENCE:
+			/* The PDI session must already be open */
+			if (pdi_phy_ops == &pdi_phy_shift) {
+				shared_ram[SHM_RESULT] = ERR_UNSUPPORTED_DEV;
+				break;
+			}
+			shared_ram[SHM_RESULT] = seq_run(
+				(const uint32_t *)arg, length,
+				(uint32_t *)&shared_ram[SHM_LENGTH]);
+			break;
+		case CMD_TRACE:
+			pdi_trace_enable(arg != 0);
+			shared_ram[SHM_RESULT] = STATUS_OK;
+			break;
+		case CMD_DETECT:
+			if (session) {
+				shared_ram[SHM_RESULT] = ERR_BUSY;
+				break;
+			}
+			if (length > DETECT_WINDOW_MS) {
+				shared_ram[SHM_RESULT] = ERR_INVALID_ARG;
+				break;
+			}
+			shared_ram[SHM_RESULT] = detect(arg != 0, channels,
+				length ? length : DETECT_PERIOD_MS);
 			break;
 		case CMD_READ_FLASH:
 			memset(page_buffer, 0, BUFSIZE);
 
 			/* Initialize the PDI interface */
 			xnvm_init();
-			xnvm_read_memory(XNVM_FLASH_BASE + shared_ram[1],
+			xnvm_read_memory(XNVM_FLASH_BASE + arg,
 					 page_buffer, half(BUFSIZE));
 
 			/* Initialize the PDI interface */
 			xnvm_init();
-			xnvm_read_memory(XNVM_FLASH_BASE + shared_ram[1] + half(BUFSIZE),
+			xnvm_read_memory(XNVM_FLASH_BASE + arg + half(BUFSIZE),
 					 &page_buffer[half(BUFSIZE)], half(BUFSIZE));
 
 			/* */
 			pdi_deinit();
 
-			for (i = 0; i < BUFSIZE; i++)
-				shared_ram[i + 5] = page_buffer[i];
+			memcpy((uint8_t *)&shared_ram[SHM_SLOT_OFFSET(0)],
+			       page_buffer, BUFSIZE);
+			break;
+		case CMD_READ_MEMORY:
+			/*
+			 * Read straight into the requested slot, the PDI
+			 * session must already be open (CMD_ENTER_PROGMODE).
+			 */
+			if (slot >= SHM_SLOT_NUM || length > SHM_SLOT_SIZE) {
+				shared_ram[SHM_RESULT] = ERR_INVALID_ARG;
+				break;
+			}
+
+			/* with several channels, channel n reads into slot n */
+			shared_ram[SHM_RESULT] = STATUS_OK;
+			for (c = 0; c < PDI_CHANNELS; c++) {
+				if (!(channels & 1 << c))
+					continue;
+				if (channels & (channels - 1))
+					slot = c;
+				pdi_select_channel(c);
+				if (xnvm_read_memory(arg,
+						     (uint8_t *)&shared_ram[SHM_SLOT_OFFSET(slot)],
+						     length) == 0) {
+					shared_ram[SHM_RESULT] = ERR_TIMEOUT;
+					break;
+				}
+			}
+			break;
+		case CMD_READ_DATA:
+		case CMD_WRITE_DATA:
+			/* The PDI session must already be open */
+			if (slot >= SHM_SLOT_NUM || length == 0 ||
+			    length > (SHM_SLOT_NUM - slot) * SHM_SLOT_SIZE) {
+				shared_ram[SHM_RESULT] = ERR_INVALID_ARG;
+				break;
+			}
+			if (arg >= DATA_SPACE_SIZE ||
+			    length > DATA_SPACE_SIZE - arg) {
+				shared_ram[SHM_RESULT] = ERR_BAD_ADDRESS;
+				break;
+			}
+
+			data = (uint8_t *)&shared_ram[SHM_SLOT_OFFSET(slot)];
+			if (cmd == CMD_WRITE_DATA)
+				shared_ram[SHM_RESULT] = xnvm_write_data(
+					arg, data, length);
+			else if (xnvm_read_data(arg, data, length) == 0)
+				shared_ram[SHM_RESULT] = ERR_TIMEOUT;
+			else
+				shared_ram[SHM_RESULT] = STATUS_OK;
 			break;
 		case CMD_PROGRAM_FLASH:
-			for (i = 0; i < BUFSIZE; i++)
-				page_buffer[i] = (uint8_t)shared_ram[i + 5];
+			memcpy(page_buffer,
+			       (uint8_t *)&shared_ram[SHM_SLOT_OFFSET(0)],
+			       BUFSIZE);
 
 			/* Initialize the PDI interface */
 			xnvm_init();
-			xnvm_erase_program_flash_page(0x0000 + shared_ram[1], page_buffer, BUFSIZE);
+			xnvm_erase_program_flash_page(0x0000 + arg, page_buffer, BUFSIZE);
 			break;
 		default:
 			break;
 		}
 
-		shared_ram[0] = 0;
+done:
+		pdi_trace(TRACE_END, shared_ram[SHM_RESULT], 0);
+		pdi_metrics.commands++;
+		pdi_metrics.command_cycles += timer_cycles() - start;
+		idle = timer_cycles();
+		memcpy((void *)&shared_ram[SHM_METRICS], &pdi_metrics,
+		       sizeof(pdi_metrics));
+
+		/*
+		 * The command word goes last, the host may be spinning on it
+		 * and send the next command as soon as it reads zero.
+		 */
 		shared_ram[1] = 0;
+		shared_ram[0] = 0;
 
 		/*
 		 * Writing to register 31 sends interrupt requests to the
@@ -0,0 +1,71 @@
+/*
+ * Linker command file of the PDI programmer firmware.
+ *
+ * Places the firmware buffers where layout.h says they are, the host finds
+ * them there. A buffer outgrowing its region fails the link.
+ *
+ * Copyright (C) 2015-2017 Toby Churchill Ltd.
+ *
+ * Enric Balletbo Serra <enric.balletbo@collabora.com>
+ *
+ * License
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+#include "layout.h"
+
+-cr				/* link using C conventions, RAM autoinit */
+-stack LAYOUT_STACK_SIZE
+-heap 0
+
+MEMORY
+{
+    PAGE 0:
+	PRU_IMEM	: org = PRU_IRAM, len = PRU_IRAM_SIZE
+
+    PAGE 1:
+	PRU0_STACK	: org = LAYOUT_STACK, len = LAYOUT_STACK_SIZE
+	PRU0_FRAMES	: org = LAYOUT_FRAMES, len = LAYOUT_FRAMES_SIZE
+	PRU0_DMEM	: org = LAYOUT_FRAMES + LAYOUT_FRAMES_SIZE,
+			  len = PRU_DRAM0_SIZE - LAYOUT_STACK_SIZE -
+				LAYOUT_FRAMES_SIZE
+	PRU1_PAGES	: org = LAYOUT_PAGES, len = LAYOUT_PAGES_SIZE
+	PRU1_SEQ	: org = LAYOUT_SEQ, len = LAYOUT_SEQ_SIZE
+	PRU1_DMEM	: org = LAYOUT_SEQ + LAYOUT_SEQ_SIZE,
+			  len = PRU_DRAM1_SIZE - LAYOUT_PAGES_SIZE -
+				LAYOUT_SEQ_SIZE
+
+    PAGE 2:
+	PRU_MAILBOX	: org = LAYOUT_MAILBOX, len = LAYOUT_MAILBOX_SIZE
+	PRU_TRACE	: org = LAYOUT_TRACE, len = LAYOUT_TRACE_SIZE
+	PRU_SHAREDMEM	: org = LAYOUT_SHARED_FREE,
+			  len = PRU_SHARED_RAM_SIZE - LAYOUT_MAILBOX_SIZE -
+				LAYOUT_TRACE_SIZE
+}
+
+SECTIONS
+{
+	.text		>  PRU_IMEM, PAGE 0
+
+	/* not initialised, the host owns the mailbox before the PRU runs */
+	.pdi_frames	>  PRU0_FRAMES, PAGE 1, type = NOINIT
+	.pdi_pages	>  PRU1_PAGES, PAGE 1, type = NOINIT
+	.pdi_seq	>  PRU1_SEQ, PAGE 1, type = NOINIT
+	.pdi_mailbox	>  PRU_MAILBOX, PAGE 2, type = NOINIT
+	.pdi_trace	>  PRU_TRACE, PAGE 2, type = NOINIT
+
+	.stack		>  PRU0_STACK, PAGE 1
+	.bss		>  PRU0_DMEM, PAGE 1
+	.cio		>  PRU0_DMEM, PAGE 1
+	.data		>  PRU0_DMEM, PAGE 1
+	.switch		>  PRU0_DMEM, PAGE 1
+	.sysmem		>  PRU0_DMEM, PAGE 1
+	.cinit		>  PRU0_DMEM, PAGE 1
+	.rodata		>  PRU0_DMEM, PAGE 1
+	.rofardata	>  PRU0_DMEM, PAGE 1
+	.farbss		>  PRU0_DMEM, PAGE 1
+	.fardata	>  PRU0_DMEM, PAGE 1
+}
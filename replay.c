@@ -0,0 +1,671 @@
+/**
+ * PDI bus trace replay.
+ *
+ * Runs the NVM layer of the firmware again on the host, against the bus
+ * events of a trace taken with pdi -T, instead of a target. Each command
+ * either replays to the same bus traffic and status, or the first event
+ * where the code and the trace part ways is reported. The virtual clock
+ * follows the event time stamps, so the time budgets in the trace decide
+ * timeouts the way they did on the wire.
+ *
+ * Given two traces, the wire time of every command type is compared.
+ *
+ * Copyright (C) 2015-2017 Toby Churchill Ltd.
+ *
+ * Enric Balletbo Serra <enric.balletbo@collabora.com>
+ *
+ * License
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <errno.h>
+
+#include "xmega_pdi_nvm.h"
+#include "low_level_pdi.h"
+#include "sequencer.h"
+#include "timer.h"
+#include "crc16.h"
+#include "trace.h"
+
+#include "atxmega16d4_nvm_regs.h"
+
+#define CMD_FIRST	CMD_ENTER_PROGMODE
+#define CMD_LAST	CMD_WRITE_NVM
+#define CMD_NUM		(CMD_LAST - CMD_FIRST + 1)
+
+static const char * const cmd_names[CMD_NUM] = {
+	[CMD_ENTER_PROGMODE - CMD_FIRST]	= "enter",
+	[CMD_LEAVE_PROGMODE - CMD_FIRST]	= "leave",
+	[CMD_READ_SIGNATURE - CMD_FIRST]	= "read-signature",
+	[CMD_CHIP_ERASE - CMD_FIRST]		= "chip-erase",
+	[CMD_PROGRAM_FLASH - CMD_FIRST]		= "program-flash",
+	[CMD_READ_FLASH - CMD_FIRST]		= "read-flash",
+	[CMD_READ_MEMORY - CMD_FIRST]		= "read-memory",
+	[CMD_PROGRAM_IMAGE - CMD_FIRST]		= "program-image",
+	[CMD_SET_TIMEOUTS - CMD_FIRST]		= "set-timeouts",
+	[CMD_IDENTIFY - CMD_FIRST]		= "identify",
+	[CMD_ERASE - CMD_FIRST]			= "erase",
+	[CMD_SECTION_CRC - CMD_FIRST]		= "section-crc",
+	[CMD_PHY_INFO - CMD_FIRST]		= "phy-info",
+	[CMD_PHY_SELECT - CMD_FIRST]		= "phy-select",
+	[CMD_CALIBRATE - CMD_FIRST]		= "calibrate",
+	[CMD_SEQUENCE - CMD_FIRST]		= "sequence",
+	[CMD_TRACE - CMD_FIRST]			= "trace",
+	[CMD_DETECT - CMD_FIRST]		= "detect",
+	[CMD_READ_DATA - CMD_FIRST]		= "read-data",
+	[CMD_WRITE_DATA - CMD_FIRST]		= "write-data",
+	[CMD_VERIFY_IMAGE - CMD_FIRST]		= "verify-image",
+	[CMD_WRITE_NVM - CMD_FIRST]		= "write-nvm",
+};
+
+static const char * const event_names[] = {
+	[TRACE_CMD]		= "command",
+	[TRACE_END]		= "end",
+	[TRACE_ENABLE]		= "enable",
+	[TRACE_DISABLE]		= "disable",
+	[TRACE_TX]		= "tx",
+	[TRACE_BITS]		= "bits",
+	[TRACE_BREAK]		= "break",
+	[TRACE_RX]		= "rx",
+	[TRACE_RX_ERROR]	= "rx error",
+	[TRACE_RX_TIMEOUT]	= "rx timeout",
+	[TRACE_CHANNEL]		= "channel",
+};
+
+/* A trace in memory */
+struct trace {
+	const char *path;
+	uint8_t *data;
+	size_t size;
+	uint32_t clock_hz;
+
+	/* wire cycles and commands per command type */
+	uint64_t cycles[CMD_NUM];
+	uint32_t count[CMD_NUM];
+};
+
+/* The events of the command being replayed */
+static struct {
+	const struct trace_event *ev;
+	uint32_t nevents;
+	uint32_t pos;		/* next event */
+	uint32_t now;		/* virtual cycle counter */
+	char why[96];		/* first divergence, empty if none */
+	uint32_t at;		/* event it happened at */
+} rp;
+
+/* What the NVM layer expects of the firmware around it */
+struct pdi_metrics pdi_metrics;
+bool pdi_trace_on;
+
+static const char *cmd_name(uint32_t cmd)
+{
+	if (cmd < CMD_FIRST || cmd > CMD_LAST || !cmd_names[cmd - CMD_FIRST])
+		return "unknown";
+
+	return cmd_names[cmd - CMD_FIRST];
+}
+
+static const char *event_name(uint8_t type)
+{
+	if (type >= sizeof(event_names) / sizeof(event_names[0]) ||
+	    !event_names[type])
+		return "unknown event";
+
+	return event_names[type];
+}
+
+static void diverge(const char *fmt, ...)
+{
+	va_list ap;
+
+	if (rp.why[0])
+		return;
+
+	va_start(ap, fmt);
+	vsnprintf(rp.why, sizeof(rp.why), fmt, ap);
+	va_end(ap);
+	rp.at = rp.pos;
+}
+
+/**
+ * \brief Step over channel switches, the replay drives a single target.
+ */
+static void replay_skip(void)
+{
+	while (rp.pos + 1 < rp.nevents &&
+	       rp.ev[rp.pos].type == TRACE_CHANNEL)
+		rp.pos++;
+}
+
+/**
+ * \brief Take the next event of the command, whatever its type.
+ *
+ * Returns NULL once the replay diverged, or when the code wants more
+ * than the trace holds.
+ */
+static const struct trace_event *replay_take(const char *what)
+{
+	const struct trace_event *ev;
+
+	if (rp.why[0])
+		return NULL;
+
+	replay_skip();
+
+	/* the last event is TRACE_END, never for the code to take */
+	if (rp.pos + 1 >= rp.nevents) {
+		diverge("%s past the end of the command", what);
+		return NULL;
+	}
+
+	ev = &rp.ev[rp.pos++];
+	rp.now = ev->cycles;
+
+	return ev;
+}
+
+static bool replay_expect(const struct trace_event *ev, enum trace_type type,
+			  const char *what)
+{
+	if (!ev)
+		return false;
+
+	if (ev->type != type) {
+		rp.pos--;
+		diverge("%s, the trace has %s", what, event_name(ev->type));
+		return false;
+	}
+
+	return true;
+}
+
+void timer_init(void)
+{
+}
+
+/**
+ * \brief The virtual cycle counter, the time stamp of the last event.
+ *
+ * A diverged replay has no time left: every look at the clock is past
+ * any budget, so that no wait loop spins on a frozen clock.
+ */
+uint32_t timer_cycles(void)
+{
+	if (rp.why[0])
+		rp.now += 0x7FFFFFFF;
+
+	return rp.now;
+}
+
+void pdi_init(void)
+{
+	replay_expect(replay_take("enable"), TRACE_ENABLE, "enable");
+}
+
+void pdi_deinit(void)
+{
+	replay_expect(replay_take("disable"), TRACE_DISABLE, "disable");
+}
+
+void pdi_send_break(void)
+{
+	replay_expect(replay_take("break"), TRACE_BREAK, "break");
+}
+
+enum status_code pdi_write(const uint8_t *data, uint16_t length)
+{
+	const struct trace_event *ev;
+	uint16_t crc;
+
+	if (!length)
+		return STATUS_OK;
+
+	ev = replay_take("tx");
+	if (!replay_expect(ev, TRACE_TX, "tx"))
+		return ERR_PROTOCOL;
+
+	if (ev->data + 1u != length) {
+		rp.pos--;
+		diverge("tx of %u bytes, the trace has %u", length,
+			ev->data + 1u);
+		return ERR_PROTOCOL;
+	}
+
+	crc = crc16_update(CRC16_INIT, data, length);
+	if (ev->arg != crc) {
+		rp.pos--;
+		diverge("tx CRC %04x, the trace has %04x", crc, ev->arg);
+		return ERR_PROTOCOL;
+	}
+
+	return STATUS_OK;
+}
+
+void pdi_write_bits(const uint32_t *bits, uint32_t nbits)
+{
+	const struct trace_event *ev;
+
+	ev = replay_take("bits");
+	if (replay_expect(ev, TRACE_BITS, "bits") && ev->arg != nbits) {
+		rp.pos--;
+		diverge("%u bits sent, %u in the trace", nbits, ev->arg);
+	}
+}
+
+enum status_code pdi_get_byte(uint8_t *ret, uint32_t timeout_us)
+{
+	const struct trace_event *ev;
+
+	ev = replay_take("rx");
+	if (!ev)
+		return ERR_TIMEOUT;
+
+	switch (ev->type) {
+	case TRACE_RX:
+		*ret = ev->data;
+		return STATUS_OK;
+	case TRACE_RX_ERROR:
+		return ERR_BAD_DATA;
+	case TRACE_RX_TIMEOUT:
+		return ERR_TIMEOUT;
+	default:
+		rp.pos--;
+		diverge("rx, the trace has %s", event_name(ev->type));
+		return ERR_TIMEOUT;
+	}
+}
+
+uint16_t pdi_read(uint8_t *data, uint16_t length, uint32_t timeout_us)
+{
+	uint16_t i;
+
+	for (i = 0; i < length; i++) {
+		if (pdi_get_byte(data + i, timeout_us) != STATUS_OK)
+			return 0;
+	}
+
+	return length;
+}
+
+/**
+ * \brief Check that the stage in the trace lies within it.
+ *
+ * The firmware trusts the host, the replay cannot trust the file.
+ */
+static bool replay_stage_ok(const uint8_t *stage, uint32_t size)
+{
+	const struct stage_header *hdr = (const struct stage_header *)stage;
+	const struct stage_page *map;
+	uint32_t i;
+
+	if (size < sizeof(*hdr) || hdr->map_offset > size ||
+	    hdr->npages > (size - hdr->map_offset) / sizeof(*map))
+		return false;
+
+	map = (const struct stage_page *)(stage + hdr->map_offset);
+	for (i = 0; i < hdr->npages; i++) {
+		if (!(map[i].flags & STAGE_PAGE_ERASE) &&
+		    (size < XNVM_FLASH_PAGE_SIZE ||
+		     map[i].offset > size - XNVM_FLASH_PAGE_SIZE))
+			return false;
+	}
+
+	return true;
+}
+
+/**
+ * \brief Run a command the way pru.c does.
+ *
+ * \retval true the command was run, its status is in *status.
+ * \retval false the replay cannot run it, only its timing counts.
+ */
+static bool replay_command(const struct trace_block *blk, const uint8_t *extra,
+			   int32_t *status)
+{
+	uint8_t page[2][XNVM_FLASH_PAGE_SIZE];
+	uint8_t buf[SHM_DATA_MAX];
+	struct verify_result verify;
+	uint32_t crc, done;
+
+	switch (blk->cmd) {
+	case CMD_ENTER_PROGMODE:
+		*status = xnvm_init();
+		return true;
+	case CMD_LEAVE_PROGMODE:
+		*status = xnvm_pull_dev_out_of_reset();
+		pdi_deinit();
+		return true;
+	case CMD_CHIP_ERASE:
+		*status = xnvm_chip_erase();
+		return true;
+	case CMD_ERASE:
+		switch (blk->arg) {
+		case AREA_APP:
+			*status = xnvm_erase_app_section();
+			break;
+		case AREA_BOOT:
+			*status = xnvm_erase_boot_section();
+			break;
+		case AREA_EEPROM:
+			*status = xnvm_erase_eeprom();
+			break;
+		case AREA_CHIP:
+			*status = xnvm_chip_erase();
+			break;
+		default:
+			*status = ERR_INVALID_ARG;
+			break;
+		}
+		return true;
+	case CMD_SECTION_CRC:
+		if (blk->arg != AREA_APP && blk->arg != AREA_BOOT)
+			*status = ERR_INVALID_ARG;
+		else
+			*status = xnvm_section_crc(blk->arg == AREA_BOOT, &crc);
+		return true;
+	case CMD_READ_MEMORY:
+		if (blk->slot >= SHM_SLOT_NUM || blk->length > SHM_SLOT_SIZE)
+			*status = ERR_INVALID_ARG;
+		else if (xnvm_read_memory(blk->arg, buf, blk->length) == 0)
+			*status = ERR_TIMEOUT;
+		else
+			*status = STATUS_OK;
+		return true;
+	case CMD_READ_DATA:
+	case CMD_WRITE_DATA:
+		if (blk->slot >= SHM_SLOT_NUM || blk->length == 0 ||
+		    blk->length > (SHM_SLOT_NUM - blk->slot) * SHM_SLOT_SIZE)
+			*status = ERR_INVALID_ARG;
+		else if (blk->arg >= DATA_SPACE_SIZE ||
+			 blk->length > DATA_SPACE_SIZE - blk->arg)
+			*status = ERR_BAD_ADDRESS;
+		else if (blk->cmd == CMD_WRITE_DATA && blk->extra != blk->length)
+			return false;
+		else if (blk->cmd == CMD_WRITE_DATA)
+			*status = xnvm_write_data(blk->arg, extra, blk->length);
+		else if (xnvm_read_data(blk->arg, buf, blk->length) == 0)
+			*status = ERR_TIMEOUT;
+		else
+			*status = STATUS_OK;
+		return true;
+	case CMD_WRITE_NVM:
+		if (blk->slot >= SHM_SLOT_NUM || blk->length == 0 ||
+		    blk->length > (SHM_SLOT_NUM - blk->slot) * SHM_SLOT_SIZE)
+			*status = ERR_INVALID_ARG;
+		else if (blk->extra != blk->length)
+			return false;
+		else
+			*status = xnvm_write_nvm(blk->arg, extra, blk->length,
+						 page[0]);
+		return true;
+	case CMD_SET_TIMEOUTS:
+		/* the budgets the firmware used from then on */
+		if (blk->extra != sizeof(xnvm_timeouts))
+			return false;
+		/* refused under a session, nothing was written back */
+		if (blk->result == ERR_BUSY) {
+			*status = ERR_BUSY;
+			return true;
+		}
+		memcpy(&xnvm_timeouts, extra, sizeof(xnvm_timeouts));
+		*status = STATUS_OK;
+		return true;
+	case CMD_TRACE:
+		*status = STATUS_OK;
+		return true;
+	case CMD_PROGRAM_IMAGE:
+		/* where the host stopped it is not in the trace */
+		if (!blk->extra || blk->result == ERR_FLUSHED)
+			return false;
+		if (!replay_stage_ok(extra, blk->extra))
+			*status = ERR_BAD_FORMAT;
+		else
+			*status = xnvm_program_stage(
+				(const struct stage_header *)extra,
+				blk->length, blk->slot, page, NULL, &done);
+		return true;
+	case CMD_VERIFY_IMAGE:
+		if (!blk->extra || blk->result == ERR_FLUSHED)
+			return false;
+		if (!replay_stage_ok(extra, blk->extra))
+			*status = ERR_BAD_FORMAT;
+		else
+			*status = xnvm_verify_stage(
+				(const struct stage_header *)extra,
+				blk->length, &verify, page, NULL, &done);
+		return true;
+	case CMD_SEQUENCE:
+		if (blk->extra != blk->length * 4)
+			return false;
+		*status = seq_run((const uint32_t *)extra, blk->length, &done);
+		return true;
+	default:
+		return false;
+	}
+}
+
+/**
+ * \brief Replay one block and print its line.
+ */
+static void replay_block(struct trace *t, unsigned int index,
+			 const struct trace_block *blk,
+			 const struct trace_event *ev, const uint8_t *extra)
+{
+	const struct trace_event *first = &ev[0], *last;
+	uint32_t cycles = 0;
+	int32_t status = 0;
+	uint32_t i;
+	bool ran;
+
+	printf("%6u  %-14s ", index, cmd_name(blk->cmd));
+
+	if (!blk->nevents) {
+		printf("%10s  no events\n", "-");
+		return;
+	}
+
+	last = &ev[blk->nevents - 1];
+	if (last->type == TRACE_END)
+		cycles = last->cycles - first->cycles;
+	if (blk->cmd >= CMD_FIRST && blk->cmd <= CMD_LAST) {
+		t->cycles[blk->cmd - CMD_FIRST] += cycles;
+		t->count[blk->cmd - CMD_FIRST]++;
+	}
+	printf("%s%9.1f  ", blk->lost ? ">" : " ",
+	       (double)cycles * 1e6 / t->clock_hz);
+
+	if (blk->lost) {
+		printf("%u events lost, timing only\n", blk->lost);
+		return;
+	}
+	if (first->type != TRACE_CMD || last->type != TRACE_END) {
+		printf("malformed\n");
+		return;
+	}
+
+	/* the order the firmware served several targets in is its own */
+	for (i = 1; i < blk->nevents && blk->cmd != CMD_SET_TIMEOUTS; i++) {
+		if (ev[i].type == TRACE_CHANNEL) {
+			printf("several channels, timing only\n");
+			return;
+		}
+	}
+
+	memset(&rp, 0, sizeof(rp));
+	rp.ev = ev;
+	rp.nevents = blk->nevents;
+	rp.pos = 1;
+	rp.now = first->cycles;
+
+	ran = replay_command(blk, extra, &status);
+	if (!ran) {
+		printf("timing only\n");
+		return;
+	}
+
+	replay_skip();
+	if (!rp.why[0] && rp.pos + 1 != rp.nevents)
+		diverge("%u events left over", rp.nevents - 1 - rp.pos);
+	if (!rp.why[0] && status != blk->result)
+		diverge("status %d, the trace has %d", status, blk->result);
+
+	if (rp.why[0])
+		printf("diverged at event %u: %s\n", rp.at, rp.why);
+	else
+		printf("replayed\n");
+}
+
+static int trace_load(struct trace *t, const char *path)
+{
+	const struct trace_header *hdr;
+	FILE *f;
+	long size;
+
+	t->path = path;
+
+	f = fopen(path, "rb");
+	if (!f)
+		return -1;
+	if (fseek(f, 0, SEEK_END) < 0 || (size = ftell(f)) < 0 ||
+	    fseek(f, 0, SEEK_SET) < 0)
+		goto err_close;
+
+	t->size = size;
+	t->data = malloc(t->size ? t->size : 1);
+	if (!t->data || fread(t->data, 1, t->size, f) != t->size)
+		goto err_close;
+	fclose(f);
+
+	hdr = (const struct trace_header *)t->data;
+	if (t->size < sizeof(*hdr) || hdr->magic != TRACE_MAGIC ||
+	    hdr->version != TRACE_VERSION ||
+	    hdr->event_size != sizeof(struct trace_event) || !hdr->clock_hz) {
+		errno = EINVAL;
+		return -1;
+	}
+	t->clock_hz = hdr->clock_hz;
+
+	return 0;
+
+err_close:
+	fclose(f);
+	return -1;
+}
+
+/**
+ * \brief Replay every block of a trace, in order.
+ */
+static int trace_replay(struct trace *t)
+{
+	const struct trace_block *blk;
+	size_t off = sizeof(struct trace_header), need;
+	unsigned int index = 0;
+
+	printf("%s\n%6s  %-14s %10s  %s\n", t->path, "#", "command",
+	       "wire us", "verdict");
+
+	while (off < t->size) {
+		if (t->size - off < sizeof(*blk))
+			goto truncated;
+		blk = (const struct trace_block *)(t->data + off);
+		off += sizeof(*blk);
+
+		need = (size_t)blk->nevents * sizeof(struct trace_event) +
+		       ((blk->extra + 3) & ~3u);
+		if (t->size - off < need)
+			goto truncated;
+
+		replay_block(t, index++, blk,
+			     (const struct trace_event *)(t->data + off),
+			     t->data + off +
+			     blk->nevents * sizeof(struct trace_event));
+		off += need;
+	}
+
+	return 0;
+
+truncated:
+	fflush(stdout);
+	fprintf(stderr, "%s: truncated after %u commands\n", t->path, index);
+	return -1;
+}
+
+static void print_compare(const struct trace *a, const struct trace *b)
+{
+	double ua, ub;
+	unsigned int i;
+
+	printf("\n%-14s %7s %12s %7s %12s %12s\n", "command", "A", "A us",
+	       "B", "B us", "B-A us");
+	for (i = 0; i < CMD_NUM; i++) {
+		if (!a->count[i] && !b->count[i])
+			continue;
+		ua = (double)a->cycles[i] * 1e6 / a->clock_hz;
+		ub = (double)b->cycles[i] * 1e6 / b->clock_hz;
+		printf("%-14s %7u %12.1f %7u %12.1f %+12.1f\n",
+		       cmd_names[i] ? cmd_names[i] : "unknown",
+		       a->count[i], ua, b->count[i], ub, ub - ua);
+	}
+}
+
+static void usage(void)
+{
+	fprintf(stderr,
+		"usage: pdi-replay TRACE [TRACE]\n"
+		"\n"
+		"Replays the commands of a bus trace taken with pdi -T against\n"
+		"the firmware NVM code, and prints the wire time of each and\n"
+		"whether the code still makes the same bus traffic. Commands\n"
+		"it cannot run again, or that lost events, count for timing\n"
+		"only. Given a second trace, compares the wire time of every\n"
+		"command type.\n");
+}
+
+int main(int argc, const char *argv[])
+{
+	struct trace t[2];
+	int i, ret = 0;
+
+	if (argc != 2 && argc != 3) {
+		usage();
+		return 1;
+	}
+
+	memset(t, 0, sizeof(t));
+	for (i = 0; i < argc - 1; i++) {
+		if (trace_load(&t[i], argv[i + 1]) < 0) {
+			fprintf(stderr, "%s: %s\n", argv[i + 1],
+				errno == EINVAL ? "not a PDI trace" :
+				strerror(errno));
+			return 1;
+		}
+
+		/* every trace starts from the firmware defaults */
+		xnvm_timeouts = (struct xnvm_timeouts) {
+			.byte_us	= XNVM_TIMEOUT_BYTE_US,
+			.nvmen_us	= XNVM_TIMEOUT_NVMEN_US,
+			.busy_us	= XNVM_TIMEOUT_BUSY_US,
+			.erase_us	= XNVM_TIMEOUT_ERASE_US,
+		};
+		if (i)
+			printf("\n");
+		if (trace_replay(&t[i]) < 0)
+			ret = 1;
+	}
+
+	if (argc == 3)
+		print_compare(&t[0], &t[1]);
+
+	for (i = 0; i < argc - 1; i++)
+		free(t[i].data);
+
+	return ret;
+}
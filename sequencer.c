@@ -0,0 +1,221 @@
+/**
+ * PDI bit sequencer.
+ *
+ * Replays a sequence compiled on the host, see the CMD_SEQUENCE format in
+ * prog.h. Nothing is encoded here: transmitted words go to the PHY as they
+ * are, and response bytes are only checked against what the host expects.
+ * The sequence is read from DDR through a window in PRU1 data RAM, a block
+ * at a time, so the DDR latency is paid once per block and not per word.
+ *
+ * Copyright (C) 2015-2017 Toby Churchill Ltd.
+ *
+ * Enric Balletbo Serra <enric.balletbo@collabora.com>
+ *
+ * License
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#include "sequencer.h"
+#include "low_level_pdi.h"
+#include "xmega_pdi_nvm.h"
+#include "prog.h"
+#include "layout.h"
+#include "timer.h"
+
+#define SEQ_WINDOW_WORDS	(LAYOUT_SEQ_SIZE / 4)
+
+#pragma DATA_SECTION(seq_window, ".pdi_seq")
+static uint32_t seq_window[SEQ_WINDOW_WORDS];
+
+struct seq_reader {
+	const uint32_t *src;	/* next word in DDR */
+	uint32_t left;		/* words not fetched yet */
+	uint32_t pos;		/* next word in the window */
+	uint32_t fill;		/* words in the window */
+};
+
+/**
+ * \brief Get the next n words of the sequence into the window.
+ *
+ * Returns NULL if the sequence ends first, or n is over the window.
+ */
+static const uint32_t *seq_take(struct seq_reader *r, uint32_t n)
+{
+	uint32_t keep, more;
+	const uint32_t *p;
+
+	if (r->fill - r->pos < n) {
+		/* slide what is left to the front, then fill up from DDR */
+		keep = r->fill - r->pos;
+		memmove(seq_window, &seq_window[r->pos], keep * 4);
+
+		more = SEQ_WINDOW_WORDS - keep;
+		if (more > r->left)
+			more = r->left;
+		memcpy(&seq_window[keep], r->src, more * 4);
+		r->src += more;
+		r->left -= more;
+
+		r->pos = 0;
+		r->fill = keep + more;
+		if (r->fill < n)
+			return NULL;
+	}
+
+	p = &seq_window[r->pos];
+	r->pos += n;
+
+	return p;
+}
+
+/**
+ * \brief Send a run of bits, through the window a block at a time.
+ */
+static enum status_code seq_tx(struct seq_reader *r, uint32_t nbits)
+{
+	const uint32_t *bits;
+	uint32_t n;
+
+	while (nbits) {
+		n = nbits < SEQ_WINDOW_WORDS * 32 ? nbits : SEQ_WINDOW_WORDS * 32;
+		bits = seq_take(r, (n + 31) / 32);
+		if (!bits)
+			return ERR_BAD_FORMAT;
+		pdi_write_bits(bits, n);
+		nbits -= n;
+	}
+
+	return STATUS_OK;
+}
+
+static inline uint32_t seq_check(const uint32_t *checks, uint32_t i)
+{
+	return (i & 1) ? checks[i / 2] >> 16 : checks[i / 2] & 0xFFFF;
+}
+
+/**
+ * \brief Read response bytes and check each of them.
+ */
+static enum status_code seq_rx(struct seq_reader *r, uint32_t nbytes)
+{
+	enum status_code ret;
+	const uint32_t *checks;
+	uint32_t i, check;
+	uint8_t value;
+
+	checks = seq_take(r, (nbytes + 1) / 2);
+	if (!checks)
+		return ERR_BAD_FORMAT;
+
+	for (i = 0; i < nbytes; i++) {
+		ret = pdi_get_byte(&value, xnvm_timeouts.byte_us);
+		if (ret != STATUS_OK)
+			return ret;
+
+		check = seq_check(checks, i);
+		if ((value & check >> 8) != (check & 0xFF))
+			return ERR_PROTOCOL;
+	}
+
+	return STATUS_OK;
+}
+
+/**
+ * \brief Send a request until the byte it gets back passes its check.
+ */
+static enum status_code seq_poll(struct seq_reader *r, uint32_t op)
+{
+	enum status_code ret;
+	struct deadline dl;
+	const uint32_t *req;
+	uint32_t nbits = SEQ_BITS(op), check;
+	uint8_t value;
+
+	if (SEQ_POLL_BUDGET(op) >= SHM_TIMEOUTS_NUM)
+		return ERR_BAD_FORMAT;
+
+	req = seq_take(r, (nbits + 31) / 32 + 1);
+	if (!req)
+		return ERR_BAD_FORMAT;
+	check = req[(nbits + 31) / 32];
+
+	deadline_set(&dl, ((uint32_t *)&xnvm_timeouts)[SEQ_POLL_BUDGET(op)]);
+
+	for (;;) {
+		pdi_write_bits(req, nbits);
+		pdi_metrics.tx_frames += SEQ_POLL_FRAMES(op);
+		pdi_metrics.busy_polls++;
+
+		ret = pdi_get_byte(&value, xnvm_timeouts.byte_us);
+		if (ret != STATUS_OK)
+			return ret;
+		if ((value & check >> 8) == (check & 0xFF))
+			return STATUS_OK;
+		if (deadline_expired(&dl))
+			return ERR_TIMEOUT;
+	}
+}
+
+/**
+ * \brief Replay a sequence compiled on the host.
+ *
+ * Stops at the first operation that fails. There is no retry here: the
+ * host knows what the sequence was doing and decides what to do next.
+ *
+ * \param seq the sequence, in DDR.
+ * \param nwords its length in words.
+ * \param done words of the operations that completed.
+ *
+ * \retval STATUS_OK the whole sequence ran.
+ * \retval ERR_TIMEOUT a response did not start, or a poll ran out of time.
+ * \retval ERR_BAD_DATA a response byte had a parity or stop bit error.
+ * \retval ERR_PROTOCOL a response byte was not the one expected.
+ * \retval ERR_BAD_FORMAT the sequence is malformed.
+ */
+enum status_code seq_run(const uint32_t *seq, uint32_t nwords, uint32_t *done)
+{
+	enum status_code ret = STATUS_OK;
+	struct seq_reader r = { seq, nwords, 0, 0 };
+	const uint32_t *op;
+
+	*done = 0;
+
+	while (ret == STATUS_OK && (r.left || r.pos < r.fill)) {
+		op = seq_take(&r, 1);
+		if (!op)
+			return ERR_BAD_FORMAT;
+
+		switch (SEQ_OP(*op)) {
+		case SEQ_TX:
+			pdi_metrics.tx_frames += SEQ_TX_FRAMES(*op);
+			ret = seq_tx(&r, SEQ_BITS(*op));
+			break;
+		case SEQ_RX:
+			ret = seq_rx(&r, SEQ_BITS(*op));
+			break;
+		case SEQ_POLL:
+			ret = seq_poll(&r, *op);
+			break;
+		case SEQ_PAGE:
+			if (*op & SEQ_PAGE_ERASED)
+				pdi_metrics.pages_erased++;
+			else
+				pdi_metrics.pages_written++;
+			break;
+		default:
+			ret = ERR_BAD_FORMAT;
+			break;
+		}
+
+		if (ret == STATUS_OK)
+			*done = nwords - r.left - (r.fill - r.pos);
+	}
+
+	return ret;
+}
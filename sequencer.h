@@ -0,0 +1,24 @@
+/**
+ * PDI bit sequencer.
+ *
+ * Copyright (C) 2015-2017 Toby Churchill Ltd.
+ *
+ * Enric Balletbo Serra <enric.balletbo@collabora.com>
+ *
+ * License
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+#ifndef SEQUENCER_H_INCLUDED
+#define SEQUENCER_H_INCLUDED
+
+#include <stdint.h>
+
+#include "status_codes.h"
+
+enum status_code seq_run(const uint32_t *seq, uint32_t nwords, uint32_t *done);
+
+#endif
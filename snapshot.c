@@ -0,0 +1,260 @@
+/**
+ * Device snapshot files.
+ *
+ * Copyright (C) 2015-2017 Toby Churchill Ltd.
+ *
+ * Enric Balletbo Serra <enric.balletbo@collabora.com>
+ *
+ * License
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "snapshot.h"
+#include "atxmega16d4_nvm_regs.h"
+
+#define align(x, a)	(((x) + (a) - 1) & ~((a) - 1))
+
+static const struct {
+	const char *name;
+	uint32_t address;
+	uint32_t size;
+} snapshot_layout[SNAPSHOT_REGION_NUM] = {
+	[SNAPSHOT_FLASH]	= { "flash", XNVM_FLASH_BASE, XNVM_FLASH_SIZE },
+	[SNAPSHOT_EEPROM]	= { "eeprom", XNVM_EEPROM_BASE, XNVM_EEPROM_SIZE },
+	[SNAPSHOT_USER_SIGN]	= { "usersig", XNVM_SIGNATURE_BASE, XNVM_USER_SIGN_SIZE },
+	[SNAPSHOT_CALIBRATION]	= { "calibration", XNVM_CALIBRATION_BASE, XNVM_CALIBRATION_SIZE },
+	[SNAPSHOT_FUSES]	= { "fuses", XNVM_FUSE_BASE, XNVM_FUSE_SIZE },
+};
+
+/**
+ * \brief Create a snapshot file and map it.
+ *
+ * The region index is filled in with every region marked as not read yet.
+ * A NULL path gives an anonymous snapshot which is never written to disk.
+ *
+ * \retval 0 on success, -1 with errno set otherwise.
+ */
+int snapshot_create(struct snapshot *snap, const char *path)
+{
+	struct snapshot_header *hdr;
+	uint32_t offset;
+	unsigned int i;
+
+	offset = align(sizeof(*hdr), SNAPSHOT_ALIGN);
+	for (i = 0; i < SNAPSHOT_REGION_NUM; i++)
+		offset += align(snapshot_layout[i].size, SNAPSHOT_ALIGN);
+	snap->size = offset;
+
+	if (path) {
+		snap->fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+		if (snap->fd < 0)
+			return -1;
+
+		if (ftruncate(snap->fd, snap->size) < 0)
+			goto err_close;
+
+		snap->map = mmap(NULL, snap->size, PROT_READ | PROT_WRITE,
+				 MAP_SHARED, snap->fd, 0);
+	} else {
+		snap->fd = -1;
+		snap->map = mmap(NULL, snap->size, PROT_READ | PROT_WRITE,
+				 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	}
+	if (snap->map == MAP_FAILED)
+		goto err_close;
+
+	hdr = snap->hdr = (struct snapshot_header *)snap->map;
+	hdr->magic = SNAPSHOT_MAGIC;
+	hdr->version = SNAPSHOT_VERSION;
+	hdr->nregions = SNAPSHOT_REGION_NUM;
+
+	offset = align(sizeof(*hdr), SNAPSHOT_ALIGN);
+	for (i = 0; i < SNAPSHOT_REGION_NUM; i++) {
+		hdr->region[i].type = i;
+		hdr->region[i].address = snapshot_layout[i].address;
+		hdr->region[i].offset = offset;
+		hdr->region[i].size = snapshot_layout[i].size;
+		hdr->region[i].valid = 0;
+		offset += align(snapshot_layout[i].size, SNAPSHOT_ALIGN);
+	}
+
+	return 0;
+
+err_close:
+	if (snap->fd >= 0)
+		close(snap->fd);
+	return -1;
+}
+
+/**
+ * \brief Map an existing snapshot file read-only.
+ *
+ * \retval 0 on success, -1 with errno set otherwise.
+ */
+int snapshot_open(struct snapshot *snap, const char *path)
+{
+	struct snapshot_header *hdr;
+	struct stat st;
+	unsigned int i;
+
+	snap->fd = open(path, O_RDONLY);
+	if (snap->fd < 0)
+		return -1;
+
+	if (fstat(snap->fd, &st) < 0)
+		goto err_close;
+
+	snap->size = st.st_size;
+	if (snap->size < sizeof(*hdr)) {
+		errno = EINVAL;
+		goto err_close;
+	}
+
+	snap->map = mmap(NULL, snap->size, PROT_READ, MAP_SHARED, snap->fd, 0);
+	if (snap->map == MAP_FAILED)
+		goto err_close;
+
+	hdr = snap->hdr = (struct snapshot_header *)snap->map;
+	if (hdr->magic != SNAPSHOT_MAGIC ||
+	    hdr->version != SNAPSHOT_VERSION ||
+	    hdr->nregions > SNAPSHOT_REGION_NUM)
+		goto err_format;
+
+	for (i = 0; i < hdr->nregions; i++) {
+		if (hdr->region[i].offset + hdr->region[i].size > snap->size ||
+		    hdr->region[i].valid > hdr->region[i].size)
+			goto err_format;
+	}
+
+	return 0;
+
+err_format:
+	munmap(snap->map, snap->size);
+	errno = EINVAL;
+err_close:
+	close(snap->fd);
+	return -1;
+}
+
+void snapshot_close(struct snapshot *snap)
+{
+	if (snap->fd >= 0)
+		msync(snap->map, snap->size, MS_SYNC);
+	munmap(snap->map, snap->size);
+	if (snap->fd >= 0)
+		close(snap->fd);
+}
+
+/**
+ * \brief Get the data of a region, or NULL if the snapshot lacks it.
+ */
+uint8_t *snapshot_data(struct snapshot *snap, unsigned int type)
+{
+	unsigned int i;
+
+	for (i = 0; i < snap->hdr->nregions; i++) {
+		if (snap->hdr->region[i].type == type)
+			return snap->map + snap->hdr->region[i].offset;
+	}
+
+	return NULL;
+}
+
+const char *snapshot_region_name(unsigned int type)
+{
+	if (type >= SNAPSHOT_REGION_NUM)
+		return "unknown";
+
+	return snapshot_layout[type].name;
+}
+
+void compare_init(struct compare_state *st, FILE *out, uint32_t base)
+{
+	st->out = out;
+	st->base = base;
+	st->open = 0;
+	st->ranges = 0;
+}
+
+static void compare_flush(struct compare_state *st)
+{
+	if (!st->open)
+		return;
+
+	fprintf(st->out, "mismatch 0x%06x-0x%06x (%u bytes)\n",
+		st->base + st->start, st->base + st->end - 1,
+		st->end - st->start);
+	st->ranges++;
+	st->open = 0;
+}
+
+static void compare_mismatch(struct compare_state *st, uint32_t offset)
+{
+	if (st->open && st->end == offset) {
+		st->end++;
+		return;
+	}
+
+	compare_flush(st);
+	st->start = offset;
+	st->end = offset + 1;
+	st->open = 1;
+}
+
+/**
+ * \brief Compare one chunk of a stream.
+ *
+ * Chunks must be fed in increasing offset order. Equal words are skipped a
+ * word at a time, only mismatching words are looked at byte by byte.
+ */
+void compare_chunk(struct compare_state *st, uint32_t offset,
+		   const uint8_t *a, const uint8_t *b, uint32_t length)
+{
+	const uint32_t *wa = (const uint32_t *)a;
+	const uint32_t *wb = (const uint32_t *)b;
+	uint32_t i, j;
+
+	/* word-wide when both buffers allow it */
+	i = 0;
+	if ((((uintptr_t)a | (uintptr_t)b) & 3) == 0) {
+		for (; i + 4 <= length; i += 4) {
+			if (wa[i / 4] == wb[i / 4])
+				continue;
+
+			for (j = i; j < i + 4; j++) {
+				if (a[j] != b[j])
+					compare_mismatch(st, offset + j);
+			}
+		}
+	}
+
+	for (; i < length; i++) {
+		if (a[i] != b[i])
+			compare_mismatch(st, offset + i);
+	}
+
+	if (st->open && st->end != offset + length)
+		compare_flush(st);
+}
+
+/**
+ * \brief Close the comparison.
+ *
+ * Returns the number of mismatching ranges found.
+ */
+unsigned int compare_finish(struct compare_state *st)
+{
+	compare_flush(st);
+
+	return st->ranges;
+}
@@ -0,0 +1,92 @@
+/**
+ * Device snapshot files.
+ *
+ * Copyright (C) 2015-2017 Toby Churchill Ltd.
+ *
+ * Enric Balletbo Serra <enric.balletbo@collabora.com>
+ *
+ * License
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+#ifndef SNAPSHOT_H_INCLUDED
+#define SNAPSHOT_H_INCLUDED
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#define SNAPSHOT_MAGIC		0x534e4450	/* "PDNS" */
+#define SNAPSHOT_VERSION	1
+
+/* Region data is aligned so it can be compared a word at a time */
+#define SNAPSHOT_ALIGN		256
+
+enum snapshot_region_type {
+	SNAPSHOT_FLASH = 0,
+	SNAPSHOT_EEPROM,
+	SNAPSHOT_USER_SIGN,
+	SNAPSHOT_CALIBRATION,
+	SNAPSHOT_FUSES,
+	SNAPSHOT_REGION_NUM,
+};
+
+/**
+ * \brief Region index entry, one per memory read from the device.
+ */
+struct snapshot_region {
+	uint32_t type;		/* enum snapshot_region_type */
+	uint32_t address;	/* PDI address of the region */
+	uint32_t offset;	/* file offset of the region data */
+	uint32_t size;		/* region size in bytes */
+	uint32_t valid;		/* bytes already read from the device */
+};
+
+/**
+ * \brief On-disk header, at the start of the snapshot file.
+ */
+struct snapshot_header {
+	uint32_t magic;
+	uint16_t version;
+	uint16_t nregions;
+	uint8_t signature[4];
+	struct snapshot_region region[SNAPSHOT_REGION_NUM];
+};
+
+struct snapshot {
+	int fd;
+	size_t size;
+	uint8_t *map;
+	struct snapshot_header *hdr;
+};
+
+/**
+ * \brief Running state of a streamed comparison.
+ *
+ * Mismatching bytes are merged into ranges, a range is reported as soon as
+ * a matching byte closes it.
+ */
+struct compare_state {
+	FILE *out;
+	uint32_t base;		/* address reported for offset 0 */
+	uint32_t start;		/* open mismatch range */
+	uint32_t end;
+	int open;
+	unsigned int ranges;	/* mismatch ranges reported so far */
+};
+
+int snapshot_create(struct snapshot *snap, const char *path);
+int snapshot_open(struct snapshot *snap, const char *path);
+void snapshot_close(struct snapshot *snap);
+uint8_t *snapshot_data(struct snapshot *snap, unsigned int type);
+const char *snapshot_region_name(unsigned int type);
+
+void compare_init(struct compare_state *st, FILE *out, uint32_t base);
+void compare_chunk(struct compare_state *st, uint32_t offset,
+		   const uint8_t *a, const uint8_t *b, uint32_t length);
+unsigned int compare_finish(struct compare_state *st);
+
+#endif
@@ -0,0 +1,136 @@
+/**
+ * Image staging in DDR.
+ *
+ * Copyright (C) 2015-2017 Toby Churchill Ltd.
+ *
+ * Enric Balletbo Serra <enric.balletbo@collabora.com>
+ *
+ * License
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+#include <errno.h>
+#include <string.h>
+
+#include <prussdrv.h>
+
+#include "stage.h"
+#include "crc16.h"
+#include "atxmega16d4_nvm_regs.h"
+
+#define PAGE_SIZE	XNVM_FLASH_PAGE_SIZE
+
+#define align(x, a)	(((x) + (a) - 1) & ~((a) - 1))
+
+/**
+ * \brief Map the DDR region exposed to the PRU.
+ *
+ * prussdrv_init() and prussdrv_open() must have been called.
+ *
+ * \retval 0 on success, -1 with errno set otherwise.
+ */
+int stage_init(struct stage *st)
+{
+	void *p;
+
+	if (prussdrv_map_extmem(&p) < 0) {
+		errno = ENODEV;
+		return -1;
+	}
+
+	st->ddr = p;
+	st->size = prussdrv_extmem_size();
+	st->phys = prussdrv_get_phys_addr(p);
+	st->hdr = (struct stage_header *)st->ddr;
+
+	return 0;
+}
+
+/**
+ * \brief Bytes a stage takes, up to the end of its last payload.
+ */
+uint32_t stage_size(const struct stage_header *stage)
+{
+	const struct stage_page *map;
+	uint32_t end, i;
+
+	map = (const struct stage_page *)((const uint8_t *)stage +
+					  stage->map_offset);
+	end = stage->map_offset + stage->npages * sizeof(*map);
+	for (i = 0; i < stage->npages; i++) {
+		if (!(map[i].flags & STAGE_PAGE_ERASE) &&
+		    map[i].offset + stage->page_size > end)
+			end = map[i].offset + stage->page_size;
+	}
+
+	return end;
+}
+
+/**
+ * \brief Stage a raw flash image for CMD_PROGRAM_IMAGE, following a plan.
+ *
+ * Sections that get erased as a whole, or are blank already, only carry
+ * their non-blank pages, to be written without a page erase. Sections
+ * erased page by page carry the pages that differ from the current
+ * contents, pages becoming blank as erase-only entries. A partial last page
+ * is padded with 0xFF.
+ *
+ * Returns the number of pages staged, or -1 with errno set.
+ */
+int stage_image(struct stage *st, const uint8_t *image, size_t size,
+		const uint8_t *current, const struct erase_plan *plan)
+{
+	struct stage_page *map;
+	uint8_t *payload;
+	uint32_t npages, n, offset, address;
+	enum plan_erase erase;
+
+	npages = plan->end / PAGE_SIZE;
+
+	offset = align(sizeof(*st->hdr) + npages * sizeof(*map), PAGE_SIZE);
+	if (offset + npages * PAGE_SIZE > st->size) {
+		errno = ENOSPC;
+		return -1;
+	}
+
+	map = (struct stage_page *)(st->ddr + sizeof(*st->hdr));
+	n = 0;
+	for (address = 0; address < plan->end; address += PAGE_SIZE) {
+		erase = plan->erase[address < XNVM_APPL_SIZE ? AREA_APP : AREA_BOOT];
+
+		payload = st->ddr + offset;
+		image_page(payload, image, size, address);
+
+		map[n].address = address;
+		map[n].offset = offset;
+		map[n].crc = 0;
+		map[n].flags = STAGE_PAGE_WRITE;
+
+		if (erase == PLAN_PAGES) {
+			if (!memcmp(payload, current + address, PAGE_SIZE))
+				continue;
+			map[n].flags = 0;
+			if (page_is_blank(payload)) {
+				map[n].flags = STAGE_PAGE_ERASE;
+				n++;
+				continue;
+			}
+		} else if (erase == PLAN_UNTOUCHED || page_is_blank(payload)) {
+			continue;
+		}
+
+		map[n].crc = crc16_update(CRC16_INIT, payload, PAGE_SIZE);
+		offset += PAGE_SIZE;
+		n++;
+	}
+
+	st->hdr->magic = STAGE_MAGIC;
+	st->hdr->page_size = PAGE_SIZE;
+	st->hdr->npages = n;
+	st->hdr->map_offset = sizeof(*st->hdr);
+
+	return n;
+}
@@ -0,0 +1,39 @@
+/**
+ * Image staging in DDR.
+ *
+ * Copyright (C) 2015-2017 Toby Churchill Ltd.
+ *
+ * Enric Balletbo Serra <enric.balletbo@collabora.com>
+ *
+ * License
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+#ifndef STAGE_H_INCLUDED
+#define STAGE_H_INCLUDED
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "prog.h"
+#include "erase.h"
+
+/**
+ * \brief DDR region shared with the PRU through the external RAM window.
+ */
+struct stage {
+	uint8_t *ddr;		/* host mapping */
+	uint32_t phys;		/* address as seen by the PRU */
+	size_t size;
+	struct stage_header *hdr;
+};
+
+int stage_init(struct stage *st);
+int stage_image(struct stage *st, const uint8_t *image, size_t size,
+		const uint8_t *current, const struct erase_plan *plan);
+uint32_t stage_size(const struct stage_header *stage);
+
+#endif
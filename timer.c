@@ -0,0 +1,63 @@
+/**
+ * PRU cycle counter based timing.
+ *
+ * Copyright (C) 2015-2017 Toby Churchill Ltd.
+ *
+ * Enric Balletbo Serra <enric.balletbo@collabora.com>
+ *
+ * License
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+#include "timer.h"
+
+/* Macro for accessing a hardware register (32 bit) */
+#define HWREG(x) (*((volatile unsigned int *)(x)))
+
+/*
+ * AM335x PRU-ICSS Reference Guide (Rev. A), PRU0 CTRL registers.
+ */
+#define PRU_CTRL_CONTROL	0x22000
+#define PRU_CTRL_CYCLE		0x2200C
+
+#define CONTROL_COUNTER_ENABLE	(1 << 3)
+
+/* cycles folded out of the hardware counter */
+static uint32_t timer_base;
+
+/**
+ * \brief Start the PRU cycle counter from zero.
+ */
+void timer_init(void)
+{
+	HWREG(PRU_CTRL_CONTROL) &= ~CONTROL_COUNTER_ENABLE;
+	HWREG(PRU_CTRL_CYCLE) = 0;
+	HWREG(PRU_CTRL_CONTROL) |= CONTROL_COUNTER_ENABLE;
+	timer_base = 0;
+}
+
+/**
+ * \brief Get a free running, wrapping, cycle count.
+ *
+ * The hardware counter stops at 0xFFFFFFFF instead of wrapping around, so
+ * once it passes half its range it is folded into timer_base and restarted.
+ * Differences between two readings are then valid for up to ~21 s.
+ */
+uint32_t timer_cycles(void)
+{
+	uint32_t now = HWREG(PRU_CTRL_CYCLE);
+
+	if (now & 0x80000000) {
+		HWREG(PRU_CTRL_CONTROL) &= ~CONTROL_COUNTER_ENABLE;
+		timer_base += HWREG(PRU_CTRL_CYCLE);
+		HWREG(PRU_CTRL_CYCLE) = 0;
+		HWREG(PRU_CTRL_CONTROL) |= CONTROL_COUNTER_ENABLE;
+
+		return timer_base;
+	}
+
+	return timer_base + now;
+}
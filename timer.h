@@ -0,0 +1,54 @@
+/**
+ * PRU cycle counter based timing.
+ *
+ * Copyright (C) 2015-2017 Toby Churchill Ltd.
+ *
+ * Enric Balletbo Serra <enric.balletbo@collabora.com>
+ *
+ * License
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+#ifndef TIMER_H_INCLUDED
+#define TIMER_H_INCLUDED
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * 200 MHz @ 5ns
+ */
+#define TIMER_CYCLES_PER_US	200
+
+/**
+ * \brief A time budget, started with deadline_set().
+ */
+struct deadline {
+	uint32_t start;
+	uint32_t cycles;
+};
+
+void timer_init(void);
+uint32_t timer_cycles(void);
+
+/**
+ * \brief Start a time budget of the given number of microseconds.
+ */
+static inline void deadline_set(struct deadline *dl, uint32_t us)
+{
+	dl->start = timer_cycles();
+	dl->cycles = us * TIMER_CYCLES_PER_US;
+}
+
+/**
+ * \brief Check whether a time budget is used up.
+ */
+static inline bool deadline_expired(const struct deadline *dl)
+{
+	return (timer_cycles() - dl->start) >= dl->cycles;
+}
+
+#endif
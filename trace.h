@@ -0,0 +1,54 @@
+/**
+ * PDI bus trace files.
+ *
+ * A file header, then a block per PRU command run while tracing: what the
+ * host asked for, the bus events the firmware recorded for it (struct
+ * trace_event, see CMD_TRACE), and what else the replay needs to run the
+ * command again: the stage of CMD_PROGRAM_IMAGE, the words of CMD_SEQUENCE,
+ * the time budgets in force after CMD_SET_TIMEOUTS.
+ *
+ * Copyright (C) 2015-2017 Toby Churchill Ltd.
+ *
+ * Enric Balletbo Serra <enric.balletbo@collabora.com>
+ *
+ * License
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+#ifndef TRACE_H_INCLUDED
+#define TRACE_H_INCLUDED
+
+#include <stdint.h>
+
+#include "prog.h"
+
+#define TRACE_MAGIC		0x43525450	/* "PTRC" */
+#define TRACE_VERSION		1
+
+struct trace_header {
+	uint32_t magic;
+	uint16_t version;
+	uint16_t event_size;	/* sizeof(struct trace_event) */
+	uint32_t clock_hz;	/* of the event time stamps */
+	uint32_t reserved;
+};
+
+/**
+ * \brief A command, followed by nevents events and extra bytes, the
+ * extra bytes padded to a multiple of 4.
+ */
+struct trace_block {
+	uint32_t cmd;
+	uint32_t arg;
+	uint32_t length;
+	uint32_t slot;
+	int32_t result;
+	uint32_t nevents;
+	uint32_t lost;		/* events overwritten before the host got them */
+	uint32_t extra;		/* bytes */
+};
+
+#endif
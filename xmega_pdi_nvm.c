@@ -38,35 +38,53 @@
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdint.h>
+#include <string.h>
 
 #include "xmega_pdi_nvm.h"
 #include "low_level_pdi.h"
 #include "atxmega16d4_nvm_regs.h"
+#include "timer.h"
+#include "crc16.h"
 
+/* PDI instruction bytes, at the start of data RAM */
+#pragma DATA_SECTION(cmd_buffer, ".pdi_frames")
 uint8_t cmd_buffer[20];
 enum status_code retval;
 
-/* debug */
-volatile register unsigned int __R31;
-/* ----- */
+/**
+ * \brief Time budgets in use, the host may override them.
+ */
+struct xnvm_timeouts xnvm_timeouts = {
+	.byte_us	= XNVM_TIMEOUT_BYTE_US,
+	.nvmen_us	= XNVM_TIMEOUT_NVMEN_US,
+	.busy_us	= XNVM_TIMEOUT_BUSY_US,
+	.erase_us	= XNVM_TIMEOUT_ERASE_US,
+};
 
 /* Private prototypes */
 static enum status_code xnvm_read_pdi_status(uint8_t *status);
-static enum status_code xnvm_wait_for_nvmen(uint32_t retries);
+static enum status_code xnvm_wait_for_nvmen(uint32_t timeout_us);
 static enum status_code xnvm_ctrl_read_reg(uint16_t reg, uint8_t *value);
 static enum status_code xnvm_ctrl_write_reg(uint16_t reg, uint8_t value);
 static enum status_code xnvm_st_ptr(uint32_t address);
 static enum status_code xnvm_ctrl_cmd_write(uint8_t cmd_id);
 static enum status_code xnvm_ctrl_read_status(uint8_t *value);
-static enum status_code xnvm_erase_flash_buffer(uint32_t retries);
+static enum status_code xnvm_erase_flash_buffer(uint32_t timeout_us);
 static enum status_code xnvm_load_flash_page_buffer(uint32_t addr, uint8_t *buf, uint16_t len);
 static enum status_code xnvm_st_ptr(uint32_t address);
 static enum status_code xnvm_st_star_ptr_postinc(uint8_t value);
 static enum status_code xnvm_write_repeat(uint32_t count);
-static enum status_code xnvm_ctrl_wait_nvmbusy(uint32_t retries);
+static enum status_code xnvm_ctrl_wait_nvmbusy(uint32_t timeout_us);
 static enum status_code xnvm_ctrl_cmdex_write(void);
-static enum status_code xnvm_erase_eeprom_buffer(uint32_t retries);
+static enum status_code xnvm_erase_eeprom_buffer(uint32_t timeout_us);
 static enum status_code xnvm_load_eeprom_page_buffer(uint32_t addr, uint8_t *buf, uint16_t len);
+static enum status_code xnvm_enable_nvm(void);
+static enum status_code xnvm_confirm(void);
+static bool xnvm_retry(unsigned int *attempt);
+static enum status_code xnvm_start_flash_page(uint32_t address, uint8_t *dat_buf, uint16_t length, bool erase);
+static enum status_code xnvm_erase_at(uint8_t cmd_id, uint32_t address, uint32_t timeout_us);
+static uint16_t xnvm_read_memory_once(uint32_t address, uint8_t *data, uint16_t length);
+static uint16_t xnvm_ld_burst(uint32_t address, uint8_t *data, uint16_t length);
 /*********************/
 
 /**
@@ -83,11 +101,37 @@ enum status_code xnvm_init (void)
 	/* Enable PDI Hardware Interface */
 	pdi_init();
 
+	return xnvm_attach();
+}
+
+/**
+ * \brief Open the NVM interface of a target whose PDI is enabled.
+ *
+ * xnvm_init() for a channel pdi_init() enabled along with another one.
+ *
+ * \retval STATUS_OK init ok
+ * \retval ERR_TIMEOUT the init timed out
+ */
+enum status_code xnvm_attach(void)
+{
 	/* Put the device in reset mode */
 	retval = xnvm_put_dev_in_reset();
 	if (retval)
 		return retval;
 
+	return xnvm_enable_nvm();
+}
+
+/**
+ *  \internal
+ *  \brief Send the NVM key and wait for the NVM interface to come up.
+ *
+ *  \retval STATUS_OK the NVMEN was set successfully.
+ *  \retval ERR_BAD_DATA One of the bytes sent was corrupted during transmission.
+ *  \retval ERR_TIMEOUT Time out.
+ */
+static enum status_code xnvm_enable_nvm(void)
+{
 	/* Create the key command */
 	cmd_buffer[0] = XNVM_PDI_KEY_INSTR;
 	cmd_buffer[1] = NVM_KEY_BYTE0;
@@ -104,11 +148,80 @@ enum status_code xnvm_init (void)
 		return retval;
 
 	/* Wait until the NVM bus becomes active */
-	retval = xnvm_wait_for_nvmen(WAIT_RETRIES_NUM);
+	retval = xnvm_wait_for_nvmen(xnvm_timeouts.nvmen_us);
 
 	return retval;
 }
 
+/**
+ *  \internal
+ *  \brief Recover from a failed instruction group and decide whether to retry it.
+ *
+ *  A glitch on the line leaves the PDI in its error state, ignoring
+ *  everything until a BREAK. A BREAK brings it back without touching the
+ *  NVM interface, so only if NVMEN dropped meanwhile the key is sent again.
+ *  The reset and the key window of xnvm_init() are never repeated.
+ *
+ *  \param  attempt the attempts made so far, updated.
+ *  \retval true the PDI is back in sync, retry the group.
+ *  \retval false give up, the group error stands.
+ */
+static bool xnvm_retry(unsigned int *attempt)
+{
+	uint8_t pdi_status;
+
+	if (++(*attempt) >= XNVM_ATTEMPTS)
+		return false;
+
+	pdi_metrics.retries++;
+	pdi_send_break();
+
+	if (xnvm_read_pdi_status(&pdi_status) == STATUS_OK &&
+	    (pdi_status & XNVM_NVMEN) != 0)
+		return true;
+
+	return xnvm_enable_nvm() == STATUS_OK;
+}
+
+/**
+ *  \internal
+ *  \brief Check that the PDI took a write-only instruction group.
+ *
+ *  The PDI drops everything following a corrupted frame, so a group that
+ *  got lost shows up as an unanswered status read, or as NVMEN gone.
+ *
+ *  \retval STATUS_OK the group went through.
+ *  \retval ERR_PROTOCOL NVMEN is not set.
+ *  \retval ERR_TIMEOUT Time out.
+ */
+static enum status_code xnvm_confirm(void)
+{
+	enum status_code ret;
+	uint8_t pdi_status;
+
+	ret = xnvm_read_pdi_status(&pdi_status);
+	if (ret != STATUS_OK)
+		return ret;
+
+	return (pdi_status & XNVM_NVMEN) ? STATUS_OK : ERR_PROTOCOL;
+}
+
+/**
+ * \brief Check that a target answers on an enabled PDI.
+ *
+ * A single read of the PDI STATUS register, nothing is written.
+ *
+ * \retval STATUS_OK a target answered.
+ * \retval ERR_BAD_DATA the answer was corrupted.
+ * \retval ERR_TIMEOUT nobody answered.
+ */
+enum status_code xnvm_probe(void)
+{
+	uint8_t pdi_status;
+
+	return xnvm_read_pdi_status(&pdi_status);
+}
+
 /**
  * \brief Function for putting the device into reset
  *
@@ -147,24 +260,27 @@ enum status_code xnvm_pull_dev_out_of_reset (void)
  *  \internal
  *  \brief Wait until the NVM module has completed initialization
  *
- *  \param  retries the retry count.
+ *  \param  timeout_us the time budget, in microseconds.
  *  \retval STATUS_OK the NVMEN was set successfully.
  *  \retval ERR_BAD_DATA One of the bytes sent was corrupted during transmission.
  *  \retval ERR_TIMEOUT Time out.
  */
-static enum status_code xnvm_wait_for_nvmen(uint32_t retries)
+static enum status_code xnvm_wait_for_nvmen(uint32_t timeout_us)
 {
+	struct deadline dl;
 	uint8_t pdi_status;
 
-	while (retries != 0) {
+	deadline_set(&dl, timeout_us);
+
+	do {
 		if (xnvm_read_pdi_status(&pdi_status) != STATUS_OK) {
 				return ERR_BAD_DATA;
 		}
 		if ((pdi_status & XNVM_NVMEN) != 0) {
 				return STATUS_OK;
 		}
-		--retries;
-	}
+	} while (!deadline_expired(&dl));
+
 	return ERR_TIMEOUT;
 
 }
@@ -186,8 +302,8 @@ static enum status_code xnvm_read_pdi_status(uint8_t *status)
 	if (STATUS_OK != pdi_write(cmd_buffer, 1)) {
 			ret = ERR_BAD_DATA;
 	}
-	if (pdi_get_byte(status, WAIT_RETRIES_NUM) != STATUS_OK) {
-			ret = ERR_TIMEOUT;
+	if (ret == STATUS_OK) {
+			ret = pdi_get_byte(status, xnvm_timeouts.byte_us);
 	}
 
 	return ret;
@@ -206,16 +322,20 @@ enum status_code xnvm_ioread_byte(uint16_t address, uint8_t *value)
 {
 	enum status_code ret = STATUS_OK;
 	uint32_t register_address;
-
-	cmd_buffer[0] = XNVM_PDI_LDS_INSTR | XNVM_PDI_LONG_ADDRESS_MASK |
-			XNVM_PDI_BYTE_DATA_MASK;
+	unsigned int attempt = 0;
 
 	register_address = XNVM_DATA_BASE + address;
 
-	mem_move((uint8_t*)&register_address, (cmd_buffer + 1), 4);
+	do {
+		cmd_buffer[0] = XNVM_PDI_LDS_INSTR | XNVM_PDI_LONG_ADDRESS_MASK |
+				XNVM_PDI_BYTE_DATA_MASK;
 
-	ret = pdi_write(cmd_buffer, 5);
-	ret = pdi_get_byte(value, WAIT_RETRIES_NUM);
+		mem_move((uint8_t*)&register_address, (cmd_buffer + 1), 4);
+
+		ret = pdi_write(cmd_buffer, 5);
+		if (ret == STATUS_OK)
+			ret = pdi_get_byte(value, xnvm_timeouts.byte_us);
+	} while (ret != STATUS_OK && xnvm_retry(&attempt));
 
 	return ret;
 }
@@ -322,6 +442,10 @@ static enum status_code xnvm_ctrl_cmd_write(uint8_t cmd_id)
 /**
  *  \brief Erase the chip
  *
+ *  NVMEN drops for as long as the chip erase runs, so the group cannot be
+ *  confirmed like the other erases; a lost CMDEX shows up as a timeout of
+ *  the NVMEN wait instead, and is not retried.
+ *
  *  \retval STATUS_OK erase chip succussfully.
  *  \retval ERR_TIMEOUT Time out.
  */
@@ -331,7 +455,126 @@ enum status_code xnvm_chip_erase(void)
 	xnvm_ctrl_cmd_write(XNVM_CMD_CHIP_ERASE);
 	/* Write the CMDEX to execute command */
 	xnvm_ctrl_cmdex_write();
-	return xnvm_wait_for_nvmen(WAIT_RETRIES_NUM);
+
+	return xnvm_wait_for_nvmen(xnvm_timeouts.erase_us);
+}
+
+/**
+ *  \internal
+ *  \brief Run an erase command started by a dummy write into the area.
+ *
+ *  \param  cmd_id the NVM erase command.
+ *  \param  address any address inside the area.
+ *  \param  timeout_us time budget for the erase.
+ */
+static enum status_code xnvm_erase_at(uint8_t cmd_id, uint32_t address, uint32_t timeout_us)
+{
+	enum status_code ret;
+	unsigned int attempt = 0;
+
+	do {
+		xnvm_ctrl_cmd_write(cmd_id);
+		xnvm_st_ptr(address);
+		xnvm_st_star_ptr_postinc(DUMMY_BYTE);
+		ret = xnvm_confirm();
+	} while (ret != STATUS_OK && xnvm_retry(&attempt));
+
+	if (ret != STATUS_OK)
+		return ret;
+
+	return xnvm_ctrl_wait_nvmbusy(timeout_us);
+}
+
+/**
+ *  \brief Erase the application section, leaving the boot loader section
+ *  and the EEPROM alone.
+ *
+ *  \retval STATUS_OK erase succussfully.
+ *  \retval ERR_TIMEOUT Time out.
+ */
+enum status_code xnvm_erase_app_section(void)
+{
+	return xnvm_erase_at(XNVM_CMD_ERASE_APP_SECTION, XNVM_APPL_BASE,
+			     xnvm_timeouts.erase_us);
+}
+
+/**
+ *  \brief Erase the boot loader section.
+ *
+ *  \retval STATUS_OK erase succussfully.
+ *  \retval ERR_TIMEOUT Time out.
+ */
+enum status_code xnvm_erase_boot_section(void)
+{
+	return xnvm_erase_at(XNVM_CMD_ERASE_BOOT_SECTION, XNVM_BOOT_BASE,
+			     xnvm_timeouts.erase_us);
+}
+
+/**
+ *  \brief Erase the whole EEPROM.
+ *
+ *  \retval STATUS_OK erase succussfully.
+ *  \retval ERR_TIMEOUT Time out.
+ */
+enum status_code xnvm_erase_eeprom(void)
+{
+	enum status_code ret;
+	unsigned int attempt = 0;
+
+	do {
+		xnvm_ctrl_cmd_write(XNVM_CMD_ERASE_EEPROM);
+		xnvm_ctrl_cmdex_write();
+		ret = xnvm_confirm();
+	} while (ret != STATUS_OK && xnvm_retry(&attempt));
+
+	if (ret != STATUS_OK)
+		return ret;
+
+	return xnvm_ctrl_wait_nvmbusy(xnvm_timeouts.erase_us);
+}
+
+/**
+ *  \brief Let the NVM controller compute the CRC of a flash section.
+ *
+ *  The 24-bit result is read back from the NVM DATA registers. An erased
+ *  section always gives the same value, so comparing against it is a
+ *  blank check that costs a handful of PDI frames.
+ *
+ *  \param  boot the boot loader section instead of the application one.
+ *  \param  crc the CRC.
+ *  \retval STATUS_OK CRC read.
+ *  \retval ERR_TIMEOUT Time out.
+ */
+enum status_code xnvm_section_crc(bool boot, uint32_t *crc)
+{
+	enum status_code ret;
+	unsigned int attempt = 0;
+	uint8_t value;
+	int i;
+
+	do {
+		xnvm_ctrl_cmd_write(boot ? XNVM_CMD_CALC_CRC_BOOT_SECTION :
+				    XNVM_CMD_CALC_CRC_APP_SECTION);
+		xnvm_ctrl_cmdex_write();
+		ret = xnvm_confirm();
+	} while (ret != STATUS_OK && xnvm_retry(&attempt));
+
+	if (ret != STATUS_OK)
+		return ret;
+
+	ret = xnvm_ctrl_wait_nvmbusy(xnvm_timeouts.erase_us);
+	if (ret != STATUS_OK)
+		return ret;
+
+	*crc = 0;
+	for (i = 2; i >= 0; i--) {
+		ret = xnvm_ctrl_read_reg(XNVM_CONTROLLER_DATA_REG_OFFSET + i, &value);
+		if (ret != STATUS_OK)
+			return ret;
+		*crc = (*crc << 8) | value;
+	}
+
+	return STATUS_OK;
 }
 
 /**
@@ -371,17 +614,17 @@ static enum status_code xnvm_load_flash_page_buffer(uint32_t addr, uint8_t *buf,
  *  \internal
  *  \brief Erase the flash buffer with NVM controller.
  *
- *  \param  retries the time out delay number.
+ *  \param  timeout_us the time budget, in microseconds.
  *  \retval STATUS_OK erase successfully.
  *  \retval ERR_TIMEOUT Time out.
  */
-static enum status_code xnvm_erase_flash_buffer(uint32_t retries)
+static enum status_code xnvm_erase_flash_buffer(uint32_t timeout_us)
 {
 	xnvm_st_ptr(0);
 	xnvm_ctrl_cmd_write(XNVM_CMD_ERASE_FLASH_PAGE_BUFFER);
 	xnvm_ctrl_cmdex_write();
 
-	return xnvm_ctrl_wait_nvmbusy(retries);
+	return xnvm_ctrl_wait_nvmbusy(timeout_us);
 }
 
 /**
@@ -396,17 +639,157 @@ static enum status_code xnvm_erase_flash_buffer(uint32_t retries)
  */
 enum status_code xnvm_erase_program_flash_page(uint32_t address, uint8_t *dat_buf, uint16_t length)
 {
+	xnvm_start_erase_program_flash_page(address, dat_buf, length);
+
+	return xnvm_wait_flash_page();
+}
+
+/**
+ *  \brief Load a flash page and start the erase and write command.
+ *
+ *  Returns as soon as the NVM controller starts the page write, the caller
+ *  is free to do other work before calling xnvm_wait_flash_page().
+ *
+ *  \param  address the address of the flash.
+ *  \param  dat_buf the pointer which points to the data buffer.
+ *  \param  length the data length.
+ *  \retval STATUS_OK command started.
+ *  \retval ERR_TIMEOUT Time out.
+ */
+enum status_code xnvm_start_erase_program_flash_page(uint32_t address, uint8_t *dat_buf, uint16_t length)
+{
+	return xnvm_start_flash_page(address, dat_buf, length, true);
+}
+
+/**
+ *  \brief Load a flash page and start the write command, without erasing.
+ *
+ *  Only valid on a page that is known to be erased. Completes with
+ *  xnvm_wait_flash_page().
+ *
+ *  \param  address the address of the flash.
+ *  \param  dat_buf the pointer which points to the data buffer.
+ *  \param  length the data length.
+ *  \retval STATUS_OK command started.
+ *  \retval ERR_TIMEOUT Time out.
+ */
+enum status_code xnvm_start_program_flash_page(uint32_t address, uint8_t *dat_buf, uint16_t length)
+{
+	return xnvm_start_flash_page(address, dat_buf, length, false);
+}
+
+/**
+ *  \internal
+ *  \brief Load a flash page and start its write.
+ *
+ *  The application and boot loader sections have their own page commands,
+ *  the one matching the address is used.
+ */
+static enum status_code xnvm_start_flash_page(uint32_t address, uint8_t *dat_buf, uint16_t length, bool erase)
+{
+	enum status_code ret;
+	unsigned int attempt = 0;
+	uint8_t cmd_id;
+
+	if (address >= XNVM_APPL_SIZE)
+		cmd_id = erase ? XNVM_CMD_ERASE_AND_WRITE_BOOT_PAGE :
+			XNVM_CMD_WRITE_BOOT_PAGE;
+	else
+		cmd_id = erase ? XNVM_CMD_ERASE_AND_WRITE_APP_SECTION :
+			XNVM_CMD_WRITE_APP_SECTION;
+
 	address = address + XNVM_FLASH_BASE;
 
-	xnvm_erase_flash_buffer(WAIT_RETRIES_NUM);
-	xnvm_load_flash_page_buffer(address, dat_buf, length);
-	xnvm_ctrl_cmd_write(XNVM_CMD_ERASE_AND_WRITE_APP_SECTION);
+	do {
+		ret = xnvm_erase_flash_buffer(xnvm_timeouts.busy_us);
+		if (ret != STATUS_OK)
+			continue;
 
-	/* Dummy write for starting the erase and write command */
-	xnvm_st_ptr(address);
-	xnvm_st_star_ptr_postinc(DUMMY_BYTE);
+		xnvm_load_flash_page_buffer(address, dat_buf, length);
+		xnvm_ctrl_cmd_write(cmd_id);
 
-	return xnvm_ctrl_wait_nvmbusy(WAIT_RETRIES_NUM);
+		/* Dummy write for starting the erase and write command */
+		xnvm_st_ptr(address);
+		xnvm_st_star_ptr_postinc(DUMMY_BYTE);
+
+		ret = xnvm_confirm();
+	} while (ret != STATUS_OK && xnvm_retry(&attempt));
+
+	return ret;
+}
+
+/**
+ *  \brief Start erasing a single flash page.
+ *
+ *  Completes with xnvm_wait_flash_page().
+ *
+ *  \param  address the address of the flash.
+ *  \retval STATUS_OK command started.
+ *  \retval ERR_TIMEOUT Time out.
+ */
+enum status_code xnvm_start_erase_flash_page(uint32_t address)
+{
+	enum status_code ret;
+	unsigned int attempt = 0;
+	uint8_t cmd_id;
+
+	cmd_id = address >= XNVM_APPL_SIZE ? XNVM_CMD_ERASE_BOOT_PAGE :
+		XNVM_CMD_ERASE_APP_PAGE;
+	address = address + XNVM_FLASH_BASE;
+
+	do {
+		xnvm_ctrl_cmd_write(cmd_id);
+
+		/* Dummy write into the page starts the erase */
+		xnvm_st_ptr(address);
+		xnvm_st_star_ptr_postinc(DUMMY_BYTE);
+
+		ret = xnvm_confirm();
+	} while (ret != STATUS_OK && xnvm_retry(&attempt));
+
+	return ret;
+}
+
+/**
+ *  \brief Wait for a page erase or write started with one of the
+ *  xnvm_start_*_flash_page() functions to complete.
+ *
+ *  \retval STATUS_OK program succussfully.
+ *  \retval ERR_TIMEOUT Time out.
+ */
+enum status_code xnvm_wait_flash_page(void)
+{
+	return xnvm_ctrl_wait_nvmbusy(xnvm_timeouts.busy_us);
+}
+
+/**
+ *  \brief Check once whether a page erase or write started with one of the
+ *  xnvm_start_*_flash_page() functions completed.
+ *
+ *  Lets the caller serve another target between two checks, rather than
+ *  spin in xnvm_wait_flash_page().
+ *
+ *  \param  dl the time budget, set when the page was started.
+ *  \retval STATUS_OK the page is done.
+ *  \retval ERR_BUSY the NVM controller is still busy.
+ *  \retval ERR_TIMEOUT Time out.
+ */
+enum status_code xnvm_poll_flash_page(const struct deadline *dl)
+{
+	enum status_code ret;
+	uint8_t status;
+
+	pdi_metrics.busy_polls++;
+	ret = xnvm_ctrl_read_status(&status);
+	if (ret != STATUS_OK)
+		return ret;
+
+	if ((status & XNVM_NVM_BUSY) == 0) {
+		pdi_metrics.busy_cycles += timer_cycles() - dl->start;
+		return STATUS_OK;
+	}
+
+	return deadline_expired(dl) ? ERR_TIMEOUT : ERR_BUSY;
 }
 
 /**
@@ -489,8 +872,60 @@ static enum status_code xnvm_st_ptr(uint32_t address)
  *  \retval zero read fail.
  */
 uint16_t xnvm_read_memory(uint32_t address, uint8_t *data, uint16_t length)
+{
+	unsigned int attempt = 0;
+	uint16_t ret;
+
+	do {
+		ret = xnvm_read_memory_once(address, data, length);
+	} while (ret == 0 && xnvm_retry(&attempt));
+
+	return ret;
+}
+
+/**
+ *  \brief Read the memory once, without retrying.
+ *
+ *  For measuring the link: a failed read is reported as it is, and the
+ *  PDI brought back in sync for the next one.
+ *
+ *  \param  address the address of the memory.
+ *  \param  data the pointer which points to the data buffer.
+ *  \param  length the data length.
+ *  \retval non-zero the length of data.
+ *  \retval zero read fail.
+ */
+uint16_t xnvm_probe_memory(uint32_t address, uint8_t *data, uint16_t length)
+{
+	unsigned int attempt = 0;
+	uint16_t ret;
+
+	ret = xnvm_read_memory_once(address, data, length);
+	if (ret == 0)
+		xnvm_retry(&attempt);
+
+	return ret;
+}
+
+/**
+ *  \internal
+ *  \brief One READ_NVM_PDI burst of length bytes from address on.
+ */
+static uint16_t xnvm_read_memory_once(uint32_t address, uint8_t *data,
+				      uint16_t length)
 {
 	xnvm_ctrl_cmd_write(XNVM_CMD_READ_NVM_PDI);
+
+	return xnvm_ld_burst(address, data, length);
+}
+
+/**
+ *  \internal
+ *  \brief Set the pointer, then read length bytes with one REPEAT burst.
+ */
+static uint16_t xnvm_ld_burst(uint32_t address, uint8_t *data,
+			      uint16_t length)
+{
 	xnvm_st_ptr(address);
 
 	if (length > 1) {
@@ -501,7 +936,74 @@ uint16_t xnvm_read_memory(uint32_t address, uint8_t *data, uint16_t length)
 			XNVM_PDI_BYTE_DATA_MASK;
 	pdi_write(cmd_buffer, 1);
 
-	return pdi_read(data, length, WAIT_RETRIES_NUM);
+	return pdi_read(data, length, xnvm_timeouts.byte_us);
+}
+
+/**
+ *  \brief Read a range of the data space (SRAM, I/O registers).
+ *
+ *  One pointer set and one REPEAT burst, however long the range. The data
+ *  space is not behind the NVM controller, its command is left alone.
+ *  Reading an I/O register can clear flags or pop a FIFO, so a failed
+ *  burst is only sent again when the range lies wholly in the SRAM.
+ *
+ *  \param  address the data space address.
+ *  \param  data the pointer which points to the data buffer.
+ *  \param  length the data length.
+ *  \retval non-zero the read byte length.
+ *  \retval zero read fail.
+ */
+uint16_t xnvm_read_data(uint16_t address, uint8_t *data, uint16_t length)
+{
+	unsigned int attempt = 0;
+	bool sram;
+	uint16_t ret;
+
+	sram = address >= XNVM_SRAM_START &&
+	       address - XNVM_SRAM_START < XNVM_SRAM_SIZE &&
+	       length <= XNVM_SRAM_SIZE - (address - XNVM_SRAM_START);
+
+	ret = xnvm_ld_burst(XNVM_DATA_BASE + address, data, length);
+	if (ret == 0 && !sram) {
+		xnvm_retry(&attempt);
+		return 0;
+	}
+
+	while (ret == 0 && xnvm_retry(&attempt))
+		ret = xnvm_ld_burst(XNVM_DATA_BASE + address, data, length);
+
+	return ret;
+}
+
+/**
+ *  \brief Write a range of the data space (SRAM, I/O registers).
+ *
+ *  One pointer set and one REPEAT burst, however long the range. Like
+ *  xnvm_iowrite_byte(), nothing is read back: a write to a register with
+ *  side effects must not be sent twice.
+ *
+ *  \param  address the data space address.
+ *  \param  data the pointer which points to the data buffer.
+ *  \param  length the data length.
+ *  \retval STATUS_OK write succussfully.
+ *  \retval ERR_INVALID_ARG Invalid argument.
+ */
+enum status_code xnvm_write_data(uint16_t address, const uint8_t *data,
+				 uint16_t length)
+{
+	if (data == NULL || length == 0)
+		return ERR_INVALID_ARG;
+
+	xnvm_st_ptr(XNVM_DATA_BASE + address);
+
+	if (length > 1)
+		xnvm_write_repeat(length);
+
+	cmd_buffer[0] = XNVM_PDI_ST_INSTR | XNVM_PDI_LD_PTR_STAR_INC_MASK |
+			XNVM_PDI_BYTE_DATA_MASK;
+	pdi_write(cmd_buffer, 1);
+
+	return pdi_write(data, length);
 }
 
 /**
@@ -516,28 +1018,41 @@ uint16_t xnvm_read_memory(uint32_t address, uint8_t *data, uint16_t length)
  */
 enum status_code xnvm_erase_program_eeprom_page(uint32_t address, uint8_t *dat_buf, uint16_t length)
 {
+	enum status_code ret;
+	unsigned int attempt = 0;
+
 	address = address + XNVM_EEPROM_BASE;
 
-	xnvm_erase_eeprom_buffer(WAIT_RETRIES_NUM);
-	xnvm_load_eeprom_page_buffer(address, dat_buf, length);
-	xnvm_ctrl_cmd_write(XNVM_CMD_ERASE_AND_WRITE_EEPROM);
+	do {
+		ret = xnvm_erase_eeprom_buffer(xnvm_timeouts.busy_us);
+		if (ret != STATUS_OK)
+			continue;
 
-	/* Dummy write for starting the erase and write command */
-	xnvm_st_ptr(address);
-	xnvm_st_star_ptr_postinc(DUMMY_BYTE);
+		xnvm_load_eeprom_page_buffer(address, dat_buf, length);
+		xnvm_ctrl_cmd_write(XNVM_CMD_ERASE_AND_WRITE_EEPROM);
+
+		/* Dummy write for starting the erase and write command */
+		xnvm_st_ptr(address);
+		xnvm_st_star_ptr_postinc(DUMMY_BYTE);
+
+		ret = xnvm_confirm();
+	} while (ret != STATUS_OK && xnvm_retry(&attempt));
 
-	return xnvm_ctrl_wait_nvmbusy(WAIT_RETRIES_NUM);
+	if (ret != STATUS_OK)
+		return ret;
+
+	return xnvm_ctrl_wait_nvmbusy(xnvm_timeouts.busy_us);
 }
 
 /**
  *  \internal
  *  \brief Erase the eeprom buffer with NVM controller.
  *
- *  \param  retries the time out delay number.
+ *  \param  timeout_us the time budget, in microseconds.
  *  \retval STATUS_OK erase succussfully.
  *  \retval ERR_TIMEOUT Time out.
  */
-static enum status_code xnvm_erase_eeprom_buffer(uint32_t retries)
+static enum status_code xnvm_erase_eeprom_buffer(uint32_t timeout_us)
 {
 	xnvm_st_ptr(0);
 	xnvm_ctrl_cmd_write(XNVM_CMD_ERASE_EEPROM_PAGE_BUFFER);
@@ -545,7 +1060,7 @@ static enum status_code xnvm_erase_eeprom_buffer(uint32_t retries)
 	/* Execute command by setting CMDEX */
 	xnvm_ctrl_cmdex_write();
 
-	return xnvm_ctrl_wait_nvmbusy(retries);
+	return xnvm_ctrl_wait_nvmbusy(timeout_us);
 }
 
 /**
@@ -597,7 +1112,7 @@ enum status_code xnvm_erase_user_sign(void)
 	xnvm_st_ptr(XNVM_SIGNATURE_BASE);
 	xnvm_st_star_ptr_postinc(DUMMY_BYTE);
 
-	return xnvm_ctrl_wait_nvmbusy(WAIT_RETRIES_NUM);
+	return xnvm_ctrl_wait_nvmbusy(xnvm_timeouts.busy_us);
 }
 
 /**
@@ -614,7 +1129,7 @@ enum status_code xnvm_erase_program_user_sign(uint32_t address, uint8_t *dat_buf
 {
 	address = address + XNVM_SIGNATURE_BASE;
 
-	xnvm_erase_flash_buffer(WAIT_RETRIES_NUM);
+	xnvm_erase_flash_buffer(xnvm_timeouts.busy_us);
 	xnvm_load_flash_page_buffer(address, dat_buf, length);
 	xnvm_erase_user_sign();
 	xnvm_ctrl_cmd_write(XNVM_CMD_WRITE_USER_SIGN);
@@ -623,7 +1138,7 @@ enum status_code xnvm_erase_program_user_sign(uint32_t address, uint8_t *dat_buf
 	xnvm_st_ptr(address);
 	xnvm_st_star_ptr_postinc(DUMMY_BYTE);
 
-	return xnvm_ctrl_wait_nvmbusy(WAIT_RETRIES_NUM);
+	return xnvm_ctrl_wait_nvmbusy(xnvm_timeouts.busy_us);
 }
 
 /**
@@ -631,11 +1146,11 @@ enum status_code xnvm_erase_program_user_sign(uint32_t address, uint8_t *dat_buf
  *
  *  \param  address the fuse bit address.
  *  \param  value which should be write into the fuse bit.
- *  \param  retries the time out delay number.
+ *  \param  timeout_us the time budget, in microseconds.
  *  \retval STATUS_OK write succussfully.
  *  \retval ERR_TIMEOUT time out.
  */
-enum status_code xnvm_write_fuse_bit(uint32_t address, uint8_t value, uint32_t retries)
+enum status_code xnvm_write_fuse_bit(uint32_t address, uint8_t value, uint32_t timeout_us)
 {
 	uint32_t register_address;
 
@@ -651,31 +1166,43 @@ enum status_code xnvm_write_fuse_bit(uint32_t address, uint8_t value, uint32_t r
 
 	pdi_write(cmd_buffer, 6);
 
-	return xnvm_ctrl_wait_nvmbusy(retries);
+	return xnvm_ctrl_wait_nvmbusy(timeout_us);
 }
 
 /**
  *  \internal
  *  \brief Wait until the NVM Controller is ready.
  *
- *  \param  retries the retry count.
+ *  \param  timeout_us the time budget, in microseconds.
  *  \retval STATUS_OK BUSY bit was set.
  *  \retval ERR_TIMEOUT Time out.
  */
-static enum status_code xnvm_ctrl_wait_nvmbusy(uint32_t retries)
+static enum status_code xnvm_ctrl_wait_nvmbusy(uint32_t timeout_us)
 {
+	struct deadline dl;
+	enum status_code ret;
 	uint8_t status;
 
-	while (retries != 0) {
-			xnvm_ctrl_read_status(&status);
+	deadline_set(&dl, timeout_us);
+
+	do {
+			/* A target that does not answer will not become ready */
+			pdi_metrics.busy_polls++;
+			ret = xnvm_ctrl_read_status(&status);
+			if (ret != STATUS_OK)
+					break;
 
 			/* Check if the NVMBUSY bit is clear in the NVM_STATUS register. */
-			if ((status & XNVM_NVM_BUSY) == 0) {
-					return STATUS_OK;
-			}
-			--retries;
-	}
-	return ERR_TIMEOUT;
+			if ((status & XNVM_NVM_BUSY) == 0)
+					break;
+	} while (!deadline_expired(&dl));
+
+	pdi_metrics.busy_cycles += timer_cycles() - dl.start;
+
+	if (ret == STATUS_OK && (status & XNVM_NVM_BUSY))
+			return ERR_TIMEOUT;
+
+	return ret;
 }
 
 /**
@@ -689,3 +1216,267 @@ enum status_code xnvm_deinit(void)
 	return STATUS_OK;
 }
 
+
+/**
+ * \brief Copy a staged page into a page buffer.
+ *
+ * Word by word, which is how the PRU reads DDR fastest.
+ *
+ * \retval STATUS_OK the page arrived intact.
+ * \retval ERR_BAD_DATA the page CRC does not match the page map.
+ */
+enum status_code xnvm_stage_fetch(const struct stage_header *stage,
+				  const struct stage_page *page, uint8_t *buf)
+{
+	const uint32_t *src;
+	uint32_t *dst = (uint32_t *)buf;
+	int i;
+
+	src = (const uint32_t *)((const uint8_t *)stage + page->offset);
+	for (i = 0; i < XNVM_FLASH_PAGE_SIZE / 4; i++)
+		dst[i] = src[i];
+
+	if (crc16_update(CRC16_INIT, buf, XNVM_FLASH_PAGE_SIZE) != page->crc)
+		return ERR_BAD_DATA;
+
+	return STATUS_OK;
+}
+
+/**
+ * \brief Index past the last page of a run of count pages from first on,
+ * 0 for the rest of the map.
+ */
+uint32_t xnvm_stage_end(const struct stage_header *stage, uint32_t first,
+			uint32_t count)
+{
+	if (count && count < stage->npages - first)
+		return first + count;
+
+	return stage->npages;
+}
+
+/**
+ * \internal
+ * \brief Index of the first page from i on that carries a payload.
+ */
+static uint32_t xnvm_next_payload(const struct stage_page *map, uint32_t i,
+				  uint32_t npages)
+{
+	while (i < npages && (map[i].flags & STAGE_PAGE_ERASE))
+		i++;
+
+	return i;
+}
+
+/**
+ * \brief Program the pages of a staged image, from first on.
+ *
+ * The next page is fetched while the target is busy writing the current
+ * one, so the stage latency never shows up on the wire.
+ *
+ * \param stage the stage header, see CMD_PROGRAM_IMAGE.
+ * \param first index of the first page to program.
+ * \param count pages to program, 0 for the rest of the map.
+ * \param buf two page buffers.
+ * \param stop tells to stop after the page in flight, or NULL.
+ * \param done index of the first page not programmed.
+ */
+enum status_code xnvm_program_stage(const struct stage_header *stage,
+				    uint32_t first, uint32_t count,
+				    uint8_t (*buf)[XNVM_FLASH_PAGE_SIZE],
+				    bool (*stop)(void), uint32_t *done)
+{
+	const struct stage_page *map;
+	enum status_code ret, next_ret = STATUS_OK;
+	uint8_t *cur = buf[0], *next = buf[1], *tmp;
+	uint32_t i, end, next_page;
+
+	*done = first;
+
+	if (stage->magic != STAGE_MAGIC ||
+	    stage->page_size != XNVM_FLASH_PAGE_SIZE)
+		return ERR_BAD_FORMAT;
+
+	if (first > stage->npages)
+		return ERR_INVALID_ARG;
+
+	end = xnvm_stage_end(stage, first, count);
+	map = (const struct stage_page *)((const uint8_t *)stage +
+					  stage->map_offset);
+
+	i = xnvm_next_payload(map, first, end);
+	if (i < end) {
+		ret = xnvm_stage_fetch(stage, &map[i], cur);
+		if (ret)
+			return ret;
+	}
+
+	for (i = first; i < end; i++) {
+		if (i > first && stop && stop())
+			return ERR_FLUSHED;
+
+		if (map[i].flags & STAGE_PAGE_ERASE) {
+			ret = xnvm_start_erase_flash_page(map[i].address);
+			if (ret == STATUS_OK)
+				ret = xnvm_wait_flash_page();
+			if (ret)
+				return ret;
+			pdi_metrics.pages_erased++;
+			*done = i + 1;
+			continue;
+		}
+
+		if (map[i].flags & STAGE_PAGE_WRITE)
+			ret = xnvm_start_program_flash_page(map[i].address,
+							    cur,
+							    XNVM_FLASH_PAGE_SIZE);
+		else
+			ret = xnvm_start_erase_program_flash_page(
+				map[i].address, cur, XNVM_FLASH_PAGE_SIZE);
+		if (ret)
+			return ret;
+
+		next_page = xnvm_next_payload(map, i + 1, end);
+		if (next_page < end)
+			next_ret = xnvm_stage_fetch(stage, &map[next_page],
+						    next);
+
+		ret = xnvm_wait_flash_page();
+		if (ret)
+			return ret;
+		pdi_metrics.pages_written++;
+		*done = i + 1;
+
+		if (next_ret)
+			return next_ret;
+
+		tmp = cur;
+		cur = next;
+		next = tmp;
+	}
+
+	return STATUS_OK;
+}
+
+/**
+ * \brief Compare the flash with the pages of a staged image.
+ *
+ * Each page is read back with a single burst and compared right here.
+ *
+ * \param stage the stage header, see CMD_VERIFY_IMAGE.
+ * \param first index of the first page to verify.
+ * \param res the verdict, for up to VERIFY_PAGES_MAX pages from first on.
+ * \param buf two page buffers.
+ * \param stop tells to stop before the next page, or NULL.
+ * \param done index of the first page not verified.
+ */
+enum status_code xnvm_verify_stage(const struct stage_header *stage,
+				   uint32_t first, struct verify_result *res,
+				   uint8_t (*buf)[XNVM_FLASH_PAGE_SIZE],
+				   bool (*stop)(void), uint32_t *done)
+{
+	const struct stage_page *map;
+	uint8_t *expect = buf[0], *got = buf[1];
+	enum status_code ret;
+	uint32_t i, j, n, end;
+
+	*done = first;
+	memset(res, 0, sizeof(*res));
+
+	if (stage->magic != STAGE_MAGIC ||
+	    stage->page_size != XNVM_FLASH_PAGE_SIZE)
+		return ERR_BAD_FORMAT;
+
+	if (first > stage->npages)
+		return ERR_INVALID_ARG;
+
+	end = xnvm_stage_end(stage, first, VERIFY_PAGES_MAX);
+	map = (const struct stage_page *)((const uint8_t *)stage +
+					  stage->map_offset);
+
+	for (i = first; i < end; i++) {
+		if (i > first && stop && stop())
+			return ERR_FLUSHED;
+
+		if (map[i].flags & STAGE_PAGE_ERASE) {
+			memset(expect, 0xFF, XNVM_FLASH_PAGE_SIZE);
+		} else {
+			ret = xnvm_stage_fetch(stage, &map[i], expect);
+			if (ret)
+				return ret;
+		}
+
+		if (xnvm_read_memory(XNVM_FLASH_BASE + map[i].address, got,
+				     XNVM_FLASH_PAGE_SIZE) == 0)
+			return ERR_TIMEOUT;
+
+		for (j = 0; j < XNVM_FLASH_PAGE_SIZE && got[j] == expect[j]; j++)
+			;
+
+		n = i - first;
+		if (j < XNVM_FLASH_PAGE_SIZE) {
+			res->bitmap[n / 32] |= 1u << n % 32;
+			res->first[n] = j;
+			res->failed++;
+		}
+		res->pages = n + 1;
+		*done = i + 1;
+	}
+
+	return STATUS_OK;
+}
+
+/**
+ * \brief Write bytes to the EEPROM or to the user signature row.
+ *
+ * EEPROM pages are erased and written in place, only the bytes loaded into
+ * the page buffer are touched. The user signature row is only erased as a
+ * whole, so it is read first and written back with the bytes in it.
+ *
+ * \param address PDI address, in the EEPROM or the user signature row.
+ * \param buf scratch, XNVM_USER_SIGN_SIZE bytes.
+ */
+enum status_code xnvm_write_nvm(uint32_t address, const uint8_t *data,
+				uint32_t length, uint8_t *buf)
+{
+	enum status_code ret;
+	uint32_t offset, n;
+
+	if (address >= XNVM_EEPROM_BASE &&
+	    address - XNVM_EEPROM_BASE < XNVM_EEPROM_SIZE) {
+		offset = address - XNVM_EEPROM_BASE;
+		if (length > XNVM_EEPROM_SIZE - offset)
+			return ERR_BAD_ADDRESS;
+
+		while (length) {
+			n = NVM_EEPROM_PAGE_SIZE - offset % NVM_EEPROM_PAGE_SIZE;
+			if (n > length)
+				n = length;
+			memcpy(buf, data, n);
+			ret = xnvm_erase_program_eeprom_page(offset, buf, n);
+			if (ret)
+				return ret;
+			offset += n;
+			data += n;
+			length -= n;
+		}
+		return STATUS_OK;
+	}
+
+	if (address >= XNVM_SIGNATURE_BASE &&
+	    address - XNVM_SIGNATURE_BASE < XNVM_USER_SIGN_SIZE) {
+		offset = address - XNVM_SIGNATURE_BASE;
+		if (length > XNVM_USER_SIGN_SIZE - offset)
+			return ERR_BAD_ADDRESS;
+
+		if (xnvm_read_memory(XNVM_SIGNATURE_BASE, buf,
+				     XNVM_USER_SIGN_SIZE) == 0)
+			return ERR_TIMEOUT;
+		memcpy(buf + offset, data, length);
+
+		return xnvm_erase_program_user_sign(0, buf,
+						    XNVM_USER_SIGN_SIZE);
+	}
+
+	return ERR_BAD_ADDRESS;
+}
@@ -36,7 +36,16 @@
 #ifndef XMEGA_PDI_NVM_H_
 #define XMEGA_PDI_NVM_H_
 
+#include <stdbool.h>
+#include <stdint.h>
+
 #include "status_codes.h"
+#include "timer.h"
+#include "atxmega16d4_nvm_regs.h"
+
+struct stage_header;
+struct stage_page;
+struct verify_result;
 
 #define XNVM_PDI_LDS_INSTR    0x00 //!< LDS instruction.
 #define XNVM_PDI_STS_INSTR    0x40 //!< STS instruction.
@@ -123,6 +132,18 @@
 #define NVM_KEY_BYTE7 0x12
 
 
+/**
+ * \brief Time budgets of the NVM operations, in microseconds.
+ */
+struct xnvm_timeouts {
+	uint32_t byte_us;	//!< Start of a response byte.
+	uint32_t nvmen_us;	//!< NVM interface enable after KEY.
+	uint32_t busy_us;	//!< Page buffer erase, page erase and write.
+	uint32_t erase_us;	//!< Chip erase.
+};
+
+extern struct xnvm_timeouts xnvm_timeouts;
+
 /**
  * \brief Move bytes in memory from one location to another
  *
@@ -140,16 +161,35 @@ static inline void mem_move(uint8_t * from_var, uint8_t * to_var, uint8_t bytes)
 
 /* Public prototypes */
 enum status_code xnvm_init (void);
+enum status_code xnvm_attach(void);
+enum status_code xnvm_probe(void);
 enum status_code xnvm_ioread_byte(uint16_t address, uint8_t *value);
 enum status_code xnvm_iowrite_byte(uint16_t address, uint8_t value);
 enum status_code xnvm_chip_erase(void);
 uint16_t xnvm_read_memory(uint32_t address, uint8_t *data, uint16_t length);
+uint16_t xnvm_probe_memory(uint32_t address, uint8_t *data, uint16_t length);
+uint16_t xnvm_read_data(uint16_t address, uint8_t *data, uint16_t length);
+enum status_code xnvm_write_data(uint16_t address, const uint8_t *data, uint16_t length);
 enum status_code xnvm_erase_program_flash_page(uint32_t address, uint8_t *dat_buf, uint16_t length);
+enum status_code xnvm_start_erase_program_flash_page(uint32_t address, uint8_t *dat_buf, uint16_t length);
+enum status_code xnvm_start_program_flash_page(uint32_t address, uint8_t *dat_buf, uint16_t length);
+enum status_code xnvm_start_erase_flash_page(uint32_t address);
+enum status_code xnvm_wait_flash_page(void);
+enum status_code xnvm_poll_flash_page(const struct deadline *dl);
 enum status_code xnvm_put_dev_in_reset (void);
 enum status_code xnvm_pull_dev_out_of_reset (void);
+enum status_code xnvm_erase_app_section(void);
+enum status_code xnvm_erase_boot_section(void);
+enum status_code xnvm_erase_eeprom(void);
+enum status_code xnvm_section_crc(bool boot, uint32_t *crc);
 enum status_code xnvm_erase_program_eeprom_page(uint32_t address, uint8_t *dat_buf, uint16_t length);
 enum status_code xnvm_erase_user_sign(void);
 enum status_code xnvm_erase_program_user_sign(uint32_t address, uint8_t *dat_buf, uint16_t length);
-enum status_code xnvm_write_fuse_bit(uint32_t address, uint8_t value, uint32_t retries);
+enum status_code xnvm_write_fuse_bit(uint32_t address, uint8_t value, uint32_t timeout_us);
 enum status_code xnvm_deinit(void);
+enum status_code xnvm_stage_fetch(const struct stage_header *stage, const struct stage_page *page, uint8_t *buf);
+uint32_t xnvm_stage_end(const struct stage_header *stage, uint32_t first, uint32_t count);
+enum status_code xnvm_program_stage(const struct stage_header *stage, uint32_t first, uint32_t count, uint8_t (*buf)[XNVM_FLASH_PAGE_SIZE], bool (*stop)(void), uint32_t *done);
+enum status_code xnvm_verify_stage(const struct stage_header *stage, uint32_t first, struct verify_result *res, uint8_t (*buf)[XNVM_FLASH_PAGE_SIZE], bool (*stop)(void), uint32_t *done);
+enum status_code xnvm_write_nvm(uint32_t address, const uint8_t *data, uint32_t length, uint8_t *buf);
 #endif /* XMEGA_PDI_NVM_H_ */